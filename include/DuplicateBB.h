@@ -10,7 +10,7 @@
 #ifndef LLVM_TUTOR_DUPLICATE_BB_H
 #define LLVM_TUTOR_DUPLICATE_BB_H
 
-#include "RIV.h"
+#include "LazyRIV.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/PassManager.h"
 #include "llvm/IR/ValueMap.h"
@@ -20,6 +20,7 @@
 #include <memory>
 
 namespace llvm {
+class DomTreeUpdater;
 class RandomNumberGenerator;
 } // namespace llvm
 
@@ -41,14 +42,16 @@ struct DuplicateBB : public llvm::PassInfoMixin<DuplicateBB> {
 
   // Creates a BBToSingleRIVMap of BasicBlocks that are suitable for cloning.
   BBToSingleRIVMap findBBsToDuplicate(llvm::Function &F,
-                                      const RIV::Result &RIVResult);
+                                      LazyRIVResult &RIVResult);
 
   // Clones the input basic block:
   //  * injects an `if-then-else` construct using ContextValue
   //  * duplicates BB
   //  * adds PHI nodes as required
+  // If DTU is not null, the dominator tree is updated accordingly.
   void cloneBB(llvm::BasicBlock &BB, llvm::Value *ContextValue,
-               ValueToPhiMap &ReMapper,llvm::Function &F);
+               ValueToPhiMap &ReMapper,llvm::Function &F,
+               llvm::DomTreeUpdater *DTU = nullptr);
 
   unsigned DuplicateBBCount = 0;
 
@@ -0,0 +1,25 @@
+//==============================================================================
+// FILE:
+//    DynamicCCPromote.h
+//
+// DESCRIPTION:
+//    Declares the DynamicCCPromote pass for the new pass manager. It is part of
+//    the DynamicCallCounter plugin.
+//
+// License: MIT
+//==============================================================================
+#ifndef LLVM_TUTOR_DYNAMIC_CC_PROMOTE_H
+#define LLVM_TUTOR_DYNAMIC_CC_PROMOTE_H
+
+#include "llvm/IR/Function.h"
+#include "llvm/IR/PassManager.h"
+
+//------------------------------------------------------------------------------
+// New PM interface
+//------------------------------------------------------------------------------
+struct DynamicCCPromote : public llvm::PassInfoMixin<DynamicCCPromote> {
+  llvm::PreservedAnalyses run(llvm::Function &F,
+                              llvm::FunctionAnalysisManager &FAM);
+};
+
+#endif // LLVM_TUTOR_DYNAMIC_CC_PROMOTE_H
@@ -0,0 +1,63 @@
+//==============================================================================
+// FILE:
+//    DynamicCCRecord.h
+//
+// DESCRIPTION:
+//    Describes the binary record written by modules instrumented with
+//    `dynamic-cc<format=bin>` (at exit) or `dynamic-cc<shm>` (at start-up,
+//    with the counters updated in place). The record is read by the `cc-dump`
+//    tool.
+//
+//    The layout of the record is (all integers in the byte order of the
+//    instrumented program):
+//      * DynamicCCRecordHeader
+//      * function-name table: NumFuncs NUL-terminated strings, ordered by
+//        function ID (NamesSize bytes in total)
+//      * zero padding up to CountersOffset
+//      * the counter array, exactly as laid out in memory by the
+//        instrumented program:
+//          Counter[NumShards][NumFuncs], with counters StrideBytes apart
+//        The call count of a function is the sum over all shards.
+//
+// License: MIT
+//==============================================================================
+#ifndef LLVM_TUTOR_DYNAMIC_CC_RECORD_H
+#define LLVM_TUTOR_DYNAMIC_CC_RECORD_H
+
+#include <cstdint>
+
+struct DynamicCCRecordHeader {
+  // "LTCC" when read as a little-endian integer
+  static constexpr uint32_t MagicValue = 0x43435443;
+  static constexpr uint32_t CurrentVersion = 1;
+  // The counter array starts at a multiple of this (from the beginning of the
+  // record)
+  static constexpr uint32_t CountersAlignment = 64;
+
+  uint32_t Magic;
+  uint32_t Version;
+  // Size of a single counter (4 or 8)
+  uint32_t CounterBytes;
+  uint32_t NumFuncs;
+  uint32_t NumShards;
+  // Distance between the counters of consecutive functions
+  uint32_t StrideBytes;
+  // Size of the function-name table, including the NUL terminators
+  uint32_t NamesSize;
+  // Offset of the counter array from the beginning of the record
+  uint32_t CountersOffset;
+};
+
+static_assert(sizeof(DynamicCCRecordHeader) == 32,
+              "The record header must not contain any padding");
+
+// The environment variable that names the output file. When not set, the
+// record is written to DynamicCCDefaultOutput in the working directory.
+constexpr const char *DynamicCCOutputEnvVar = "LLVM_TUTOR_CC_OUTPUT";
+constexpr const char *DynamicCCDefaultOutput = "dynamic-cc.bin";
+
+// The environment variable that names the file that `dynamic-cc<shm>` maps
+// the record (and hence the live counters) to.
+constexpr const char *DynamicCCSharedMemoryEnvVar = "LLVM_TUTOR_CC_SHM";
+
+#endif // LLVM_TUTOR_DYNAMIC_CC_RECORD_H
@@ -0,0 +1,137 @@
+//==============================================================================
+// FILE:
+//    DynamicCCRuntime.h
+//
+// DESCRIPTION:
+//    Declares the building blocks shared by the call-counting passes
+//    (DynamicCallCounter and MyDynamicCallCounter*): the counter array, the
+//    binary record (see DynamicCCRecord.h) and the printf-based report. The
+//    IR helpers are also used by InjectFuncCallRet.
+//
+// License: MIT
+//==============================================================================
+#ifndef LLVM_TUTOR_DYNAMIC_CC_RUNTIME_H
+#define LLVM_TUTOR_DYNAMIC_CC_RUNTIME_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/STLFunctionalExtras.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Module.h"
+
+class NameTable;
+
+// How the results are reported when the instrumented module exits.
+enum class ReportFormat {
+  // A table printed to stdout with printf
+  Text,
+  // A single binary record written to a file (see DynamicCCRecord.h)
+  Binary
+};
+
+//------------------------------------------------------------------------------
+// Counter layout
+//------------------------------------------------------------------------------
+// Describes the array that holds all the call counters. Conceptually it is:
+//    CounterTy Counters[NumShards][NumFuncs][StrideElems];
+// with only the first element of the innermost dimension in use (the rest is
+// padding).
+struct CounterLayout {
+  llvm::GlobalVariable *Counters = nullptr;
+  // shm mode only - the current address of the counter array. Points to
+  // Counters until the array is moved to shared memory.
+  llvm::GlobalVariable *CountersPtr = nullptr;
+  llvm::IntegerType *CounterTy = nullptr;
+  uint64_t NumFuncs = 0;
+  uint64_t StrideElems = 1;
+  uint64_t NumShards = 1;
+
+  uint64_t getShardElems() const { return NumFuncs * StrideElems; }
+  llvm::Align getCounterAlign() const {
+    return llvm::Align(CounterTy->getBitWidth() / 8);
+  }
+
+  // Returns the address of the counter array
+  llvm::Value *getBase(llvm::IRBuilder<> &Builder) const {
+    if (!CountersPtr)
+      return Counters;
+    return Builder.CreateLoad(Builder.getPtrTy(), CountersPtr, "counters");
+  }
+};
+
+// Creates `DynamicCCCounters`, the array of NumFuncs counters that are
+// CounterWidth bits wide, spaced out by Padding bytes and replicated Shards
+// times. With SharedMemory, also creates `DynamicCCCountersPtr`.
+CounterLayout CreateCounterArray(llvm::Module &M, uint64_t NumFuncs,
+                                 unsigned CounterWidth, unsigned Padding = 0,
+                                 unsigned Shards = 1,
+                                 bool SharedMemory = false);
+
+//------------------------------------------------------------------------------
+// IR helpers
+//------------------------------------------------------------------------------
+// Emits `for (i = 0; i < N; i++) Body(i)` at the current insertion point of
+// Builder (which has to be at the end of a block). On return, Builder points
+// to the end of the exit block. Body may create new basic blocks, as long as
+// it leaves Builder at the end of the block that continues the loop.
+void CreateCountedLoop(
+    llvm::IRBuilder<> &Builder, uint64_t N,
+    llvm::function_ref<void(llvm::IRBuilder<> &, llvm::Value *)> Body);
+
+// Increments the counter at Addr by one, either with a relaxed atomic add or
+// with a plain load/add/store:
+//    %1 = load CounterTy, ptr %Addr
+//    %2 = add CounterTy 1, %1
+//    store CounterTy %2, ptr %Addr
+// These are the forms that DynamicCCPromote recognises.
+void CreateIncrement(llvm::IRBuilder<> &Builder, llvm::IntegerType *CounterTy,
+                     llvm::Align CounterAlign, llvm::Value *Addr,
+                     bool IsAtomic);
+inline void CreateIncrement(llvm::IRBuilder<> &Builder,
+                            const CounterLayout &Layout, llvm::Value *Addr,
+                            bool IsAtomic) {
+  CreateIncrement(Builder, Layout.CounterTy, Layout.getCounterAlign(), Addr,
+                  IsAtomic);
+}
+
+// Returns the declaration of printf (inserting it if needed), i.e.
+//    declare i32 @printf(ptr, ...)
+llvm::FunctionCallee getOrInsertPrintf(llvm::Module &M);
+
+//------------------------------------------------------------------------------
+// Text report
+//------------------------------------------------------------------------------
+// Creates `printf_wrapper`, which prints Title followed by a table with the
+// name and the call count (summed up over the shards) of every function:
+//    NAME                 #N DIRECT CALLS  <ExtraColumnName>
+// NameOffsets[ID] is the offset of the name of function ID in Names, which
+// has to be finalized. ExtraColumn (if set) is an array of NumFuncs i32
+// values, e.g. the numbers of arguments, read when the report is printed.
+// Flush (if set) is called first, with a null argument.
+//
+// The last instruction of the returned function is `ret void`, callers can
+// append to the report by inserting before it.
+llvm::Function *CreateTextReport(llvm::Module &M, llvm::StringRef Title,
+                                 const CounterLayout &Layout, NameTable &Names,
+                                 llvm::ArrayRef<uint32_t> NameOffsets,
+                                 llvm::GlobalVariable *ExtraColumn = nullptr,
+                                 llvm::StringRef ExtraColumnName = "",
+                                 llvm::Function *Flush = nullptr);
+
+//------------------------------------------------------------------------------
+// Binary report
+//------------------------------------------------------------------------------
+// Creates a constant global that holds everything that precedes the counters
+// in the binary record: the header, the function-name table and the padding
+// before the counter array.
+llvm::GlobalVariable *CreateRecordPrefix(llvm::Module &M,
+                                         const CounterLayout &Layout,
+                                         llvm::ArrayRef<llvm::Function *> Funcs);
+
+// Creates `dynamic_cc_dump`, which writes the binary record to the file named
+// by LLVM_TUTOR_CC_OUTPUT. Flush (if set) is called first, with a null
+// argument.
+llvm::Function *CreateBinaryDump(llvm::Module &M, const CounterLayout &Layout,
+                                 llvm::GlobalVariable *Prefix,
+                                 llvm::Function *Flush = nullptr);
+
+#endif // LLVM_TUTOR_DYNAMIC_CC_RUNTIME_H
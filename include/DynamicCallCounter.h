@@ -11,14 +11,64 @@
 #ifndef LLVM_TUTOR_INSTRUMENT_BASIC_H
 #define LLVM_TUTOR_INSTRUMENT_BASIC_H
 
+#include "DynamicCCRuntime.h"
+#include "InstrumentationFilter.h"
+
 #include "llvm/IR/Module.h"
 #include "llvm/IR/PassManager.h"
 #include "llvm/Pass.h"
 
+//------------------------------------------------------------------------------
+// Options
+//------------------------------------------------------------------------------
+// How the injected code updates the call counters at run-time.
+enum class CounterUpdateMode {
+  // Plain load/add/store - cheapest, but loses counts when the instrumented
+  // code runs on more than one thread.
+  Plain,
+  // Relaxed (monotonic) `atomicrmw add` on the shared counter - exact, but the
+  // counter's cache line is still shared between cores.
+  Atomic,
+  // Every thread increments its own (thread_local) copy of the counters. The
+  // per-thread counts are merged into the shared counters when the thread
+  // exits (and for the main thread, when the module exits).
+  TLS
+};
+
+struct DynamicCallCounterOptions {
+  CounterUpdateMode Mode = CounterUpdateMode::Plain;
+  // Width of the counters in bits (32 or 64). 32-bit counters wrap around
+  // after 2^32 calls, which long-running processes can easily hit.
+  unsigned CounterWidth = 64;
+  // Distance (in bytes) between the counters of consecutive functions. Values
+  // smaller than the size of a counter mean "densely packed".
+  unsigned Padding = 0;
+  // The number of copies of the counter array. Every thread updates one copy,
+  // the copies are summed up when printing the results. Must be a power of 2.
+  unsigned Shards = 1;
+  ReportFormat Format = ReportFormat::Text;
+  // Place the counters in a memory-mapped file (named at run-time by an
+  // environment variable) so that they can be read while the program runs.
+  bool SharedMemory = false;
+  // Count only every N-th call (per thread) and scale the result by N. 0
+  // means "count every call". Can be overridden at run-time through an
+  // environment variable.
+  unsigned SamplePeriod = 0;
+  // Also count every call site (i.e. every edge of the dynamic call graph).
+  // Indirect calls are counted per run-time target. Only the call sites in
+  // the instrumented functions are counted.
+  bool CountEdges = false;
+  // Selects the functions to instrument (see InstrumentationFilter.h)
+  InstrumentationFilterOptions Filter;
+};
+
 //------------------------------------------------------------------------------
 // New PM interface
 //------------------------------------------------------------------------------
 struct DynamicCallCounter : public llvm::PassInfoMixin<DynamicCallCounter> {
+  explicit DynamicCallCounter(DynamicCallCounterOptions Opts = {})
+      : Opts(Opts) {}
+
   llvm::PreservedAnalyses run(llvm::Module &M,
                               llvm::ModuleAnalysisManager &);
   bool runOnModule(llvm::Module &M);
@@ -27,6 +77,9 @@ struct DynamicCallCounter : public llvm::PassInfoMixin<DynamicCallCounter> {
   // decorated with the optnone LLVM attribute. Note that clang -O0 decorates
   // all functions with optnone.
   static bool isRequired() { return true; }
+
+private:
+  DynamicCallCounterOptions Opts;
 };
 
 #endif
@@ -0,0 +1,102 @@
+//==============================================================================
+// FILE:
+//    FuncTraceRecord.h
+//
+// DESCRIPTION:
+//    Describes the binary trace written by modules instrumented with
+//    `inject-func-call<trace>`. The trace is read by the `trace-dump` tool.
+//
+//    The layout of the trace is (all integers in the byte order of the
+//    instrumented program):
+//      * FuncTraceHeader
+//      * function-name table: NumFuncs NUL-terminated strings, ordered by
+//        function ID (NamesSize bytes in total)
+//      * argument-kind table: NumFuncs x ArgsPerEvent FuncTraceArgKind bytes,
+//        ordered by function ID (empty unless arguments are captured)
+//      * one chunk per thread that recorded at least one event, until the
+//        end of the file:
+//          - FuncTraceChunkHeader
+//          - NumEvents events, i.e. the thread's ring buffer. Every event is
+//            a FuncTraceEvent followed by ArgsPerEvent uint64_t argument
+//            values. When the buffer has wrapped around (Head > NumEvents),
+//            the oldest event is at index Head % NumEvents.
+//
+// License: MIT
+//==============================================================================
+#ifndef LLVM_TUTOR_FUNC_TRACE_RECORD_H
+#define LLVM_TUTOR_FUNC_TRACE_RECORD_H
+
+#include <cstdint>
+
+struct FuncTraceHeader {
+  // "LTFT" when read as a little-endian integer
+  static constexpr uint32_t MagicValue = 0x5446544c;
+  // Version 2 traces could contain padding after the argument-kind table
+  static constexpr uint32_t CurrentVersion = 3;
+  // The values of ClockKind
+  static constexpr uint32_t ClockCycles = 0;
+  static constexpr uint32_t ClockNanoseconds = 1;
+
+  uint32_t Magic;
+  uint32_t Version;
+  uint32_t NumFuncs;
+  // Size of the function-name table, including the NUL terminators
+  uint32_t NamesSize;
+  // The capacity of every per-thread ring buffer (a power of 2)
+  uint32_t EventsPerThread;
+  // The unit of FuncTraceEvent::Timestamp
+  uint32_t ClockKind;
+  // The number of argument values that follow every FuncTraceEvent
+  uint32_t ArgsPerEvent;
+  uint32_t Reserved;
+};
+
+static_assert(sizeof(FuncTraceHeader) == 32,
+              "The trace header must not contain any padding");
+
+struct FuncTraceChunkHeader {
+  // The number of events that the thread has recorded in total (including
+  // the ones that have been overwritten)
+  uint64_t Head;
+  // Threads are numbered in the order in which they recorded their first
+  // event
+  uint32_t ThreadIndex;
+  // The number of events that follow, min(Head, EventsPerThread)
+  uint32_t NumEvents;
+};
+
+static_assert(sizeof(FuncTraceChunkHeader) == 16,
+              "The chunk header must not contain any padding");
+
+struct FuncTraceEvent {
+  uint64_t Timestamp;
+  uint32_t FuncID;
+  uint32_t NumArgs;
+};
+
+static_assert(sizeof(FuncTraceEvent) == 16,
+              "The trace event must not contain any padding");
+
+// How the value of an argument is encoded in its uint64_t slot
+enum class FuncTraceArgKind : uint8_t {
+  // Not captured (the function has fewer arguments, or the argument is not a
+  // scalar), the value is 0
+  None = 0,
+  // An integer of up to 64 bits, sign-extended (`i1` is zero-extended)
+  Int = 1,
+  // A pointer, i.e. an address
+  Pointer = 2,
+  // A floating-point value, converted to double. The slot holds the bits of
+  // the double.
+  Float = 3
+};
+
+// The maximum value of FuncTraceHeader::ArgsPerEvent
+constexpr uint32_t FuncTraceMaxArgsPerEvent = 8;
+
+// The environment variable that names the output file. When not set, the
+// trace is written to FuncTraceDefaultOutput in the working directory.
+constexpr const char *FuncTraceOutputEnvVar = "LLVM_TUTOR_TRACE_OUTPUT";
+constexpr const char *FuncTraceDefaultOutput = "func-trace.bin";
+
+#endif // LLVM_TUTOR_FUNC_TRACE_RECORD_H
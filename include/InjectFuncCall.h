@@ -10,14 +10,36 @@
 #ifndef LLVM_TUTOR_INSTRUMENT_BASIC_H
 #define LLVM_TUTOR_INSTRUMENT_BASIC_H
 
+#include "InstrumentationFilter.h"
+
 #include "llvm/IR/Module.h"
 #include "llvm/IR/PassManager.h"
 #include "llvm/Pass.h"
 
+//------------------------------------------------------------------------------
+// Options
+//------------------------------------------------------------------------------
+struct InjectFuncCallOptions {
+  // Instead of calling printf, record a binary event (function ID, number of
+  // arguments and a timestamp) in a per-thread ring buffer. The buffers are
+  // written to a file when the module exits (see FuncTraceRecord.h).
+  bool Trace = false;
+  // The capacity of every per-thread ring buffer (a power of 2). Once a
+  // buffer is full, the oldest events are overwritten.
+  unsigned EventsPerThread = 16384;
+  // The number of arguments whose values are recorded in every trace event
+  // (at most FuncTraceMaxArgsPerEvent)
+  unsigned ArgsPerEvent = 0;
+  // Selects the functions to instrument (see InstrumentationFilter.h)
+  InstrumentationFilterOptions Filter;
+};
+
 //------------------------------------------------------------------------------
 // New PM interface
 //------------------------------------------------------------------------------
 struct InjectFuncCall : public llvm::PassInfoMixin<InjectFuncCall> {
+  explicit InjectFuncCall(InjectFuncCallOptions Opts = {}) : Opts(Opts) {}
+
   llvm::PreservedAnalyses run(llvm::Module &M,
                               llvm::ModuleAnalysisManager &);
   bool runOnModule(llvm::Module &M);
@@ -26,6 +48,14 @@ struct InjectFuncCall : public llvm::PassInfoMixin<InjectFuncCall> {
   // decorated with the optnone LLVM attribute. Note that clang -O0 decorates
   // all functions with optnone.
   static bool isRequired() { return true; }
+
+private:
+  // Injects the calls to printf
+  bool injectPrintf(llvm::Module &M);
+  // Injects the trace events (and the ring-buffer runtime)
+  bool injectTrace(llvm::Module &M);
+
+  InjectFuncCallOptions Opts;
 };
 
 #endif
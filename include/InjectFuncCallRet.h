@@ -1,23 +1,47 @@
 //==============================================================================
 // FILE:
-//    InjectFuncCall.h
+//    InjectFuncCallRet.h
 //
 // DESCRIPTION:
-//    Declares the InjectFuncCall pass for the new and the legacy pass managers.
+//    Declares the InjectFuncCallRet pass for the new pass manager.
 //
 // License: MIT
 //==============================================================================
-#ifndef LLVM_TUTOR_INSTRUMENT_BASIC_H
-#define LLVM_TUTOR_INSTRUMENT_BASIC_H
+#ifndef LLVM_TUTOR_INJECT_FUNC_CALL_RET_H
+#define LLVM_TUTOR_INJECT_FUNC_CALL_RET_H
+
+#include "InstrumentationFilter.h"
 
 #include "llvm/IR/Module.h"
 #include "llvm/IR/PassManager.h"
 #include "llvm/Pass.h"
 
+//------------------------------------------------------------------------------
+// Options
+//------------------------------------------------------------------------------
+struct InjectFuncCallRetOptions {
+  // Instead of calling printf before every return, measure the time between
+  // the entry and every return and record it in a per-function latency
+  // histogram. The percentiles are printed when the module exits.
+  bool Timing = false;
+  // Instead of calling printf, maintain a per-thread shadow stack and count
+  // the calls of every calling context. The counts are written as collapsed
+  // stacks (the input of flame-graph tools) when the module exits.
+  bool Stacks = false;
+  // The number of calling contexts that every thread can record (a power of
+  // 2)
+  unsigned StackNodes = 65536;
+  // Selects the functions to instrument (see InstrumentationFilter.h)
+  InstrumentationFilterOptions Filter;
+};
+
 //------------------------------------------------------------------------------
 // New PM interface
 //------------------------------------------------------------------------------
 struct InjectFuncCallRet : public llvm::PassInfoMixin<InjectFuncCallRet> {
+  explicit InjectFuncCallRet(InjectFuncCallRetOptions Opts = {})
+      : Opts(Opts) {}
+
   llvm::PreservedAnalyses run(llvm::Module &M,
                               llvm::ModuleAnalysisManager &);
   bool runOnModule(llvm::Module &M);
@@ -26,6 +50,16 @@ struct InjectFuncCallRet : public llvm::PassInfoMixin<InjectFuncCallRet> {
   // decorated with the optnone LLVM attribute. Note that clang -O0 decorates
   // all functions with optnone.
   static bool isRequired() { return true; }
+
+private:
+  // Injects the calls to printf
+  bool injectPrintf(llvm::Module &M);
+  // Injects the timing code (and the histograms)
+  bool injectTiming(llvm::Module &M);
+  // Injects the shadow-stack code (and the calling-context tries)
+  bool injectStacks(llvm::Module &M);
+
+  InjectFuncCallRetOptions Opts;
 };
 
-#endif
+#endif // LLVM_TUTOR_INJECT_FUNC_CALL_RET_H
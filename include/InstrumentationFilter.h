@@ -0,0 +1,84 @@
+//==============================================================================
+// FILE:
+//    InstrumentationFilter.h
+//
+// DESCRIPTION:
+//    Declares InstrumentationFilter, which selects the functions instrumented
+//    by DynamicCallCounter, InjectFuncCall and InjectFuncCallRet. All three
+//    accept the same pass parameters:
+//      * filter=<file> - allow/deny lists of function names (see below),
+//      * min-insts=<N> - skip functions with fewer than N IR instructions,
+//      * min-entry-count=<N> - skip functions whose profile entry count
+//        (`!prof !{!"function_entry_count", ...}`) is below N. Functions
+//        without a profile are kept.
+//
+//    The filter file contains one pattern per line:
+//      # Comments and empty lines are ignored
+//      allow:parse_*           <- glob
+//      deny:*_slow_path        <- glob
+//      allow-regex:^foo[0-9]+$ <- regular expression (POSIX ERE)
+//      deny-regex:^llvm_tutor_
+//    A function is instrumented if its name matches no deny pattern and
+//    either there are no allow patterns or it matches at least one of them.
+//
+// License: MIT
+//==============================================================================
+#ifndef LLVM_TUTOR_INSTRUMENTATION_FILTER_H
+#define LLVM_TUTOR_INSTRUMENTATION_FILTER_H
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Function.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/GlobPattern.h"
+#include "llvm/Support/Regex.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// Options
+//------------------------------------------------------------------------------
+struct InstrumentationFilterOptions {
+  // The patterns read from the filter file. They are validated when the file
+  // is read, i.e. when the pass parameters are parsed.
+  std::vector<std::string> AllowGlobs;
+  std::vector<std::string> DenyGlobs;
+  std::vector<std::string> AllowRegexes;
+  std::vector<std::string> DenyRegexes;
+  // 0 means "no threshold"
+  unsigned MinInstructions = 0;
+  uint64_t MinEntryCount = 0;
+};
+
+// Parses Param if it is one of the parameters listed above and stores it in
+// Opts. Returns false if Param is not a filter parameter, and an error if it
+// is one but it's invalid (PassName is used in the error message).
+llvm::Expected<bool>
+parseInstrumentationFilterParam(llvm::StringRef Param,
+                                llvm::StringRef PassName,
+                                InstrumentationFilterOptions &Opts);
+
+//------------------------------------------------------------------------------
+// InstrumentationFilter
+//------------------------------------------------------------------------------
+class InstrumentationFilter {
+public:
+  explicit InstrumentationFilter(const InstrumentationFilterOptions &Opts);
+
+  // Returns true if F should be instrumented. Has to be called before F is
+  // instrumented, as the instrumentation itself adds instructions.
+  bool shouldInstrument(const llvm::Function &F) const;
+
+private:
+  bool matchesNamePatterns(llvm::StringRef Name) const;
+
+  std::vector<llvm::GlobPattern> AllowGlobs;
+  std::vector<llvm::GlobPattern> DenyGlobs;
+  std::vector<llvm::Regex> AllowRegexes;
+  std::vector<llvm::Regex> DenyRegexes;
+  unsigned MinInstructions;
+  uint64_t MinEntryCount;
+};
+
+#endif // LLVM_TUTOR_INSTRUMENTATION_FILTER_H
@@ -0,0 +1,96 @@
+//========================================================================
+// FILE:
+//    LazyRIV.h
+//
+// DESCRIPTION:
+//    Declares LazyRIV, a query-based version of RIV. Instead of computing
+//    the set of reachable integer values for every basic block up front, it
+//    answers questions about individual blocks:
+//      * is V reachable in BB?
+//      * how many values are reachable in BB?
+//      * what is the K-th value reachable in BB?
+//    by walking the dominator tree on demand. The values defined in a block
+//    and the number of values reachable in a block are memoized, so no set
+//    is ever materialized and a query costs at most O(depth of BB in the
+//    dominator tree).
+//
+//    The values reachable in BB are numbered as follows: integer globals and
+//    arguments first (as in RIV), then the integer values defined in the
+//    blocks that dominate BB, from the entry block down to the immediate
+//    dominator of BB.
+//
+//    The result can be kept up to date while the CFG changes, as long as the
+//    dominator tree that it was computed from is (e.g. through a
+//    DomTreeUpdater). A pass that does that can preserve both LazyRIV and
+//    DominatorTreeAnalysis, see DuplicateBB.
+//
+// License: MIT
+//========================================================================
+#ifndef LLVM_TUTOR_LAZY_RIV_H
+#define LLVM_TUTOR_LAZY_RIV_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/PassManager.h"
+
+#include <optional>
+
+//------------------------------------------------------------------------------
+// Result
+//------------------------------------------------------------------------------
+class LazyRIVResult {
+public:
+  LazyRIVResult(llvm::Function &F, const llvm::DominatorTree &DT)
+      : F(F), DT(DT) {}
+
+  // Returns true if V is a reachable integer value in BB
+  bool isReachable(const llvm::BasicBlock *BB, const llvm::Value *V) const;
+  // Returns the number of reachable integer values in BB (0 for blocks that
+  // are unreachable from the entry block)
+  size_t getNumReachable(const llvm::BasicBlock *BB);
+  // Returns the K-th reachable integer value in BB, K < getNumReachable(BB)
+  llvm::Value *getReachable(const llvm::BasicBlock *BB, size_t K);
+
+  // Drops everything memoized for BB and for the blocks that BB dominates.
+  // Call this before splitting BB or otherwise changing the instructions in
+  // BB or the CFG below it. If the dominator tree is then updated (e.g.
+  // through a DomTreeUpdater), the result remains valid.
+  void forgetBlock(const llvm::BasicBlock *BB);
+
+  // The result depends on the dominator tree, so it has to be invalidated
+  // together with it
+  bool invalidate(llvm::Function &F, const llvm::PreservedAnalyses &PA,
+                  llvm::FunctionAnalysisManager::Invalidator &Inv);
+
+private:
+  // The integer globals and arguments (memoized)
+  llvm::ArrayRef<llvm::Value *> getEntryValues();
+  // The integer values defined in BB (memoized)
+  llvm::ArrayRef<llvm::Value *> getDefs(const llvm::BasicBlock *BB);
+
+  llvm::Function &F;
+  const llvm::DominatorTree &DT;
+
+  std::optional<llvm::SmallVector<llvm::Value *, 8>> EntryValues;
+  llvm::DenseMap<const llvm::BasicBlock *, llvm::SmallVector<llvm::Value *, 4>>
+      Defs;
+  llvm::DenseMap<const llvm::BasicBlock *, size_t> NumReachable;
+};
+
+//------------------------------------------------------------------------------
+// New PM interface
+//------------------------------------------------------------------------------
+struct LazyRIV : public llvm::AnalysisInfoMixin<LazyRIV> {
+  using Result = LazyRIVResult;
+  Result run(llvm::Function &F, llvm::FunctionAnalysisManager &);
+
+private:
+  // A special type used by analysis passes to provide an address that
+  // identifies that particular analysis pass type.
+  static llvm::AnalysisKey Key;
+  friend struct llvm::AnalysisInfoMixin<LazyRIV>;
+};
+
+#endif // LLVM_TUTOR_LAZY_RIV_H
@@ -0,0 +1,89 @@
+//==============================================================================
+// FILE:
+//    MBA.h
+//
+// DESCRIPTION:
+//    Declares the MBA pass for the new pass manager. Unlike MBAAdd, MBAAddInt16
+//    and MBASub, it applies all the default rules of the MBA engine (see
+//    MBARules.h) in one traversal, optionally within a cost budget.
+//
+// License: MIT
+//==============================================================================
+#ifndef LLVM_TUTOR_MBA_H
+#define LLVM_TUTOR_MBA_H
+
+#include "MBARewrite.h"
+
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Support/InstructionCost.h"
+
+#include <cstdint>
+#include <memory>
+
+//------------------------------------------------------------------------------
+// Options
+//------------------------------------------------------------------------------
+// Limits on what the pass rewrites. 0 means "no limit" everywhere. Costs are
+// TargetTransformInfo costs: code size for the budgets and reciprocal
+// throughput for the slowdown.
+struct MBAOptions {
+  // The maximum code growth per function and per module. Once a budget is
+  // exhausted, the remaining instructions are left alone. Cold instructions
+  // are rewritten first.
+  uint64_t Budget = 0;
+  uint64_t ModuleBudget = 0;
+  // Skip instructions that run more than MaxTripCount times per call of the
+  // function, i.e. for which the product of the maximum trip counts of the
+  // enclosing loops is larger (or unknown)
+  uint64_t MaxTripCount = 0;
+  // Skip basic blocks that are more than MaxHotness times as frequent as the
+  // entry block (BlockFrequencyInfo, i.e. profile data if available)
+  double MaxHotness = 0;
+  // The maximum slowdown of every innermost loop per iteration, as a factor
+  // of its original cost (e.g. 1.5). Code outside loops is not limited.
+  double MaxSlowdown = 0;
+
+  bool hasLimits() const {
+    return Budget || ModuleBudget || MaxTripCount || MaxHotness ||
+           MaxSlowdown;
+  }
+};
+
+//------------------------------------------------------------------------------
+// New PM interface
+//------------------------------------------------------------------------------
+struct MBA : public llvm::PassInfoMixin<MBA> {
+  explicit MBA(MBAOptions Opts = {})
+      : Opts(Opts),
+        ModuleGrowth(std::make_shared<llvm::InstructionCost>(0)) {}
+
+  llvm::PreservedAnalyses run(llvm::Function &F,
+                              llvm::FunctionAnalysisManager &);
+  bool runOnBasicBlock(llvm::BasicBlock &B);
+
+  // Returns true if this pass rewrites Inst
+  static bool isCandidate(const llvm::Instruction &Inst);
+  // Emits the MBA expression that replaces BinOp (a candidate) at the
+  // insertion point of Builder and returns it (see MBARewrite.h)
+  static llvm::Value *emitReplacement(llvm::IRBuilderBase &Builder,
+                                      llvm::BinaryOperator &BinOp,
+                                      MBAConstantFn GetConstant);
+
+  // Without isRequired returning true, this pass will be skipped for functions
+  // decorated with the optnone LLVM attribute. Note that clang -O0 decorates
+  // all functions with optnone.
+  static bool isRequired() { return true; }
+
+private:
+  // Rewrites F within the limits set in Opts
+  bool runWithLimits(llvm::Function &F, llvm::FunctionAnalysisManager &FAM);
+
+  MBAOptions Opts;
+  // The code growth so far, counted against Opts.ModuleBudget. The pass
+  // manager runs the same pass object on all functions of the module.
+  std::shared_ptr<llvm::InstructionCost> ModuleGrowth;
+};
+
+#endif // LLVM_TUTOR_MBA_H
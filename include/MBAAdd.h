@@ -10,7 +10,10 @@
 #ifndef LLVM_TUTOR_MBA_ADD_H
 #define LLVM_TUTOR_MBA_ADD_H
 
+#include "MBARewrite.h"
+
 #include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/PassManager.h"
 #include "llvm/Pass.h"
 
@@ -22,6 +25,14 @@ struct MBAAdd : public llvm::PassInfoMixin<MBAAdd> {
                               llvm::FunctionAnalysisManager &);
   bool runOnBasicBlock(llvm::BasicBlock &B);
 
+  // Returns true if this pass rewrites Inst
+  static bool isCandidate(const llvm::Instruction &Inst);
+  // Emits the MBA expression that replaces BinOp (a candidate) at the
+  // insertion point of Builder and returns it (see MBARewrite.h)
+  static llvm::Value *emitReplacement(llvm::IRBuilderBase &Builder,
+                                      llvm::BinaryOperator &BinOp,
+                                      MBAConstantFn GetConstant);
+
   // Without isRequired returning true, this pass will be skipped for functions
   // decorated with the optnone LLVM attribute. Note that clang -O0 decorates
   // all functions with optnone.
@@ -0,0 +1,60 @@
+//==============================================================================
+// FILE:
+//    MBARewrite.h
+//
+// DESCRIPTION:
+//    Declares the helpers shared by the MBA passes (MBA, MBAAdd, MBAAddInt16
+//    and MBASub) and the mba-parallel tool.
+//
+//    Every MBA pass is split into isCandidate (does the pass rewrite this
+//    instruction?) and emitReplacement (emit the equivalent MBA expression).
+//    emitReplacement only creates new, unnamed instructions and takes all
+//    constants from an MBAConstantFn. That's what allows mba-parallel to run
+//    it on different functions of one module concurrently: with a builder
+//    that doesn't fold and constants handed out under a lock, nothing that is
+//    shared between functions is modified. Replacing the original instruction
+//    (replaceWithMBA) does modify shared state and is done serially.
+//
+// License: MIT
+//==============================================================================
+#ifndef LLVM_TUTOR_MBA_REWRITE_H
+#define LLVM_TUTOR_MBA_REWRITE_H
+
+#include "llvm/ADT/APInt.h"
+#include "llvm/ADT/STLFunctionalExtras.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/InstrTypes.h"
+
+#include <cstdint>
+
+// Returns the integer constant (or splat) of type Ty with value V, see
+// getMBAConstantValue
+using MBAConstantFn =
+    llvm::function_ref<llvm::Constant *(llvm::Type *Ty, uint64_t V)>;
+
+// Returns V as an integer of the (scalar) width of Ty: truncated if Ty is
+// narrower than 64 bits and sign-extended if it is wider (i.e. -1 means "all
+// ones" for every width)
+inline llvm::APInt getMBAConstantValue(llvm::Type *Ty, uint64_t V) {
+  unsigned Bits = Ty->getScalarSizeInBits();
+  if (Bits > 64)
+    return llvm::APInt(Bits, V, /*isSigned=*/true);
+  return llvm::APInt(Bits, Bits == 64 ? V : V & ((uint64_t(1) << Bits) - 1));
+}
+
+// The MBAConstantFn used by the passes
+inline llvm::Constant *getMBAConstant(llvm::Type *Ty, uint64_t V) {
+  return llvm::ConstantInt::get(Ty, getMBAConstantValue(Ty, V));
+}
+
+// Replaces all uses of BinOp with Replacement (which takes over the name of
+// BinOp) and erases BinOp
+inline void replaceWithMBA(llvm::BinaryOperator &BinOp,
+                           llvm::Value *Replacement) {
+  BinOp.replaceAllUsesWith(Replacement);
+  if (auto *NewInst = llvm::dyn_cast<llvm::Instruction>(Replacement))
+    NewInst->takeName(&BinOp);
+  BinOp.eraseFromParent();
+}
+
+#endif // LLVM_TUTOR_MBA_REWRITE_H
@@ -0,0 +1,139 @@
+//==============================================================================
+// FILE:
+//    MBARules.h
+//
+// DESCRIPTION:
+//    Declares the table-driven MBA engine used by all MBA passes. A rewrite
+//    rule is plain data:
+//      * the opcode and the bit width (0 means "any") it applies to. For
+//        vectors of integers, this is the width of the elements,
+//      * the MBA identity used to rewrite the instruction, e.g.
+//          a + b == (a ^ b) + 2 * (a & b)
+//      * optionally, an affine mask wrapped around the identity:
+//          x == (x * A + B) * C + D  (mod 2^BitWidth)
+//        where C is the modular inverse of A (A has to be odd) and
+//        D == -B * C. C and D are computed at compile time from A and B, see
+//        makeMBAAffineMask.
+//    For example, MBAAdd uses:
+//      a + b == (((a ^ b) + 2 * (a & b)) * 39 + 23) * 151 + 111
+//    i.e. AddViaXorAnd with A = 39 and B = 23 for i8.
+//
+//    Adding an identity means adding an MBAIdentity and a case to
+//    emitMBARule. Adding a width means adding a row to a table.
+//
+// License: MIT
+//==============================================================================
+#ifndef LLVM_TUTOR_MBA_RULES_H
+#define LLVM_TUTOR_MBA_RULES_H
+
+#include "MBARewrite.h"
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InstrTypes.h"
+
+#include <cstdint>
+
+//------------------------------------------------------------------------------
+// Compile-time helpers
+//------------------------------------------------------------------------------
+// All ones in the low Bits bits
+constexpr uint64_t getMBAWidthMask(unsigned Bits) {
+  return Bits >= 64 ? ~uint64_t(0) : (uint64_t(1) << Bits) - 1;
+}
+
+// Returns X such that A * X == 1 (mod 2^Bits). A has to be odd.
+//
+// Newton's iteration, X' = X * (2 - A * X), doubles the number of correct
+// low bits in every step. X = A is correct to 3 bits (A * A == 1 mod 8 for
+// odd A), so 5 steps give 96 >= 64 bits.
+constexpr uint64_t getMBAModularInverse(uint64_t A, unsigned Bits) {
+  uint64_t X = A;
+  for (int I = 0; I < 5; ++I)
+    X *= 2 - A * X;
+  return X & getMBAWidthMask(Bits);
+}
+
+//------------------------------------------------------------------------------
+// Rules
+//------------------------------------------------------------------------------
+// The identities that the engine knows how to emit
+enum class MBAIdentity {
+  // a + b == (a ^ b) + 2 * (a & b)
+  AddViaXorAnd,
+  // a - b == (a + ~b) + 1
+  SubViaAddNot,
+};
+
+// x == (x * A + B) * C + D (mod 2^BitWidth)
+struct MBAAffineMask {
+  uint64_t A;
+  uint64_t B;
+  uint64_t C;
+  uint64_t D;
+
+  constexpr bool isIdentity() const { return A == 1 && B == 0; }
+};
+
+// The mask that is not emitted at all
+constexpr MBAAffineMask MBANoAffineMask{1, 0, 1, 0};
+
+// Returns the affine mask for the multiplier A (odd) and the addend B
+constexpr MBAAffineMask makeMBAAffineMask(uint64_t A, uint64_t B,
+                                          unsigned Bits) {
+  uint64_t C = getMBAModularInverse(A, Bits);
+  return {A & getMBAWidthMask(Bits), B & getMBAWidthMask(Bits), C,
+          (0 - B * C) & getMBAWidthMask(Bits)};
+}
+
+// Returns true if Mask really is the identity for Bits-wide integers (use in
+// a static_assert to catch an even A)
+constexpr bool isValidMBAAffineMask(const MBAAffineMask &Mask, unsigned Bits) {
+  return ((Mask.A * Mask.C) & getMBAWidthMask(Bits)) == 1 &&
+         ((Mask.B * Mask.C + Mask.D) & getMBAWidthMask(Bits)) == 0;
+}
+
+struct MBARule {
+  unsigned Opcode;
+  // 0 means "any width". Rules with an affine mask need a fixed width.
+  unsigned BitWidth;
+  MBAIdentity Identity;
+  MBAAffineMask Mask;
+};
+
+// Returns true if every rule in Rules with an affine mask is valid
+template <size_t N>
+constexpr bool areValidMBARules(const MBARule (&Rules)[N]) {
+  for (const MBARule &Rule : Rules)
+    if (!Rule.Mask.isIdentity() &&
+        (!Rule.BitWidth || !isValidMBAAffineMask(Rule.Mask, Rule.BitWidth)))
+      return false;
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Engine
+//------------------------------------------------------------------------------
+// Returns the first rule in Rules that applies to Inst, or nullptr
+const MBARule *findMBARule(llvm::ArrayRef<MBARule> Rules,
+                           const llvm::Instruction &Inst);
+
+// Emits the MBA expression for BinOp described by Rule at the insertion
+// point of Builder and returns it (see MBARewrite.h)
+llvm::Value *emitMBARule(llvm::IRBuilderBase &Builder,
+                         llvm::BinaryOperator &BinOp, const MBARule &Rule,
+                         MBAConstantFn GetConstant);
+
+// Returns the cost of the instructions emitted by emitMBARule for an
+// instruction of type Ty minus the cost of the instruction they replace
+llvm::InstructionCost
+getMBARuleCostDelta(const MBARule &Rule, llvm::Type *Ty,
+                    const llvm::TargetTransformInfo &TTI,
+                    llvm::TargetTransformInfo::TargetCostKind CostKind);
+
+// The rules used by the generic `mba` pass: add for 8/16/32/64 bits and sub
+// for any width (scalars and vectors)
+llvm::ArrayRef<MBARule> getDefaultMBARules();
+
+#endif // LLVM_TUTOR_MBA_RULES_H
@@ -0,0 +1,79 @@
+//========================================================================
+// FILE:
+//    ModuleRIV.h
+//
+// DESCRIPTION:
+//    Declares ModuleRIV, a module-level version of RIV. It computes the RIV
+//    results (see RIV.h) for all functions in a module in parallel, on a
+//    thread pool, and hands them back as a read-only result. Every worker
+//    builds its own dominator tree, i.e. the FunctionAnalysisManager (which
+//    is not thread-safe) is not involved.
+//
+//    Also declares the printer pass for the new pass manager.
+//
+// License: MIT
+//========================================================================
+#ifndef LLVM_TUTOR_MODULE_RIV_H
+#define LLVM_TUTOR_MODULE_RIV_H
+
+#include "RIV.h"
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassManager.h"
+
+#include <vector>
+
+//------------------------------------------------------------------------------
+// Result
+//------------------------------------------------------------------------------
+class ModuleRIVResult {
+public:
+  // The functions with a body, in module order
+  llvm::ArrayRef<const llvm::Function *> functions() const { return Funcs; }
+  // The RIV result for F (nullptr for declarations)
+  const RIVResult *lookup(const llvm::Function *F) const;
+
+private:
+  friend struct ModuleRIV;
+
+  std::vector<const llvm::Function *> Funcs;
+  // Results[I] is the result for Funcs[I]
+  std::vector<RIVResult> Results;
+  llvm::DenseMap<const llvm::Function *, unsigned> Index;
+};
+
+//------------------------------------------------------------------------------
+// New PM interface
+//------------------------------------------------------------------------------
+struct ModuleRIV : public llvm::AnalysisInfoMixin<ModuleRIV> {
+  using Result = ModuleRIVResult;
+  // 0 threads means "one per hardware thread"
+  explicit ModuleRIV(unsigned Threads = 0) : Threads(Threads) {}
+  Result run(llvm::Module &M, llvm::ModuleAnalysisManager &);
+  Result build(llvm::Module &M);
+
+private:
+  unsigned Threads;
+
+  // A special type used by analysis passes to provide an address that
+  // identifies that particular analysis pass type.
+  static llvm::AnalysisKey Key;
+  friend struct llvm::AnalysisInfoMixin<ModuleRIV>;
+};
+
+//------------------------------------------------------------------------------
+// New PM interface for the printer pass
+//------------------------------------------------------------------------------
+class ModuleRIVPrinter : public llvm::PassInfoMixin<ModuleRIVPrinter> {
+public:
+  explicit ModuleRIVPrinter(llvm::raw_ostream &OutS) : OS(OutS) {}
+  llvm::PreservedAnalyses run(llvm::Module &M,
+                              llvm::ModuleAnalysisManager &MAM);
+
+private:
+  llvm::raw_ostream &OS;
+};
+
+#endif // LLVM_TUTOR_MODULE_RIV_H
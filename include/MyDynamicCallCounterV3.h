@@ -0,0 +1,52 @@
+//==============================================================================
+// FILE:
+//    MyDynamicCallCounterV3.h
+//
+// DESCRIPTION:
+//    Declares the MyDynamicCallCounterV3 pass for the new pass manager.
+//
+// License: MIT
+//==============================================================================
+#ifndef LLVM_TUTOR_MY_DYNAMIC_CALL_COUNTER_V3_H
+#define LLVM_TUTOR_MY_DYNAMIC_CALL_COUNTER_V3_H
+
+#include "DynamicCCRuntime.h"
+
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassManager.h"
+
+//------------------------------------------------------------------------------
+// Options
+//------------------------------------------------------------------------------
+struct MyDynamicCallCounterV3Options {
+  // Width of the counters in bits (32 or 64)
+  unsigned CounterWidth = 64;
+  // Update the counters with relaxed atomic adds (for multi-threaded inputs)
+  bool Atomic = false;
+  // Report the number of arguments of every function (text output only)
+  bool ReportArgs = false;
+  ReportFormat Format = ReportFormat::Text;
+};
+
+//------------------------------------------------------------------------------
+// New PM interface
+//------------------------------------------------------------------------------
+struct MyDynamicCallCounterV3
+    : public llvm::PassInfoMixin<MyDynamicCallCounterV3> {
+  explicit MyDynamicCallCounterV3(MyDynamicCallCounterV3Options Opts = {})
+      : Opts(Opts) {}
+
+  llvm::PreservedAnalyses run(llvm::Module &M,
+                              llvm::ModuleAnalysisManager &);
+  bool runOnModule(llvm::Module &M);
+
+  // Without isRequired returning true, this pass will be skipped for functions
+  // decorated with the optnone LLVM attribute. Note that clang -O0 decorates
+  // all functions with optnone.
+  static bool isRequired() { return true; }
+
+private:
+  MyDynamicCallCounterV3Options Opts;
+};
+
+#endif // LLVM_TUTOR_MY_DYNAMIC_CALL_COUNTER_V3_H
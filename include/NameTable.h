@@ -0,0 +1,64 @@
+//==============================================================================
+// FILE:
+//    NameTable.h
+//
+// DESCRIPTION:
+//    Declares NameTable, the packed table of function names shared by the
+//    instrumenting passes (DynamicCallCounter, MyDynamicCallCounter*,
+//    InjectFuncCall, InjectFuncCallRet).
+//
+//    Instead of one private global per name (and, in some passes, per use),
+//    all names live in a single global, `LLVMTutorNames`, as consecutive
+//    NUL-terminated strings. Every distinct name is stored once and is
+//    referred to by its offset in the table. Passes that run later on the
+//    same module extend the existing table, so the offsets handed out earlier
+//    remain valid.
+//
+// License: MIT
+//==============================================================================
+#ifndef LLVM_TUTOR_NAME_TABLE_H
+#define LLVM_TUTOR_NAME_TABLE_H
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Module.h"
+
+#include <string>
+
+class NameTable {
+public:
+  // Picks up the names that are already in M's table (if any)
+  explicit NameTable(llvm::Module &M);
+
+  // Returns the offset of Name in the table, adding Name if needed
+  uint32_t add(llvm::StringRef Name);
+
+  // Emits the table into the module (replacing the previous version of the
+  // table, if there was one) and returns it. Has to be called again after
+  // adding more names.
+  llvm::GlobalVariable *finalize();
+
+  // Returns the address of the name at Offset (a constant expression). The
+  // name has to be in the finalized table.
+  llvm::Constant *getAddress(uint32_t Offset) const;
+  llvm::Constant *getAddress(llvm::StringRef Name) const {
+    return getAddress(Offsets.lookup(Name));
+  }
+  // Emits the computation of the address of the name at Offset (an i32 known
+  // only at run-time, e.g. loaded from a table of offsets)
+  llvm::Value *CreateAddress(llvm::IRBuilder<> &Builder,
+                             llvm::Value *Offset) const;
+
+  llvm::GlobalVariable *getTable() const { return Table; }
+
+private:
+  llvm::Module &M;
+  // The contents of the table and the offsets of the names in it
+  std::string Data;
+  llvm::StringMap<uint32_t> Offsets;
+  llvm::GlobalVariable *Table = nullptr;
+};
+
+#endif // LLVM_TUTOR_NAME_TABLE_H
@@ -4,6 +4,7 @@
 //
 // DESCRIPTION:
 //    Declares the RIV passes:
+//      * the result of the analysis (RIVResult)
 //      * new pass manager interface
 //      * legacy pass manager interface
 //      * printer pass for the new pass manager
@@ -13,25 +14,151 @@
 #ifndef LLVM_TUTOR_RIV_H
 #define LLVM_TUTOR_RIV_H
 
-#include "llvm/ADT/MapVector.h"
-#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Dominators.h"
 #include "llvm/Pass.h"
 
+#include <deque>
+#include <iterator>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// Result
+//------------------------------------------------------------------------------
+// The set of reachable integer values of a block is the set of its immediate
+// dominator plus the values defined in the immediate dominator. Rather than
+// copying that into every block, the sets are stored as chains of nodes that
+// are shared along dominator-tree paths:
+//    * every block that defines integer values has a node holding these
+//      values and a pointer to the node of its closest such dominator,
+//    * a root node holds the integer globals and arguments,
+//    * the set of a block is the chain that starts at the node of its
+//      immediate dominator (or the closest dominator above it that has one).
+// This takes O(#values + #blocks) memory instead of O(#values * #blocks).
+class RIVResult {
+public:
+  struct Node {
+    // The next node in the chain (nullptr for the root node and for nodes
+    // that have been flattened, see compact())
+    const Node *Up = nullptr;
+    llvm::SmallVector<llvm::Value *, 4> Values;
+    // The number of values in the chain starting at this node
+    size_t ChainSize = 0;
+    // The number of nodes in the chain starting at this node
+    unsigned ChainLength = 1;
+  };
+
+  // A read-only view of the set of reachable integer values of a block. The
+  // values are visited from the immediate dominator up to the root, i.e.
+  // integer globals and arguments come last.
+  class ValueSet {
+  public:
+    class iterator {
+    public:
+      using iterator_category = std::forward_iterator_tag;
+      using value_type = llvm::Value *;
+      using difference_type = std::ptrdiff_t;
+      using pointer = llvm::Value *const *;
+      using reference = llvm::Value *const &;
+
+      iterator() = default;
+      explicit iterator(const Node *N) : N(N) { skipEmpty(); }
+
+      reference operator*() const { return N->Values[Idx]; }
+      iterator &operator++() {
+        ++Idx;
+        skipEmpty();
+        return *this;
+      }
+      iterator operator++(int) {
+        iterator Tmp = *this;
+        ++*this;
+        return Tmp;
+      }
+      bool operator==(const iterator &Other) const {
+        return N == Other.N && Idx == Other.Idx;
+      }
+      bool operator!=(const iterator &Other) const { return !(*this == Other); }
+
+    private:
+      void skipEmpty() {
+        while (N && Idx == N->Values.size()) {
+          N = N->Up;
+          Idx = 0;
+        }
+      }
+
+      const Node *N = nullptr;
+      unsigned Idx = 0;
+    };
+
+    ValueSet() = default;
+    explicit ValueSet(const Node *Head) : Head(Head) {}
+
+    iterator begin() const { return iterator(Head); }
+    iterator end() const { return iterator(); }
+    size_t size() const { return Head ? Head->ChainSize : 0; }
+    bool empty() const { return size() == 0; }
+    // Walks the chain, i.e. O(size())
+    bool contains(const llvm::Value *V) const;
+
+  private:
+    const Node *Head = nullptr;
+  };
+
+  RIVResult() = default;
+  // The nodes are referenced by address, so the result can be moved, but not
+  // copied
+  RIVResult(RIVResult &&) = default;
+  RIVResult &operator=(RIVResult &&) = default;
+  RIVResult(const RIVResult &) = delete;
+  RIVResult &operator=(const RIVResult &) = delete;
+
+  // The set of reachable integer values for BB (empty for blocks that are
+  // unreachable from the entry block)
+  ValueSet lookup(const llvm::BasicBlock *BB) const {
+    return ValueSet(Heads.lookup(BB));
+  }
+  // The blocks reachable from the entry block, in the order in which they
+  // were visited
+  llvm::ArrayRef<const llvm::BasicBlock *> blocks() const { return Blocks; }
+
+  // Compact mode: flattens the chains so that iterating over any set visits
+  // at most MaxChainLength nodes. A node deeper than that gets a copy of all
+  // the values in its chain and is cut off from the rest of it. This trades
+  // memory for faster iteration in deep dominator trees. 0 means "off".
+  void compact(unsigned MaxChainLength);
+
+private:
+  friend struct RIV;
+
+  Node &createNode(const Node *Up);
+
+  // All nodes, parents before children. std::deque never moves its elements.
+  std::deque<Node> Nodes;
+  std::vector<const llvm::BasicBlock *> Blocks;
+  llvm::DenseMap<const llvm::BasicBlock *, const Node *> Heads;
+};
+
 //------------------------------------------------------------------------------
 // New PM interface
 //------------------------------------------------------------------------------
 struct RIV : public llvm::AnalysisInfoMixin<RIV> {
-  // A map that for every basic block holds a set of pointers to reachable
-  // integer values for that block.
-  using Result = llvm::MapVector<llvm::BasicBlock const *,
-                                 llvm::SmallPtrSet<llvm::Value *, 8>>;
+  // For every basic block holds the set of reachable integer values for
+  // that block (see RIVResult). MaxChainLength enables the compact mode (see
+  // RIVResult::compact).
+  using Result = RIVResult;
+  explicit RIV(unsigned MaxChainLength = 0) : MaxChainLength(MaxChainLength) {}
   Result run(llvm::Function &F, llvm::FunctionAnalysisManager &);
   Result buildRIV(llvm::Function &F,
                   llvm::DomTreeNodeBase<llvm::BasicBlock> *CFGRoot);
 
 private:
+  unsigned MaxChainLength;
+
   // A special type used by analysis passes to provide an address that
   // identifies that particular analysis pass type.
   static llvm::AnalysisKey Key;
@@ -51,4 +178,7 @@ private:
   llvm::raw_ostream &OS;
 };
 
+// Pretty-prints the result of RIV (shared with the printer of ModuleRIV)
+void printRIVResult(llvm::raw_ostream &OutS, const RIVResult &RIVMap);
+
 #endif // LLVM_TUTOR_RIV_H
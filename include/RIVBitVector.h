@@ -0,0 +1,85 @@
+//========================================================================
+// FILE:
+//    RIVBitVector.h
+//
+// DESCRIPTION:
+//    Declares RIVBitVector, an alternative to RIV that computes the same sets
+//    of reachable integer values, but stores them as bit vectors:
+//      * every integer value that can be reachable (integer globals, integer
+//        arguments and integer instructions) gets a dense number,
+//      * the set of every basic block is a SparseBitVector of these numbers.
+//    The instructions are numbered in dominator-tree preorder, so the values
+//    defined along a dominator-tree path form a few contiguous ranges. These
+//    are stored compactly by SparseBitVector and merged word by word.
+//
+//    Also declares the printer pass for the new pass manager.
+//
+// License: MIT
+//========================================================================
+#ifndef LLVM_TUTOR_RIV_BIT_VECTOR_H
+#define LLVM_TUTOR_RIV_BIT_VECTOR_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SparseBitVector.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/PassManager.h"
+
+#include <vector>
+
+//------------------------------------------------------------------------------
+// Result
+//------------------------------------------------------------------------------
+class RIVBitVectorResult {
+public:
+  using ValueSet = llvm::SparseBitVector<>;
+
+  // All values that are reachable in at least one block, indexed by their
+  // numbers
+  llvm::ArrayRef<llvm::Value *> getValues() const { return Values; }
+  llvm::Value *getValue(unsigned Number) const { return Values[Number]; }
+
+  // The set of reachable integer values for BB (empty for blocks that are
+  // unreachable from the entry block)
+  const ValueSet &getReachable(const llvm::BasicBlock *BB) const;
+  bool isReachable(const llvm::BasicBlock *BB, const llvm::Value *V) const;
+
+private:
+  friend struct RIVBitVector;
+
+  std::vector<llvm::Value *> Values;
+  llvm::DenseMap<const llvm::Value *, unsigned> Numbers;
+  llvm::DenseMap<const llvm::BasicBlock *, ValueSet> Reachable;
+  ValueSet Empty;
+};
+
+//------------------------------------------------------------------------------
+// New PM interface
+//------------------------------------------------------------------------------
+struct RIVBitVector : public llvm::AnalysisInfoMixin<RIVBitVector> {
+  using Result = RIVBitVectorResult;
+  Result run(llvm::Function &F, llvm::FunctionAnalysisManager &);
+  Result build(llvm::Function &F, const llvm::DominatorTree &DT);
+
+private:
+  // A special type used by analysis passes to provide an address that
+  // identifies that particular analysis pass type.
+  static llvm::AnalysisKey Key;
+  friend struct llvm::AnalysisInfoMixin<RIVBitVector>;
+};
+
+//------------------------------------------------------------------------------
+// New PM interface for the printer pass
+//------------------------------------------------------------------------------
+class RIVBitVectorPrinter : public llvm::PassInfoMixin<RIVBitVectorPrinter> {
+public:
+  explicit RIVBitVectorPrinter(llvm::raw_ostream &OutS) : OS(OutS) {}
+  llvm::PreservedAnalyses run(llvm::Function &F,
+                              llvm::FunctionAnalysisManager &FAM);
+
+private:
+  llvm::raw_ostream &OS;
+};
+
+#endif // LLVM_TUTOR_RIV_BIT_VECTOR_H
@@ -0,0 +1,32 @@
+//==============================================================================
+// FILE:
+//    TraceClock.h
+//
+// DESCRIPTION:
+//    Declares the helpers that inject reads of a cheap, monotonic clock into
+//    instrumented code (used by the tracing and timing runtimes).
+//
+//    On x86 the clock is the time-stamp counter (`rdtsc`, via
+//    `llvm.readcyclecounter`). Elsewhere the cycle counter is either not
+//    readable from user space (e.g. AArch64 without PMU access) or not
+//    supported at all, so `clock_gettime(CLOCK_MONOTONIC)` is used instead.
+//    On Linux and Darwin it is served from the vDSO/commpage, i.e. without a
+//    system call.
+//
+// License: MIT
+//==============================================================================
+#ifndef LLVM_TUTOR_TRACE_CLOCK_H
+#define LLVM_TUTOR_TRACE_CLOCK_H
+
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Module.h"
+
+// Returns true if the timestamps in M are CPU cycles (and false if they are
+// nanoseconds)
+bool traceClockCountsCycles(const llvm::Module &M);
+
+// Emits a read of the clock, returning an i64. The first use in M defines
+// `llvm_tutor_clock_ns` if the clock is clock_gettime.
+llvm::Value *CreateReadTraceClock(llvm::IRBuilder<> &Builder, llvm::Module &M);
+
+#endif // LLVM_TUTOR_TRACE_CLOCK_H
@@ -13,6 +13,10 @@
 //    stream). It also demonstrates how instructions can be modified without
 //    having to completely replace them.
 //
+//    All IEEE floating-point types (half, bfloat, float, double, ...) and
+//    fixed and scalable vectors of those are supported. The epsilon is the
+//    machine epsilon of the element type, splatted for vectors.
+//
 //    Originally developed for [1].
 //
 //    [1] "Writing an LLVM Optimization" by Jonathan Smith
@@ -58,6 +62,10 @@ static FCmpInst *convertFCmpEqInstruction(FCmpInst *FCmp) noexcept {
 
   Value *LHS = FCmp->getOperand(0);
   Value *RHS = FCmp->getOperand(1);
+  // ppc_fp128 is a pair of doubles, clearing the top bit is not fabs for it
+  if (LHS->getType()->getScalarType()->isPPC_FP128Ty())
+    return nullptr;
+
   // Determine the new floating-point comparison predicate based on the current
   // one.
   CmpInst::Predicate CmpPred = [FCmp] {
@@ -76,39 +84,43 @@ static FCmpInst *convertFCmpEqInstruction(FCmpInst *FCmp) noexcept {
   }();
 
   // Create the objects and values needed to perform the equality comparison
-  // conversion.
-  Module *M = FCmp->getModule();
-  assert(M && "The given fcmp instruction does not belong to a module");
-  LLVMContext &Ctx = M->getContext();
-  IntegerType *I64Ty = IntegerType::get(Ctx, 64);
-  Type *DoubleTy = Type::getDoubleTy(Ctx);
-
-  // Define the sign-mask and double-precision machine epsilon constants.
-  ConstantInt *SignMask = ConstantInt::get(I64Ty, ~(1L << 63));
-  // The machine epsilon value for IEEE 754 double-precision values is 2 ^ -52
-  // or (b / 2) * b ^ -(p - 1) where b (base) = 2 and p (precision) = 53.
-  APInt EpsilonBits(64, 0x3CB0000000000000);
-  Constant *EpsilonValue =
-      ConstantFP::get(DoubleTy, EpsilonBits.bitsToDouble());
+  // conversion. FPTy is either a floating-point type or a (fixed or scalable)
+  // vector of those, IntTy is the integer type of the same shape (e.g.
+  // <4 x i64> for <4 x double>).
+  Type *FPTy = LHS->getType();
+  const fltSemantics &Sem = FPTy->getScalarType()->getFltSemantics();
+  unsigned Bits = FPTy->getScalarSizeInBits();
+  Type *IntTy =
+      FPTy->getWithNewType(IntegerType::get(FCmp->getContext(), Bits));
+
+  // Define the sign-mask and machine epsilon constants (splatted for vectors).
+  Constant *SignMask = ConstantInt::get(IntTy, APInt::getSignedMaxValue(Bits));
+  // The machine epsilon value for IEEE 754 values is (b / 2) * b ^ -(p - 1)
+  // where b (base) = 2 and p is the precision, e.g. 2 ^ -52 for double (p =
+  // 53) and 2 ^ -23 for float (p = 24).
+  APFloat Epsilon =
+      scalbn(APFloat(Sem, 1), 1 - APFloat::semanticsPrecision(Sem),
+             APFloat::rmNearestTiesToEven);
+  Constant *EpsilonValue = ConstantFP::get(FPTy, Epsilon);
 
   // Create an IRBuilder with an insertion point set to the given fcmp
   // instruction.
   IRBuilder<> Builder(FCmp);
   // Create the subtraction, casting, absolute value, and new comparison
-  // instructions one at a time.
+  // instructions one at a time (shown for double).
   // %0 = fsub double %a, %b
   auto *FSubInst = Builder.CreateFSub(LHS, RHS);
   // %1 = bitcast double %0 to i64
-  auto *CastToI64 = Builder.CreateBitCast(FSubInst, I64Ty);
+  auto *CastToInt = Builder.CreateBitCast(FSubInst, IntTy);
   // %2 = and i64 %1, 0x7fffffffffffffff
-  auto *AbsValue = Builder.CreateAnd(CastToI64, SignMask);
+  auto *AbsValue = Builder.CreateAnd(CastToInt, SignMask);
   // %3 = bitcast i64 %2 to double
-  auto *CastToDouble = Builder.CreateBitCast(AbsValue, DoubleTy);
+  auto *CastToFP = Builder.CreateBitCast(AbsValue, FPTy);
   // %4 = fcmp <olt/ult/oge/uge> double %3, 0x3cb0000000000000
   // Rather than creating a new instruction, we'll just change the predicate and
   // operands of the existing fcmp instruction to match what we want.
   FCmp->setPredicate(CmpPred);
-  FCmp->setOperand(0, CastToDouble);
+  FCmp->setOperand(0, CastToFP);
   FCmp->setOperand(1, EpsilonValue);
   return FCmp;
 }
@@ -29,6 +29,11 @@
 //    All newly created basic blocks are suffixed with the original basic
 //    block's numeric ID.
 //
+//    The dominator tree is updated as the blocks are cloned and so are the
+//    LazyRIV results (see LazyRIVResult::forgetBlock). Both analyses are
+//    preserved, so passes that run after DuplicateBB (including DuplicateBB
+//    itself) don't have to recompute them.
+//
 //  ALGORITHM:
 //    --------------------------------------------------------------------------
 //    The following CFG graph represents function 'F' before and after applying
@@ -79,6 +84,7 @@
 #include "DuplicateBB.h"
 
 #include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/DomTreeUpdater.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Passes/PassBuilder.h"
@@ -100,7 +106,7 @@ using namespace llvm;
 // DuplicateBB Implementation
 //------------------------------------------------------------------------------
 DuplicateBB::BBToSingleRIVMap
-DuplicateBB::findBBsToDuplicate(Function &F, const RIV::Result &RIVResult) {
+DuplicateBB::findBBsToDuplicate(Function &F, LazyRIVResult &RIVResult) {
   BBToSingleRIVMap BlocksToDuplicate;
   //using BBToSingleRIVMap = std::vector<std::tuple<llvm::BasicBlock *, llvm::Value *>>;
 
@@ -110,9 +116,9 @@ DuplicateBB::findBBsToDuplicate(Function &F, const RIV::Result &RIVResult) {
     if (BB.isLandingPad())
       continue;
 
-    // Get the set of RIVs for this block
-    auto const &ReachableValues = RIVResult.lookup(&BB);
-    size_t ReachableValuesCount = ReachableValues.size();
+    // Get the number of RIVs for this block (this doesn't compute the set of
+    // RIVs, see LazyRIV.h)
+    size_t ReachableValuesCount = RIVResult.getNumReachable(&BB);
 
     // Are there any RIVs for this BB? We need at least one to be able to
     // duplicate this BB.
@@ -122,21 +128,20 @@ DuplicateBB::findBBsToDuplicate(Function &F, const RIV::Result &RIVResult) {
     }
 
     // Get a random context value from the RIV set
-    auto Iter = ReachableValues.begin();
-    std::uniform_int_distribution<> Dist(0, ReachableValuesCount - 1);
-    std::advance(Iter, Dist(*pRNG));
+    std::uniform_int_distribution<size_t> Dist(0, ReachableValuesCount - 1);
+    Value *ContextValue = RIVResult.getReachable(&BB, Dist(*pRNG));
 
-    if (dyn_cast<GlobalValue>(*Iter)) {
+    if (dyn_cast<GlobalValue>(ContextValue)) {
       LLVM_DEBUG(errs() << "Random context value is a global variable. "
                         << "Skipping this BB\n");
       continue;
     }
 
-    LLVM_DEBUG(errs() << "Random context value: " << **Iter << "\n");
+    LLVM_DEBUG(errs() << "Random context value: " << *ContextValue << "\n");
 
     // Store the binding between the current BB and the context variable that
     // will be used for the `if-then-else` construct.
-    BlocksToDuplicate.emplace_back(&BB, *Iter);
+    BlocksToDuplicate.emplace_back(&BB, ContextValue);
     //emplace_back is much more efficient than push_back
   }
 
@@ -144,7 +149,8 @@ DuplicateBB::findBBsToDuplicate(Function &F, const RIV::Result &RIVResult) {
 }
 
 void DuplicateBB::cloneBB(BasicBlock &BB, Value *ContextValue,
-                          ValueToPhiMap &ReMapper,Function &F) {
+                          ValueToPhiMap &ReMapper,Function &F,
+                          DomTreeUpdater *DTU) {
   // Don't duplicate Phi nodes - start right after them
   BasicBlock::iterator BBHead = BB.getFirstNonPHIIt();
 
@@ -158,7 +164,8 @@ void DuplicateBB::cloneBB(BasicBlock &BB, Value *ContextValue,
   // tail, which contains all the instructions from BBHead onwards.
   Instruction *ThenTerm = nullptr;
   Instruction *ElseTerm = nullptr;
-  SplitBlockAndInsertIfThenElse(Cond, &*BBHead, &ThenTerm, &ElseTerm);
+  SplitBlockAndInsertIfThenElse(Cond, &*BBHead, &ThenTerm, &ElseTerm,
+                                /*BranchWeights=*/nullptr, DTU);
   BasicBlock *Tail = ThenTerm->getSuccessor(0);
 
   assert(Tail == ElseTerm->getSuccessor(0) && "Inconsistent CFG");
@@ -254,9 +261,12 @@ PreservedAnalyses DuplicateBB::run(llvm::Function &F,
   if (!pRNG)
     pRNG = F.getParent()->createRNG("duplicate-bb");
   
-  BBToSingleRIVMap Targets = findBBsToDuplicate(F, FAM.getResult<RIV>(F));
-  //RIV return a map: llvm::MapVector<const llvm::BasicBlock *, 
-  //                                    llvm::SmallPtrSet<llvm::Value *, 8>>
+  auto &RIVResult = FAM.getResult<LazyRIV>(F);
+  BBToSingleRIVMap Targets = findBBsToDuplicate(F, RIVResult);
+
+  // Keep the dominator tree (and hence RIVResult) up to date while cloning
+  DomTreeUpdater DTU(FAM.getResult<DominatorTreeAnalysis>(F),
+                     DomTreeUpdater::UpdateStrategy::Eager);
 
 
   // This map is used to keep track of the new bindings. Otherwise, the
@@ -266,12 +276,20 @@ PreservedAnalyses DuplicateBB::run(llvm::Function &F,
 
   // Duplicate
   for (auto &BB_Ctx : Targets) {
-    cloneBB(*std::get<0>(BB_Ctx), std::get<1>(BB_Ctx), ReMapper, F);
+    // The instructions of BB are about to be moved to a new block that will
+    // dominate all the blocks that BB dominates
+    RIVResult.forgetBlock(std::get<0>(BB_Ctx));
+    cloneBB(*std::get<0>(BB_Ctx), std::get<1>(BB_Ctx), ReMapper, F, &DTU);
   }
 
   DuplicateBBCountStats = DuplicateBBCount;
-  return (Targets.empty() ? llvm::PreservedAnalyses::all()
-                          : llvm::PreservedAnalyses::none());
+  if (Targets.empty())
+    return llvm::PreservedAnalyses::all();
+
+  llvm::PreservedAnalyses PA;
+  PA.preserve<DominatorTreeAnalysis>();
+  PA.preserve<LazyRIV>();
+  return PA;
 }
 
 //------------------------------------------------------------------------------
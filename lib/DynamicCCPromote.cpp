@@ -0,0 +1,308 @@
+//========================================================================
+// FILE:
+//    DynamicCCPromote.cpp
+//
+// DESCRIPTION:
+//    Promotes the counter updates injected by DynamicCallCounter to registers
+//    inside loops. Once a small instrumented function is inlined into a hot
+//    loop, every iteration does a load/add/store (or an `atomicrmw add`) on
+//    its counter in `DynamicCCCounters`. This pass replaces those updates with
+//    a running total (the "delta") kept in a register, and adds the delta to
+//    the counter in memory on every exit from the loop:
+//    ```IR
+//      preheader:
+//        br label %loop
+//      loop:
+//        %delta = phi i64 [ 0, %preheader ], [ %delta.next, %loop ]
+//        %delta.next = add i64 %delta, 1
+//        ...
+//      exit:
+//        %1 = load i64, ptr @DynamicCCCounters
+//        %2 = add i64 %1, %delta.next
+//        store i64 %2, ptr @DynamicCCCounters
+//    ```
+//    (A PHI node for the delta is only added to exit blocks with several
+//    predecessors.)
+//    Adding the delta (rather than storing the promoted value) keeps the counts
+//    exact even if the counter is also updated outside of the promoted code,
+//    e.g. by a (non-inlined) call from the loop or by another thread. Atomic
+//    updates remain atomic on exit.
+//
+//    Only updates of counters at constant addresses are promoted (i.e. not
+//    with `shards` and not with `shm`, where the address is only known at
+//    run-time). Loops that can be left without going through an exit block,
+//    i.e. through a call that may unwind or never return (e.g. `exit`), are
+//    not promoted - the delta would be lost. Neither are loops without exit
+//    blocks (e.g. the main loop of a server).
+//
+//    The loops have to be in the loop-simplify form (with a preheader and
+//    dedicated exits), which is the case in the standard optimisation
+//    pipelines.
+//
+// USAGE:
+//      $ opt -load-pass-plugin <BUILD_DIR>/lib/libDynamicCallCounter.so `\`
+//        -passes="dynamic-cc,default<O2>,dynamic-cc-promote" <bitcode-file> `\`
+//        -o instrumentend.bin
+//
+// License: MIT
+//========================================================================
+#include "DynamicCCPromote.h"
+
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Transforms/Utils/SSAUpdater.h"
+
+#include <optional>
+
+using namespace llvm;
+
+#define DEBUG_TYPE "dynamic-cc-promote"
+
+//-----------------------------------------------------------------------------
+// DynamicCCPromote implementation
+//-----------------------------------------------------------------------------
+namespace {
+// A promotable counter update, either
+//    %1 = load CounterTy, ptr %Addr
+//    %2 = add CounterTy %1, Inc
+//    store CounterTy %2, ptr %Addr
+// or
+//    atomicrmw add ptr %Addr, CounterTy Inc monotonic
+struct CounterUpdate {
+  Instruction *Update;
+  LoadInst *Load;
+  BinaryOperator *Add;
+  ConstantInt *Inc;
+};
+
+// All the promotable updates of one counter in a loop
+struct PromotedCounter {
+  GlobalVariable *Counters;
+  APInt Offset;
+  IntegerType *CounterTy;
+  bool IsAtomic = false;
+  SmallVector<CounterUpdate, 4> Updates;
+};
+} // namespace
+
+// Returns true if GV is one of the counter arrays created by DynamicCallCounter
+static bool isCounterArray(const GlobalVariable &GV) {
+  return GV.hasLocalLinkage() && !GV.isThreadLocal() &&
+         (GV.getName() == "DynamicCCCounters" ||
+          GV.getName() == "DynamicCCDirectCounters");
+}
+
+// If Ptr points to a counter at a constant address, returns the counter array
+// and sets Offset to the offset of the counter in that array
+static GlobalVariable *getCounterAddress(Value *Ptr, const DataLayout &DL,
+                                         APInt &Offset) {
+  Offset = APInt(DL.getIndexTypeSizeInBits(Ptr->getType()), 0);
+  auto *GV = dyn_cast<GlobalVariable>(
+      Ptr->stripAndAccumulateConstantOffsets(DL, Offset,
+                                             /*AllowNonInbounds=*/false));
+  return (GV && isCounterArray(*GV)) ? GV : nullptr;
+}
+
+// Matches the store of a load/add/store counter update
+static std::optional<CounterUpdate> matchPlainUpdate(StoreInst &SI) {
+  if (!SI.isSimple())
+    return std::nullopt;
+  auto *Add = dyn_cast<BinaryOperator>(SI.getValueOperand());
+  if (!Add || Add->getOpcode() != Instruction::Add || !Add->hasOneUse())
+    return std::nullopt;
+
+  // DynamicCallCounter emits `add 1, %load`, InstCombine canonicalises it to
+  // `add %load, 1`
+  auto *Load = dyn_cast<LoadInst>(Add->getOperand(0));
+  auto *Inc = dyn_cast<ConstantInt>(Add->getOperand(1));
+  if (!Load) {
+    Load = dyn_cast<LoadInst>(Add->getOperand(1));
+    Inc = dyn_cast<ConstantInt>(Add->getOperand(0));
+  }
+  if (!Load || !Inc || !Load->isSimple() || !Load->hasOneUse() ||
+      Load->getPointerOperand() != SI.getPointerOperand() ||
+      Load->getParent() != SI.getParent())
+    return std::nullopt;
+
+  // Nothing may write to the counter between the load and the store
+  for (Instruction *I = Load->getNextNode(); I != &SI; I = I->getNextNode())
+    if (I->mayWriteToMemory())
+      return std::nullopt;
+
+  return CounterUpdate{&SI, Load, Add, Inc};
+}
+
+// Matches a relaxed `atomicrmw add` with an unused result
+static std::optional<CounterUpdate> matchAtomicUpdate(AtomicRMWInst &RMW) {
+  auto *Inc = dyn_cast<ConstantInt>(RMW.getValOperand());
+  if (RMW.getOperation() != AtomicRMWInst::Add || !Inc || RMW.isVolatile() ||
+      RMW.getOrdering() != AtomicOrdering::Monotonic || !RMW.use_empty())
+    return std::nullopt;
+  return CounterUpdate{&RMW, nullptr, nullptr, Inc};
+}
+
+// Returns true if the execution may leave L other than through one of its exit
+// blocks
+static bool mayLeaveLoopAbnormally(const Loop &L) {
+  for (BasicBlock *BB : L.blocks())
+    for (Instruction &I : *BB) {
+      auto *CB = dyn_cast<CallBase>(&I);
+      if (!CB || isa<IntrinsicInst>(CB))
+        continue;
+      // Invokes unwind through a regular CFG edge (i.e. an exit block)
+      if (!isa<InvokeInst>(CB) && !CB->doesNotThrow())
+        return true;
+      if (!CB->willReturn())
+        return true;
+    }
+  return false;
+}
+
+// Collects the promotable counter updates in L
+static SmallVector<PromotedCounter, 4> collectCounters(const Loop &L,
+                                                       const DataLayout &DL) {
+  SmallVector<PromotedCounter, 4> Counters;
+  for (BasicBlock *BB : L.blocks()) {
+    for (Instruction &I : *BB) {
+      std::optional<CounterUpdate> Update;
+      Value *Ptr = nullptr;
+      if (auto *SI = dyn_cast<StoreInst>(&I)) {
+        Update = matchPlainUpdate(*SI);
+        Ptr = SI->getPointerOperand();
+      } else if (auto *RMW = dyn_cast<AtomicRMWInst>(&I)) {
+        Update = matchAtomicUpdate(*RMW);
+        Ptr = RMW->getPointerOperand();
+      }
+      if (!Update)
+        continue;
+
+      APInt Offset;
+      GlobalVariable *GV = getCounterAddress(Ptr, DL, Offset);
+      if (!GV)
+        continue;
+
+      auto It = find_if(Counters, [&](const PromotedCounter &C) {
+        return C.Counters == GV && C.Offset == Offset &&
+               C.CounterTy == Update->Inc->getType();
+      });
+      if (It == Counters.end()) {
+        PromotedCounter C{GV, Offset, Update->Inc->getType()};
+        Counters.push_back(std::move(C));
+        It = std::prev(Counters.end());
+      }
+      // Keep the counter atomic if any of its updates is
+      It->IsAtomic |= isa<AtomicRMWInst>(I);
+      It->Updates.push_back(*Update);
+    }
+  }
+  return Counters;
+}
+
+// Replaces the updates of C in L with a delta in a register that is added to
+// the counter on every exit from L
+static void promoteCounter(Loop &L, PromotedCounter &C,
+                           ArrayRef<BasicBlock *> ExitBlocks) {
+  SmallVector<PHINode *, 8> NewPHIs;
+  SSAUpdater SSA(&NewPHIs);
+  SSA.Initialize(C.CounterTy, "delta");
+  SSA.AddAvailableValue(L.getLoopPreheader(),
+                        ConstantInt::get(C.CounterTy, 0));
+
+  // Chain the updates within every block. The first link of every chain is
+  // connected to the incoming delta once the delta is known for all blocks.
+  SmallVector<std::pair<BasicBlock *, Instruction *>, 8> ChainHeads;
+  SmallDenseMap<BasicBlock *, Instruction *, 8> ChainTails;
+  for (CounterUpdate &U : C.Updates) {
+    BasicBlock *BB = U.Update->getParent();
+    Instruction *Tail = ChainTails.lookup(BB);
+    Value *Prev = Tail ? static_cast<Value *>(Tail)
+                       : PoisonValue::get(C.CounterTy);
+    Instruction *Delta = BinaryOperator::CreateAdd(
+        Prev, U.Inc, "delta.next", U.Update->getIterator());
+    if (!Tail)
+      ChainHeads.push_back({BB, Delta});
+    ChainTails[BB] = Delta;
+  }
+  // The updates were collected in program order, so the last link of every
+  // chain is the outgoing delta of its block
+  for (auto &[BB, Tail] : ChainTails)
+    SSA.AddAvailableValue(BB, Tail);
+  for (auto &[BB, Head] : ChainHeads)
+    Head->setOperand(0, SSA.GetValueInMiddleOfBlock(BB));
+
+  for (CounterUpdate &U : C.Updates) {
+    U.Update->eraseFromParent();
+    if (U.Add) {
+      U.Add->eraseFromParent();
+      U.Load->eraseFromParent();
+    }
+  }
+
+  // Flush the delta on every exit from the loop
+  auto &CTX = C.CounterTy->getContext();
+  for (BasicBlock *Exit : ExitBlocks) {
+    Value *Delta = SSA.GetValueInMiddleOfBlock(Exit);
+    IRBuilder<> Builder(&*Exit->getFirstInsertionPt());
+    Value *Addr = Builder.CreateInBoundsGEP(
+        Type::getInt8Ty(CTX), C.Counters, Builder.getInt(C.Offset));
+    if (C.IsAtomic) {
+      Builder.CreateAtomicRMW(AtomicRMWInst::Add, Addr, Delta,
+                              Align(C.CounterTy->getBitWidth() / 8),
+                              AtomicOrdering::Monotonic);
+      continue;
+    }
+    Value *Count = Builder.CreateLoad(C.CounterTy, Addr);
+    Builder.CreateStore(Builder.CreateAdd(Count, Delta), Addr);
+  }
+}
+
+// Promotes the counters in L or, if that's not possible, in its sub-loops.
+// Returns the number of promoted counters.
+static unsigned promoteLoopNest(Loop &L, const DataLayout &DL) {
+  SmallVector<BasicBlock *, 4> ExitBlocks;
+  L.getUniqueExitBlocks(ExitBlocks);
+
+  bool CanPromote =
+      L.getLoopPreheader() && L.hasDedicatedExits() && !ExitBlocks.empty() &&
+      none_of(ExitBlocks,
+              [](BasicBlock *BB) {
+                return BB->getFirstInsertionPt() == BB->end();
+              }) &&
+      !mayLeaveLoopAbnormally(L);
+
+  if (!CanPromote) {
+    unsigned NumPromoted = 0;
+    for (Loop *SubLoop : L)
+      NumPromoted += promoteLoopNest(*SubLoop, DL);
+    return NumPromoted;
+  }
+
+  SmallVector<PromotedCounter, 4> Counters = collectCounters(L, DL);
+  for (PromotedCounter &C : Counters)
+    promoteCounter(L, C, ExitBlocks);
+  return Counters.size();
+}
+
+PreservedAnalyses DynamicCCPromote::run(Function &F,
+                                        FunctionAnalysisManager &FAM) {
+  LoopInfo &LI = FAM.getResult<LoopAnalysis>(F);
+  const DataLayout &DL = F.getDataLayout();
+
+  // Only the outermost loops are promoted, so that the deltas are flushed as
+  // rarely as possible
+  unsigned NumPromoted = 0;
+  for (Loop *L : LI)
+    NumPromoted += promoteLoopNest(*L, DL);
+
+  if (!NumPromoted)
+    return PreservedAnalyses::all();
+
+  LLVM_DEBUG(dbgs() << " Promoted " << NumPromoted << " counter(s) in "
+                    << F.getName() << "\n");
+
+  // Only instructions (incl. PHI nodes) were added/removed, the CFG is intact
+  PreservedAnalyses PA;
+  PA.preserveSet<CFGAnalyses>();
+  return PA;
+}
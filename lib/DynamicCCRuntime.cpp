@@ -0,0 +1,317 @@
+//========================================================================
+// FILE:
+//    DynamicCCRuntime.cpp
+//
+// DESCRIPTION:
+//    Implements the building blocks shared by the call-counting passes, see
+//    DynamicCCRuntime.h. This file is compiled into every plugin that uses
+//    them.
+//
+// License: MIT
+//========================================================================
+#include "DynamicCCRuntime.h"
+#include "DynamicCCRecord.h"
+#include "NameTable.h"
+
+#include "llvm/Support/MathExtras.h"
+
+using namespace llvm;
+
+//-----------------------------------------------------------------------------
+// Counter layout
+//-----------------------------------------------------------------------------
+CounterLayout CreateCounterArray(Module &M, uint64_t NumFuncs,
+                                 unsigned CounterWidth, unsigned Padding,
+                                 unsigned Shards, bool SharedMemory) {
+  auto &CTX = M.getContext();
+  CounterLayout Layout;
+  Layout.CounterTy = IntegerType::get(CTX, CounterWidth);
+  Layout.NumFuncs = NumFuncs;
+  Layout.NumShards = Shards;
+
+  uint64_t CounterBytes = Layout.CounterTy->getBitWidth() / 8;
+  assert((!Padding || (isPowerOf2_32(Padding) && Padding >= CounterBytes)) &&
+         "The padding has to be a power of two of at least one counter");
+  Layout.StrideElems =
+      std::max<uint64_t>(Padding, CounterBytes) / CounterBytes;
+
+  auto *ArrayTy = ArrayType::get(Layout.CounterTy,
+                                 Layout.NumShards * Layout.getShardElems());
+  Layout.Counters = new GlobalVariable(
+      M, ArrayTy, /*isConstant=*/false, GlobalValue::InternalLinkage,
+      Constant::getNullValue(ArrayTy), "DynamicCCCounters");
+  // Make sure that padded counters really start at the beginning of a cache
+  // line (or whatever the padding is meant to match).
+  Layout.Counters->setAlignment(Align(Layout.StrideElems * CounterBytes));
+
+  if (SharedMemory) {
+    PointerType *PtrTy = PointerType::getUnqual(CTX);
+    Layout.CountersPtr = new GlobalVariable(
+        M, PtrTy, /*isConstant=*/false, GlobalValue::InternalLinkage,
+        Layout.Counters, "DynamicCCCountersPtr");
+  }
+
+  return Layout;
+}
+
+//-----------------------------------------------------------------------------
+// IR helpers
+//-----------------------------------------------------------------------------
+void CreateCountedLoop(IRBuilder<> &Builder, uint64_t N,
+                       function_ref<void(IRBuilder<> &, Value *)> Body) {
+  auto &CTX = Builder.getContext();
+  BasicBlock *Preheader = Builder.GetInsertBlock();
+  Function *F = Preheader->getParent();
+  BasicBlock *Loop = BasicBlock::Create(CTX, "loop", F);
+  BasicBlock *Exit = BasicBlock::Create(CTX, "loop.exit", F);
+
+  Builder.CreateBr(Loop);
+  Builder.SetInsertPoint(Loop);
+  PHINode *IV = Builder.CreatePHI(Builder.getInt64Ty(), 2, "i");
+  IV->addIncoming(Builder.getInt64(0), Preheader);
+
+  Body(Builder, IV);
+
+  Value *Next = Builder.CreateAdd(IV, Builder.getInt64(1), "i.next");
+  IV->addIncoming(Next, Builder.GetInsertBlock());
+  Builder.CreateCondBr(Builder.CreateICmpULT(Next, Builder.getInt64(N)), Loop,
+                       Exit);
+  Builder.SetInsertPoint(Exit);
+}
+
+void CreateIncrement(IRBuilder<> &Builder, IntegerType *CounterTy,
+                     Align CounterAlign, Value *Addr, bool IsAtomic) {
+  Constant *One = ConstantInt::get(CounterTy, 1);
+  if (IsAtomic) {
+    Builder.CreateAtomicRMW(AtomicRMWInst::Add, Addr, One, CounterAlign,
+                            AtomicOrdering::Monotonic);
+    return;
+  }
+  LoadInst *Count = Builder.CreateAlignedLoad(CounterTy, Addr, CounterAlign);
+  Builder.CreateAlignedStore(Builder.CreateAdd(One, Count), Addr,
+                             CounterAlign);
+}
+
+FunctionCallee getOrInsertPrintf(Module &M) {
+  auto &CTX = M.getContext();
+  PointerType *PrintfArgTy = PointerType::getUnqual(CTX);
+  FunctionType *PrintfTy =
+      FunctionType::get(IntegerType::getInt32Ty(CTX), PrintfArgTy,
+                        /*IsVarArgs=*/true);
+  FunctionCallee Printf = M.getOrInsertFunction("printf", PrintfTy);
+
+  // Set attributes as per inferLibFuncAttributes in BuildLibCalls.cpp
+  Function *PrintfF = dyn_cast<Function>(Printf.getCallee());
+  PrintfF->setDoesNotThrow();
+  PrintfF->addParamAttr(
+      0, Attribute::getWithCaptureInfo(CTX, CaptureInfo::none()));
+  PrintfF->addParamAttr(0, Attribute::ReadOnly);
+
+  return Printf;
+}
+
+//-----------------------------------------------------------------------------
+// Text report
+//-----------------------------------------------------------------------------
+// `printf_wrapper` is equivalent to the following C function:
+// ```
+//    void printf_wrapper() {
+//      Flush(NULL);
+//      printf(Header);
+//      for (i = 0; i < NumFuncs; i++) {
+//        Count = 0;
+//        for (Shard = 0; Shard < NumShards; Shard++)
+//          Count += DynamicCCCounters[Shard][i * Stride];
+//        printf(Format, &LLVMTutorNames[DynamicCCNameOffsets[i]], Count,
+//               ExtraColumn[i]);
+//      }
+//    }
+// ```
+// It has internal linkage, so that it does not clash with the wrappers
+// created by other passes that run on the same module.
+Function *CreateTextReport(Module &M, StringRef Title,
+                           const CounterLayout &Layout, NameTable &Names,
+                           ArrayRef<uint32_t> NameOffsets,
+                           GlobalVariable *ExtraColumn,
+                           StringRef ExtraColumnName, Function *Flush) {
+  auto &CTX = M.getContext();
+  PointerType *PtrTy = PointerType::getUnqual(CTX);
+  IntegerType *Int32Ty = Type::getInt32Ty(CTX);
+  FunctionCallee Printf = getOrInsertPrintf(M);
+
+  // The names are stored as 32-bit offsets into the name table rather than as
+  // pointers, so that DynamicCCNameOffsets needs no relocations.
+  Constant *NameOffsetsInit = ConstantDataArray::get(CTX, NameOffsets);
+  auto *NameOffsetsVar = new GlobalVariable(
+      M, NameOffsetsInit->getType(), /*isConstant=*/true,
+      GlobalValue::PrivateLinkage, NameOffsetsInit, "DynamicCCNameOffsets");
+
+  Function *PrintfWrapperF = Function::Create(
+      FunctionType::get(Type::getVoidTy(CTX), false),
+      GlobalValue::InternalLinkage, "printf_wrapper", M);
+  IRBuilder<> Builder(BasicBlock::Create(CTX, "enter", PrintfWrapperF));
+
+  // In the TLS mode, the thread that runs the global destructors (normally
+  // the main thread) has not been flushed yet - do it now.
+  if (Flush)
+    Builder.CreateCall(Flush, {ConstantPointerNull::get(PtrTy)});
+
+  // The columns are 20 + 1 and 16 + 1 characters wide. The conversion
+  // specifier of the count has to match the width of the counters exactly,
+  // otherwise printf reads garbage (or worse) from the variadic arguments.
+  // `long long` is 64-bit on all platforms supported by LLVM, unlike `long`.
+  std::string Header;
+  Header += "=================================================\n";
+  Header += ("LLVM-TUTOR: " + Title + "\n").str();
+  Header += "=================================================\n";
+  Header += "NAME                 #N DIRECT CALLS";
+  Header += ExtraColumn ? ("  " + ExtraColumnName + "\n").str() : "\n";
+  Header += "-------------------------------------------------\n";
+  Builder.CreateCall(Printf, {Builder.CreateGlobalString(Header)});
+
+  std::string Format = ExtraColumn ? "%-20s %-16" : "%-20s %-10";
+  Format += (Layout.CounterTy->getBitWidth() == 64) ? "llu" : "u";
+  Format += ExtraColumn ? " %u\n" : "\n";
+  Value *FormatStr = Builder.CreateGlobalString(Format);
+
+  Value *CountersBase = Layout.getBase(Builder);
+  CreateCountedLoop(
+      Builder, Layout.NumFuncs, [&](IRBuilder<> &Builder, Value *I) {
+        // Merge the shards. This is the real function call counter.
+        Value *CounterIdx =
+            Builder.CreateMul(I, Builder.getInt64(Layout.StrideElems));
+        Value *Count = nullptr;
+        for (uint64_t Shard = 0; Shard < Layout.NumShards; Shard++) {
+          Value *Idx = Builder.CreateAdd(
+              CounterIdx, Builder.getInt64(Shard * Layout.getShardElems()));
+          Value *ShardCount = Builder.CreateLoad(
+              Layout.CounterTy, Builder.CreateInBoundsGEP(
+                                    Layout.CounterTy, CountersBase, Idx));
+          Count = Count ? Builder.CreateAdd(Count, ShardCount) : ShardCount;
+        }
+
+        SmallVector<Value *, 4> Args;
+        Args.push_back(FormatStr);
+        Args.push_back(Names.CreateAddress(
+            Builder,
+            Builder.CreateLoad(Int32Ty, Builder.CreateInBoundsGEP(
+                                            Int32Ty, NameOffsetsVar, I))));
+        Args.push_back(Count);
+        if (ExtraColumn)
+          Args.push_back(Builder.CreateLoad(
+              Int32Ty, Builder.CreateInBoundsGEP(Int32Ty, ExtraColumn, I)));
+        Builder.CreateCall(Printf, Args);
+      });
+
+  Builder.CreateRetVoid();
+  return PrintfWrapperF;
+}
+
+//-----------------------------------------------------------------------------
+// Binary report
+//-----------------------------------------------------------------------------
+GlobalVariable *CreateRecordPrefix(Module &M, const CounterLayout &Layout,
+                                   ArrayRef<Function *> Funcs) {
+  auto &CTX = M.getContext();
+
+  std::string Names;
+  for (Function *F : Funcs) {
+    Names += F->getName();
+    Names.push_back('\0');
+  }
+  uint32_t NamesSize = Names.size();
+  uint64_t CountersOffset =
+      alignTo(sizeof(DynamicCCRecordHeader) + NamesSize,
+              DynamicCCRecordHeader::CountersAlignment);
+  Names.resize(CountersOffset - sizeof(DynamicCCRecordHeader), '\0');
+
+  uint32_t CounterBytes = Layout.CounterTy->getBitWidth() / 8;
+  // The fields of DynamicCCRecordHeader, in order. Emitting them as IR
+  // integers (rather than copying the host's struct) means that the record
+  // uses the byte order of the target.
+  uint32_t HeaderFields[] = {DynamicCCRecordHeader::MagicValue,
+                             DynamicCCRecordHeader::CurrentVersion,
+                             CounterBytes,
+                             static_cast<uint32_t>(Layout.NumFuncs),
+                             static_cast<uint32_t>(Layout.NumShards),
+                             static_cast<uint32_t>(Layout.StrideElems *
+                                                   CounterBytes),
+                             NamesSize,
+                             static_cast<uint32_t>(CountersOffset)};
+
+  Constant *Prefix = ConstantStruct::getAnon(
+      {ConstantDataArray::get(CTX, ArrayRef<uint32_t>(HeaderFields)),
+       ConstantDataArray::getString(CTX, Names, /*AddNull=*/false)},
+      /*Packed=*/true);
+  return new GlobalVariable(M, Prefix->getType(), /*isConstant=*/true,
+                            GlobalValue::PrivateLinkage, Prefix,
+                            "DynamicCCRecordPrefix");
+}
+
+// `dynamic_cc_dump` is the replacement for `printf_wrapper` in the binary
+// mode. It is equivalent to the following C code:
+// ```
+//    void dynamic_cc_dump() {
+//      Flush(NULL); // if set, e.g. dynamic_cc_flush_tls in the TLS mode
+//      const char *Path = getenv("LLVM_TUTOR_CC_OUTPUT");
+//      FILE *Out = fopen(Path ? Path : "dynamic-cc.bin", "wb");
+//      if (!Out)
+//        return;
+//      fwrite(&DynamicCCRecordPrefix, sizeof(DynamicCCRecordPrefix), 1, Out);
+//      fwrite(DynamicCCCountersPtr, sizeof(DynamicCCCounters), 1, Out);
+//      fclose(Out);
+//    }
+// ```
+Function *CreateBinaryDump(Module &M, const CounterLayout &Layout,
+                           GlobalVariable *Prefix, Function *Flush) {
+  auto &CTX = M.getContext();
+  const DataLayout &DL = M.getDataLayout();
+  PointerType *PtrTy = PointerType::getUnqual(CTX);
+  IntegerType *SizeTy = DL.getIntPtrType(CTX);
+
+  FunctionCallee Getenv = M.getOrInsertFunction(
+      "getenv", FunctionType::get(PtrTy, {PtrTy}, false));
+  FunctionCallee Fopen = M.getOrInsertFunction(
+      "fopen", FunctionType::get(PtrTy, {PtrTy, PtrTy}, false));
+  FunctionCallee Fwrite = M.getOrInsertFunction(
+      "fwrite",
+      FunctionType::get(SizeTy, {PtrTy, SizeTy, SizeTy, PtrTy}, false));
+  FunctionCallee Fclose = M.getOrInsertFunction(
+      "fclose", FunctionType::get(Type::getInt32Ty(CTX), {PtrTy}, false));
+
+  Function *DumpF = Function::Create(
+      FunctionType::get(Type::getVoidTy(CTX), false),
+      GlobalValue::InternalLinkage, "dynamic_cc_dump", M);
+  BasicBlock *Entry = BasicBlock::Create(CTX, "enter", DumpF);
+  BasicBlock *Write = BasicBlock::Create(CTX, "write", DumpF);
+  BasicBlock *Exit = BasicBlock::Create(CTX, "exit", DumpF);
+
+  IRBuilder<> Builder(Entry);
+  if (Flush)
+    Builder.CreateCall(Flush, {ConstantPointerNull::get(PtrTy)});
+
+  Value *EnvPath = Builder.CreateCall(
+      Getenv, {Builder.CreateGlobalString(DynamicCCOutputEnvVar)});
+  Value *Path = Builder.CreateSelect(
+      Builder.CreateIsNull(EnvPath),
+      Builder.CreateGlobalString(DynamicCCDefaultOutput), EnvPath);
+  Value *Out =
+      Builder.CreateCall(Fopen, {Path, Builder.CreateGlobalString("wb")});
+  Builder.CreateCondBr(Builder.CreateIsNull(Out), Exit, Write);
+
+  Builder.SetInsertPoint(Write);
+  auto SizeOf = [&](GlobalVariable *GV) {
+    return ConstantInt::get(SizeTy, DL.getTypeAllocSize(GV->getValueType()));
+  };
+  Builder.CreateCall(Fwrite,
+                     {Prefix, SizeOf(Prefix), ConstantInt::get(SizeTy, 1), Out});
+  Builder.CreateCall(Fwrite, {Layout.getBase(Builder), SizeOf(Layout.Counters),
+                              ConstantInt::get(SizeTy, 1), Out});
+  Builder.CreateCall(Fclose, {Out});
+  Builder.CreateBr(Exit);
+
+  Builder.SetInsertPoint(Exit);
+  Builder.CreateRetVoid();
+
+  return DumpF;
+}
@@ -11,228 +11,1086 @@
 //
 //    This pass adds/injects code that will count function calls at
 //    runtime and prints the results when the module exits. More specifically:
-//      1. For every function F _defined_ in M:
-//          * defines a global variable, `i32 CounterFor_F`, initialised with 0
-//          * adds instructions at the beginning of F that increment `CounterFor_F`
-//            every time F executes
-//      2. At the end of the module (after `main`), calls `printf_wrapper` that
-//         prints the global call counters injected by this pass (e.g.
-//         `CounterFor_F`). The definition of `printf_wrapper` is also inserted by
-//         DynamicCallCounter.
+//      1. Every function F _defined_ in M is given a dense ID (0, 1, 2, ...,
+//         in the order of definition).
+//      2. Defines one global array, `DynamicCCCounters`, that holds the call
+//         counters of all functions, initialised with 0. The counter for F
+//         lives at index `ID(F) * Stride`. The counters are 64-bit wide by
+//         default, `dynamic-cc<width=32>` selects 32-bit counters.
+//      3. Adds instructions at the beginning of F that increment F's counter
+//         every time F executes.
+//      4. At the end of the module (after `main`), calls `printf_wrapper` that
+//         prints the counters from `DynamicCCCounters`. The definition of
+//         `printf_wrapper` is also inserted by DynamicCallCounter.
 //
 //    To illustrate, the following code will be injected at the beginning of
-//    function F (defined in the input module):
+//    function F with ID 2 (defined in the input module):
 //    ```IR
-//      %1 = load i32, i32* @CounterFor_F
-//      %2 = add i32 1, %1
-//      store i32 %2, i32* @CounterFor_F
+//      %1 = getelementptr inbounds i64, ptr @DynamicCCCounters, i64 2
+//      %2 = load i64, ptr %1
+//      %3 = add i64 1, %2
+//      store i64 %3, ptr %1
 //    ```
-//    The following definition of `CounterFor_F` is also added:
+//    The following definition of `DynamicCCCounters` is also added (for a
+//    module with 4 functions):
 //    ```IR
-//      @CounterFor_foo = common global i32 0, align 4
+//      @DynamicCCCounters = internal global [4 x i64] zeroinitializer, align 8
 //    ```
 //
 //    This pass will only count calls to functions _defined_ in the input
 //    module. Functions that are only _declared_ (and defined elsewhere) are not
 //    counted.
 //
+//    The plain load/add/store above is not thread-safe. Two additional modes
+//    are available for multi-threaded programs:
+//      * `dynamic-cc<atomic>` - the counters are updated with a relaxed
+//        (monotonic) atomic add:
+//        ```IR
+//          %2 = atomicrmw add ptr %1, i64 1 monotonic, align 8
+//        ```
+//      * `dynamic-cc<tls>` - every thread increments its own, thread_local copy
+//        of the counters (`DynamicCCCounters.tls`). The per-thread copies are
+//        atomically added to `DynamicCCCounters` when the thread exits (through
+//        a pthread key destructor) and, for the thread that runs the global
+//        destructors, right before the results are printed. There is no
+//        cross-core traffic on the hot path, so the overhead does not grow
+//        with the number of cores.
+//    All three modes give exact counts for single-threaded programs. Only
+//    `atomic` and `tls` are exact when more than one thread is involved (for
+//    `tls`, threads that are still running when the module exits are not
+//    accounted for).
+//
+//    Densely packed counters of hot functions share cache lines, which leads
+//    to false sharing between cores. The layout of `DynamicCCCounters` can be
+//    tuned with two more parameters:
+//      * `pad=<N>` - place consecutive counters N bytes apart (e.g. `pad=64`
+//        gives every counter its own cache line). N has to be a power of two
+//        that is at least the size of a counter (or 0 for no padding).
+//      * `shards=<N>` - keep N copies (shards) of the counters. Every thread
+//        updates one shard, selected by hashing the address of its TLS block.
+//        The shards are summed up in `printf_wrapper`. N has to be a power of
+//        two. Not available in the `tls` mode (there, every thread already has
+//        its own counters).
+//    Parameters are separated with `;`, e.g. `dynamic-cc<atomic;pad=64>`.
+//
+//    Printing one line per function at exit gets slow for modules with many
+//    functions. With `dynamic-cc<format=bin>`, the results are instead written
+//    as one binary record (a header, the function-name table and the raw
+//    counter array - see DynamicCCRecord.h) to the file named by the
+//    LLVM_TUTOR_CC_OUTPUT environment variable (`dynamic-cc.bin` by default).
+//    Use the `cc-dump` tool to print the record as a table or as JSON.
+//
+//    Long-running processes (e.g. daemons) may never exit cleanly. With
+//    `dynamic-cc<shm>`, a constructor maps the file named by the
+//    LLVM_TUTOR_CC_SHM environment variable (e.g. `/dev/shm/my-daemon` for
+//    POSIX shared memory on Linux) and lays out the same binary record in it.
+//    From then on the counters are updated in place, so `cc-dump` can take a
+//    snapshot at any time. The hot path only gains one load of the array
+//    address (`DynamicCCCountersPtr`), there are no extra syscalls. When the
+//    variable is not set, the counters stay in `DynamicCCCounters`. Not
+//    available in the `tls` mode (the per-thread counters only reach the
+//    shared array when a thread exits, so a snapshot would miss the threads
+//    that are still running).
+//
+//    Even a single add per call is too much for latency-sensitive code. With
+//    `dynamic-cc<sample=N>`, every thread keeps a countdown (in TLS) that is
+//    decremented on every call. Only when it expires, the counter of the
+//    function that is being called is incremented by N (atomically) and the
+//    countdown is reset. The hot path is thus a thread-local decrement and a
+//    well-predicted branch. The counts are estimates with an error of at most
+//    N per thread and function, so N should be much smaller than the counts of
+//    interest. The period can be overridden at run-time through the
+//    LLVM_TUTOR_CC_SAMPLE environment variable. Not available in the `tls`
+//    mode.
+//
+//    Function entry counts don't say which callers drive the load. With
+//    `dynamic-cc<edges>`, every call site in the module gets a counter as
+//    well, keyed by (caller, callee, call-site index), where the index is the
+//    position of the call among the calls in the caller. Indirect calls are
+//    counted per run-time target: every indirect call site has a small table
+//    of (target, counter) slots, filled on first use (calls to further targets
+//    are counted as `<other>`). Targets are mapped back to function names when
+//    the results are printed. The call-site counters are updated atomically
+//    in the `atomic` and `tls` modes. This mode requires `format=text` and is
+//    not available with `shm`.
+//
+//    When instrumented functions are later inlined into hot loops, the
+//    counter updates end up inside those loops. The `dynamic-cc-promote`
+//    function pass (see DynamicCCPromote.cpp), which is part of this plugin,
+//    promotes them to registers and flushes them on loop exits.
+//
 // USAGE:
 //      $ opt -load-pass-plugin <BUILD_DIR>/lib/libDynamicCallCounter.so `\`
 //        -passes=-"dynamic-cc" <bitcode-file> -o instrumentend.bin
 //      $ lli instrumented.bin
+//    or, for multi-threaded inputs:
+//      $ opt -load-pass-plugin <BUILD_DIR>/lib/libDynamicCallCounter.so `\`
+//        -passes=-"dynamic-cc<tls>" <bitcode-file> -o instrumentend.bin
 //
 // License: MIT
 //========================================================================
 #include "DynamicCallCounter.h"
+#include "DynamicCCPromote.h"
+#include "DynamicCCRecord.h"
+#include "DynamicCCRuntime.h"
+#include "NameTable.h"
 
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/TargetParser/Triple.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/Transforms/Utils/ModuleUtils.h"
 
 using namespace llvm;
 
 #define DEBUG_TYPE "dynamic-cc"
 
-Constant *CreateGlobalCounter(Module &M, StringRef GlobalVarName) {
+// Returns the position in F where the call-counting code is injected. Static
+// allocas at the top of the entry block are skipped so that they stay in the
+// entry block even if the instrumentation splits it (see the TLS mode).
+static BasicBlock::iterator getInstrumentationPoint(Function &F) {
+  BasicBlock::iterator It = F.getEntryBlock().getFirstInsertionPt();
+  while (isa<AllocaInst>(*It))
+    ++It;
+  return It;
+}
+
+// Returns the index of the first shard element that belongs to the current
+// thread. Threads are spread over the shards by hashing the address of a
+// thread_local variable (Fibonacci hashing), which costs a couple of ALU
+// instructions and no memory accesses.
+static Value *CreateShardOffset(IRBuilder<> &Builder,
+                                const CounterLayout &Layout,
+                                GlobalVariable *ShardAnchor) {
+  if (Layout.NumShards == 1)
+    return Builder.getInt64(0);
+
+  Value *Addr = Builder.CreatePtrToInt(
+      Builder.CreateThreadLocalAddress(ShardAnchor), Builder.getInt64Ty());
+  Value *Hash = Builder.CreateMul(Addr, Builder.getInt64(0x9E3779B97F4A7C15));
+  Value *Shard =
+      Builder.CreateLShr(Hash, 64 - Log2_64(Layout.NumShards), "shard");
+  return Builder.CreateMul(Shard, Builder.getInt64(Layout.getShardElems()));
+}
+
+//-----------------------------------------------------------------------------
+// TLS mode runtime
+//-----------------------------------------------------------------------------
+// Everything that the TLS mode needs at run-time, i.e. a pthread key per module
+// and the functions that flush the per-thread counters into the shared ones.
+// The injected code is equivalent to this C code:
+// ```
+//    static pthread_key_t DynamicCCThreadKey;
+//    static __thread char DynamicCCThreadRegistered;
+//
+//    static void dynamic_cc_flush_tls(void *) {
+//      for (i = 0; i < NumFuncs; i++) {
+//        __atomic_fetch_add(&DynamicCCCounters[i * Stride],
+//                           DynamicCCCounters.tls[i], __ATOMIC_RELAXED);
+//        DynamicCCCounters.tls[i] = 0;
+//      }
+//    }
+//    static void dynamic_cc_register_thread() {
+//      DynamicCCThreadRegistered = 1;
+//      // Any non-null value will do - it only enables the destructor
+//      pthread_setspecific(DynamicCCThreadKey, &DynamicCCThreadKey);
+//    }
+//    __attribute__((constructor)) static void dynamic_cc_init_tls() {
+//      pthread_key_create(&DynamicCCThreadKey, dynamic_cc_flush_tls);
+//    }
+// ```
+struct TLSRuntime {
+  GlobalVariable *Counters = nullptr;
+  GlobalVariable *Registered = nullptr;
+  Function *Flush = nullptr;
+  Function *RegisterThread = nullptr;
+};
+
+static TLSRuntime CreateTLSRuntime(Module &M, const CounterLayout &Layout) {
   auto &CTX = M.getContext();
+  PointerType *PtrTy = PointerType::getUnqual(CTX);
+  Type *VoidTy = Type::getVoidTy(CTX);
+  TLSRuntime RT;
+
+  // The per-thread counters are never shared, so there's no need for padding
+  auto *TLSArrayTy = ArrayType::get(Layout.CounterTy, Layout.NumFuncs);
+  RT.Counters = new GlobalVariable(
+      M, TLSArrayTy, /*isConstant=*/false, GlobalValue::InternalLinkage,
+      Constant::getNullValue(TLSArrayTy), "DynamicCCCounters.tls",
+      /*InsertBefore=*/nullptr, GlobalValue::GeneralDynamicTLSModel);
+  RT.Counters->setAlignment(Layout.getCounterAlign());
+
+  // pthread_key_t is `unsigned int` on Linux and `unsigned long` on Darwin
+  Type *KeyTy = M.getTargetTriple().isOSDarwin() ? Type::getInt64Ty(CTX)
+                                                 : Type::getInt32Ty(CTX);
+  auto *Key = new GlobalVariable(M, KeyTy, /*isConstant=*/false,
+                                 GlobalValue::InternalLinkage,
+                                 Constant::getNullValue(KeyTy),
+                                 "DynamicCCThreadKey");
+
+  RT.Registered = new GlobalVariable(
+      M, Type::getInt8Ty(CTX), /*isConstant=*/false,
+      GlobalValue::InternalLinkage, ConstantInt::get(Type::getInt8Ty(CTX), 0),
+      "DynamicCCThreadRegistered", /*InsertBefore=*/nullptr,
+      GlobalValue::GeneralDynamicTLSModel);
 
-  // This will insert a declaration into M
-  Constant *NewGlobalVar =
-      M.getOrInsertGlobal(GlobalVarName, IntegerType::getInt32Ty(CTX));
+  // void dynamic_cc_flush_tls(void *)
+  RT.Flush = Function::Create(FunctionType::get(VoidTy, {PtrTy}, false),
+                              GlobalValue::InternalLinkage,
+                              "dynamic_cc_flush_tls", M);
+  {
+    IRBuilder<> Builder(BasicBlock::Create(CTX, "enter", RT.Flush));
+    Value *TLSBase = Builder.CreateThreadLocalAddress(RT.Counters);
+    Value *SharedBase = Layout.getBase(Builder);
+    CreateCountedLoop(
+        Builder, Layout.NumFuncs, [&](IRBuilder<> &Builder, Value *I) {
+          Value *TLSAddr =
+              Builder.CreateInBoundsGEP(Layout.CounterTy, TLSBase, I);
+          Value *SharedAddr = Builder.CreateInBoundsGEP(
+              Layout.CounterTy, SharedBase,
+              Builder.CreateMul(I, Builder.getInt64(Layout.StrideElems)));
+          Value *Count = Builder.CreateLoad(Layout.CounterTy, TLSAddr);
+          Builder.CreateAtomicRMW(AtomicRMWInst::Add, SharedAddr, Count,
+                                  Layout.getCounterAlign(),
+                                  AtomicOrdering::Monotonic);
+          Builder.CreateStore(Constant::getNullValue(Layout.CounterTy),
+                              TLSAddr);
+        });
+    Builder.CreateRetVoid();
+  }
 
-  // This will change the declaration into definition (and initialise to 0)
-  GlobalVariable *NewGV = M.getNamedGlobal(GlobalVarName);
-  NewGV->setLinkage(GlobalValue::CommonLinkage);
-  NewGV->setAlignment(MaybeAlign(4));
-  NewGV->setInitializer(llvm::ConstantInt::get(CTX, APInt(32, 0)));
+  // void dynamic_cc_register_thread()
+  FunctionCallee SetSpecific = M.getOrInsertFunction(
+      "pthread_setspecific",
+      FunctionType::get(Type::getInt32Ty(CTX), {KeyTy, PtrTy}, false));
+  RT.RegisterThread = Function::Create(FunctionType::get(VoidTy, false),
+                                       GlobalValue::InternalLinkage,
+                                       "dynamic_cc_register_thread", M);
+  RT.RegisterThread->addFnAttr(Attribute::Cold);
+  RT.RegisterThread->addFnAttr(Attribute::NoInline);
+  {
+    IRBuilder<> Builder(BasicBlock::Create(CTX, "enter", RT.RegisterThread));
+    Builder.CreateStore(Builder.getInt8(1),
+                        Builder.CreateThreadLocalAddress(RT.Registered));
+    Builder.CreateCall(SetSpecific,
+                       {Builder.CreateLoad(KeyTy, Key), Key});
+    Builder.CreateRetVoid();
+  }
 
-  return NewGlobalVar;
+  // void dynamic_cc_init_tls(), executed before main
+  FunctionCallee KeyCreate = M.getOrInsertFunction(
+      "pthread_key_create",
+      FunctionType::get(Type::getInt32Ty(CTX), {PtrTy, PtrTy}, false));
+  Function *Init = Function::Create(FunctionType::get(VoidTy, false),
+                                    GlobalValue::InternalLinkage,
+                                    "dynamic_cc_init_tls", M);
+  {
+    IRBuilder<> Builder(BasicBlock::Create(CTX, "enter", Init));
+    Builder.CreateCall(KeyCreate, {Key, RT.Flush});
+    Builder.CreateRetVoid();
+  }
+  appendToGlobalCtors(M, Init, /*Priority=*/0);
+
+  return RT;
+}
+
+//-----------------------------------------------------------------------------
+// Sampling mode runtime
+//-----------------------------------------------------------------------------
+// The environment variable that overrides the sampling period at run-time
+static constexpr const char *SamplePeriodEnvVar = "LLVM_TUTOR_CC_SAMPLE";
+
+// Everything that the sampling mode needs at run-time. The injected code is
+// equivalent to this C code:
+// ```
+//    static unsigned DynamicCCSamplePeriod = N;
+//    static __thread int DynamicCCSampleCountdown;
+//
+//    static void dynamic_cc_take_sample(CounterTy *Counter) {
+//      DynamicCCSampleCountdown = DynamicCCSamplePeriod;
+//      __atomic_fetch_add(Counter, DynamicCCSamplePeriod, __ATOMIC_RELAXED);
+//    }
+//    __attribute__((constructor)) static void dynamic_cc_init_sampling() {
+//      const char *Period = getenv("LLVM_TUTOR_CC_SAMPLE");
+//      if (Period && atoi(Period) > 0)
+//        DynamicCCSamplePeriod = atoi(Period);
+//    }
+// ```
+// The countdown starts at 0, so the first call on every thread is sampled.
+struct SamplingRuntime {
+  GlobalVariable *Countdown = nullptr;
+  Function *TakeSample = nullptr;
+};
+
+static SamplingRuntime CreateSamplingRuntime(Module &M,
+                                             const CounterLayout &Layout,
+                                             unsigned SamplePeriod) {
+  auto &CTX = M.getContext();
+  PointerType *PtrTy = PointerType::getUnqual(CTX);
+  IntegerType *Int32Ty = Type::getInt32Ty(CTX);
+  SamplingRuntime RT;
+
+  auto *Period = new GlobalVariable(M, Int32Ty, /*isConstant=*/false,
+                                    GlobalValue::InternalLinkage,
+                                    ConstantInt::get(Int32Ty, SamplePeriod),
+                                    "DynamicCCSamplePeriod");
+  RT.Countdown = new GlobalVariable(
+      M, Int32Ty, /*isConstant=*/false, GlobalValue::InternalLinkage,
+      ConstantInt::get(Int32Ty, 0), "DynamicCCSampleCountdown",
+      /*InsertBefore=*/nullptr, GlobalValue::GeneralDynamicTLSModel);
+
+  // void dynamic_cc_take_sample(ptr)
+  RT.TakeSample = Function::Create(
+      FunctionType::get(Type::getVoidTy(CTX), {PtrTy}, false),
+      GlobalValue::InternalLinkage, "dynamic_cc_take_sample", M);
+  RT.TakeSample->addFnAttr(Attribute::Cold);
+  RT.TakeSample->addFnAttr(Attribute::NoInline);
+  {
+    IRBuilder<> Builder(BasicBlock::Create(CTX, "enter", RT.TakeSample));
+    Value *N = Builder.CreateLoad(Int32Ty, Period, "period");
+    Builder.CreateStore(N, Builder.CreateThreadLocalAddress(RT.Countdown));
+    Builder.CreateAtomicRMW(AtomicRMWInst::Add, RT.TakeSample->getArg(0),
+                            Builder.CreateZExtOrTrunc(N, Layout.CounterTy),
+                            Layout.getCounterAlign(),
+                            AtomicOrdering::Monotonic);
+    Builder.CreateRetVoid();
+  }
+
+  // void dynamic_cc_init_sampling(), executed before main
+  FunctionCallee Getenv = M.getOrInsertFunction(
+      "getenv", FunctionType::get(PtrTy, {PtrTy}, false));
+  FunctionCallee Atoi = M.getOrInsertFunction(
+      "atoi", FunctionType::get(Int32Ty, {PtrTy}, false));
+  Function *Init = Function::Create(
+      FunctionType::get(Type::getVoidTy(CTX), false),
+      GlobalValue::InternalLinkage, "dynamic_cc_init_sampling", M);
+  {
+    BasicBlock *Entry = BasicBlock::Create(CTX, "enter", Init);
+    BasicBlock *Parse = BasicBlock::Create(CTX, "parse", Init);
+    BasicBlock *Set = BasicBlock::Create(CTX, "set", Init);
+    BasicBlock *Exit = BasicBlock::Create(CTX, "exit", Init);
+
+    IRBuilder<> Builder(Entry);
+    Value *EnvPeriod = Builder.CreateCall(
+        Getenv, {Builder.CreateGlobalString(SamplePeriodEnvVar)});
+    Builder.CreateCondBr(Builder.CreateIsNull(EnvPeriod), Exit, Parse);
+
+    Builder.SetInsertPoint(Parse);
+    Value *N = Builder.CreateCall(Atoi, {EnvPeriod});
+    Builder.CreateCondBr(Builder.CreateICmpSGT(N, Builder.getInt32(0)), Set,
+                         Exit);
+
+    Builder.SetInsertPoint(Set);
+    Builder.CreateStore(N, Period);
+    Builder.CreateBr(Exit);
+
+    Builder.SetInsertPoint(Exit);
+    Builder.CreateRetVoid();
+  }
+  appendToGlobalCtors(M, Init, /*Priority=*/0);
+
+  return RT;
+}
+
+//-----------------------------------------------------------------------------
+// Shared memory
+//-----------------------------------------------------------------------------
+// Creates `dynamic_cc_map_shm`, a constructor that moves the counter array
+// into a memory-mapped file. It is equivalent to the following C code:
+// ```
+//    __attribute__((constructor)) static void dynamic_cc_map_shm() {
+//      const char *Path = getenv("LLVM_TUTOR_CC_SHM");
+//      if (!Path)
+//        return;
+//      int FD = open(Path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+//      if (FD < 0)
+//        return;
+//      if (ftruncate(FD, RecordSize) != 0) {
+//        close(FD);
+//        return;
+//      }
+//      char *Record = mmap(NULL, RecordSize, PROT_READ | PROT_WRITE,
+//                          MAP_SHARED, FD, 0);
+//      close(FD);
+//      if (Record == MAP_FAILED)
+//        return;
+//      memcpy(Record, &DynamicCCRecordPrefix, sizeof(DynamicCCRecordPrefix));
+//      DynamicCCCountersPtr = Record + sizeof(DynamicCCRecordPrefix);
+//    }
+// ```
+// The constructor runs with the highest priority, so calls made from other
+// constructors are counted as well (unless they run in another module first).
+static Function *CreateSharedMemoryMap(Module &M, const CounterLayout &Layout,
+                                       GlobalVariable *Prefix) {
+  auto &CTX = M.getContext();
+  const DataLayout &DL = M.getDataLayout();
+  PointerType *PtrTy = PointerType::getUnqual(CTX);
+  IntegerType *Int32Ty = Type::getInt32Ty(CTX);
+  // size_t, and off_t for the default (non-LFS) 32-bit and all 64-bit ABIs
+  IntegerType *SizeTy = DL.getIntPtrType(CTX);
+
+  // The values of these flags differ between Linux and Darwin. PROT_* and
+  // MAP_SHARED are the same.
+  bool IsDarwin = M.getTargetTriple().isOSDarwin();
+  const uint32_t O_RDWR_ = 0x2;
+  const uint32_t O_CREAT_ = IsDarwin ? 0x200 : 0x40;
+  const uint32_t O_TRUNC_ = IsDarwin ? 0x400 : 0x200;
+  const uint32_t PROT_READ_WRITE_ = 0x1 | 0x2;
+  const uint32_t MAP_SHARED_ = 0x1;
+
+  FunctionCallee Getenv = M.getOrInsertFunction(
+      "getenv", FunctionType::get(PtrTy, {PtrTy}, false));
+  FunctionCallee Open = M.getOrInsertFunction(
+      "open", FunctionType::get(Int32Ty, {PtrTy, Int32Ty}, /*isVarArg=*/true));
+  FunctionCallee Ftruncate = M.getOrInsertFunction(
+      "ftruncate", FunctionType::get(Int32Ty, {Int32Ty, SizeTy}, false));
+  FunctionCallee Mmap = M.getOrInsertFunction(
+      "mmap", FunctionType::get(PtrTy,
+                                {PtrTy, SizeTy, Int32Ty, Int32Ty, Int32Ty,
+                                 SizeTy},
+                                false));
+  FunctionCallee Close = M.getOrInsertFunction(
+      "close", FunctionType::get(Int32Ty, {Int32Ty}, false));
+
+  uint64_t PrefixSize = DL.getTypeAllocSize(Prefix->getValueType());
+  uint64_t RecordSize =
+      PrefixSize + DL.getTypeAllocSize(Layout.Counters->getValueType());
+
+  Function *MapF = Function::Create(
+      FunctionType::get(Type::getVoidTy(CTX), false),
+      GlobalValue::InternalLinkage, "dynamic_cc_map_shm", M);
+  BasicBlock *Entry = BasicBlock::Create(CTX, "enter", MapF);
+  BasicBlock *Opened = BasicBlock::Create(CTX, "opened", MapF);
+  BasicBlock *Resized = BasicBlock::Create(CTX, "resized", MapF);
+  BasicBlock *CloseAndExit = BasicBlock::Create(CTX, "close", MapF);
+  BasicBlock *Mapped = BasicBlock::Create(CTX, "mapped", MapF);
+  BasicBlock *Exit = BasicBlock::Create(CTX, "exit", MapF);
+
+  IRBuilder<> Builder(Entry);
+  Value *Path = Builder.CreateCall(
+      Getenv, {Builder.CreateGlobalString(DynamicCCSharedMemoryEnvVar)});
+  BasicBlock *GotPath = BasicBlock::Create(CTX, "got.path", MapF, Opened);
+  Builder.CreateCondBr(Builder.CreateIsNull(Path), Exit, GotPath);
+
+  Builder.SetInsertPoint(GotPath);
+  Value *FD = Builder.CreateCall(
+      Open, {Path, Builder.getInt32(O_RDWR_ | O_CREAT_ | O_TRUNC_),
+             Builder.getInt32(0644)});
+  Builder.CreateCondBr(Builder.CreateICmpSLT(FD, Builder.getInt32(0)), Exit,
+                       Opened);
+
+  Builder.SetInsertPoint(Opened);
+  Value *TruncRes =
+      Builder.CreateCall(Ftruncate, {FD, ConstantInt::get(SizeTy, RecordSize)});
+  Builder.CreateCondBr(Builder.CreateIsNotNull(TruncRes), CloseAndExit,
+                       Resized);
+
+  Builder.SetInsertPoint(Resized);
+  Value *Record = Builder.CreateCall(
+      Mmap, {ConstantPointerNull::get(PtrTy),
+             ConstantInt::get(SizeTy, RecordSize),
+             Builder.getInt32(PROT_READ_WRITE_), Builder.getInt32(MAP_SHARED_),
+             FD, ConstantInt::get(SizeTy, 0)});
+  Builder.CreateCall(Close, {FD});
+  // MAP_FAILED is (void *)-1
+  Value *MapFailed = Builder.CreateICmpEQ(
+      Builder.CreatePtrToInt(Record, SizeTy), ConstantInt::getAllOnesValue(SizeTy));
+  Builder.CreateCondBr(MapFailed, Exit, Mapped);
+
+  Builder.SetInsertPoint(Mapped);
+  Builder.CreateMemCpy(Record, MaybeAlign(), Prefix, MaybeAlign(), PrefixSize);
+  Builder.CreateStore(Builder.CreateConstInBoundsGEP1_64(
+                          Builder.getInt8Ty(), Record, PrefixSize),
+                      Layout.CountersPtr);
+  Builder.CreateBr(Exit);
+
+  Builder.SetInsertPoint(CloseAndExit);
+  Builder.CreateCall(Close, {FD});
+  Builder.CreateBr(Exit);
+
+  Builder.SetInsertPoint(Exit);
+  Builder.CreateRetVoid();
+
+  return MapF;
+}
+
+//-----------------------------------------------------------------------------
+// Call-graph edges
+//-----------------------------------------------------------------------------
+// The number of distinct run-time targets tracked per indirect call site
+static constexpr unsigned IndirectTargetsPerSite = 4;
+
+struct CallSite {
+  CallBase *CB;
+  Function *Caller;
+  // The position of CB among the call sites of Caller
+  unsigned Index;
+};
+
+// The call-site counters of `dynamic-cc<edges>`:
+//    CounterTy DynamicCCDirectCounters[NumDirectSites];
+//    struct { void *Target; CounterTy Count; }
+//      DynamicCCIndirectSlots[NumIndirectSites][IndirectTargetsPerSite];
+//    CounterTy DynamicCCIndirectOther[NumIndirectSites];
+struct EdgeCounters {
+  SmallVector<CallSite, 16> DirectSites;
+  SmallVector<CallSite, 16> IndirectSites;
+  GlobalVariable *Direct = nullptr;
+  GlobalVariable *IndirectSlots = nullptr;
+  GlobalVariable *IndirectOther = nullptr;
+  StructType *SlotTy = nullptr;
+  // void dynamic_cc_count_indirect(ptr Slots, ptr Other, ptr Target)
+  Function *CountIndirect = nullptr;
+};
+
+// Returns true if CB is a call that should be counted as a call-graph edge.
+// Intrinsics are not real calls and inline asm has no callee.
+static bool isCountedCallSite(const CallBase &CB) {
+  return !isa<IntrinsicInst>(CB) && !CB.isInlineAsm();
+}
+
+// Creates `dynamic_cc_count_indirect`, which finds (or claims) the slot of
+// Target in the slot table of an indirect call site and increments it. It is
+// equivalent to the following C code (unrolled, with the claim done with a
+// compare-and-swap when IsAtomic is set):
+// ```
+//    void dynamic_cc_count_indirect(Slot *Slots, CounterTy *Other,
+//                                   void *Target) {
+//      for (i = 0; i < IndirectTargetsPerSite; i++) {
+//        if (Slots[i].Target == NULL)
+//          Slots[i].Target = Target;
+//        if (Slots[i].Target == Target) {
+//          Slots[i].Count++;
+//          return;
+//        }
+//      }
+//      (*Other)++;
+//    }
+// ```
+static Function *CreateCountIndirect(Module &M, StructType *SlotTy,
+                                     IntegerType *CounterTy, bool IsAtomic) {
+  auto &CTX = M.getContext();
+  PointerType *PtrTy = PointerType::getUnqual(CTX);
+  Function *CountF = Function::Create(
+      FunctionType::get(Type::getVoidTy(CTX), {PtrTy, PtrTy, PtrTy}, false),
+      GlobalValue::InternalLinkage, "dynamic_cc_count_indirect", M);
+  CountF->addFnAttr(Attribute::NoUnwind);
+  Align CounterAlign(CounterTy->getBitWidth() / 8);
+  Value *Slots = CountF->getArg(0);
+  Value *Other = CountF->getArg(1);
+  Value *Target = CountF->getArg(2);
+
+  IRBuilder<> Builder(BasicBlock::Create(CTX, "enter", CountF));
+  BasicBlock *OtherBB = BasicBlock::Create(CTX, "other", CountF);
+  for (unsigned I = 0; I < IndirectTargetsPerSite; I++) {
+    BasicBlock *Hit = BasicBlock::Create(CTX, "hit", CountF, OtherBB);
+    BasicBlock *Free = BasicBlock::Create(CTX, "free", CountF, OtherBB);
+    BasicBlock *Next = (I + 1 == IndirectTargetsPerSite)
+                           ? OtherBB
+                           : BasicBlock::Create(CTX, "slot", CountF, OtherBB);
+
+    Value *TargetAddr = Builder.CreateConstInBoundsGEP2_32(SlotTy, Slots, I, 0);
+    LoadInst *SlotTarget = Builder.CreateLoad(PtrTy, TargetAddr);
+    if (IsAtomic) {
+      SlotTarget->setAtomic(AtomicOrdering::Monotonic);
+      SlotTarget->setAlignment(M.getDataLayout().getPointerABIAlignment(0));
+    }
+    Builder.CreateCondBr(Builder.CreateICmpEQ(SlotTarget, Target), Hit, Free);
+
+    // The slot is either free (claim it) or taken by another target
+    Builder.SetInsertPoint(Free);
+    BasicBlock *Claim = BasicBlock::Create(CTX, "claim", CountF, Next);
+    Builder.CreateCondBr(Builder.CreateIsNull(SlotTarget), Claim, Next);
+    Builder.SetInsertPoint(Claim);
+    if (IsAtomic) {
+      // Another thread may claim the slot first - possibly for this target
+      Value *Res = Builder.CreateAtomicCmpXchg(
+          TargetAddr, ConstantPointerNull::get(PtrTy), Target, MaybeAlign(),
+          AtomicOrdering::Monotonic, AtomicOrdering::Monotonic);
+      Value *Old = Builder.CreateExtractValue(Res, 0);
+      Builder.CreateCondBr(Builder.CreateOr(Builder.CreateExtractValue(Res, 1),
+                                            Builder.CreateICmpEQ(Old, Target)),
+                           Hit, Next);
+    } else {
+      Builder.CreateStore(Target, TargetAddr);
+      Builder.CreateBr(Hit);
+    }
+
+    Builder.SetInsertPoint(Hit);
+    CreateIncrement(Builder, CounterTy, CounterAlign,
+                    Builder.CreateConstInBoundsGEP2_32(SlotTy, Slots, I, 1),
+                    IsAtomic);
+    Builder.CreateRetVoid();
+
+    Builder.SetInsertPoint(Next);
+  }
+
+  // All the slots are taken by other targets
+  CreateIncrement(Builder, CounterTy, CounterAlign, Other, IsAtomic);
+  Builder.CreateRetVoid();
+
+  return CountF;
+}
+
+// Collects the call sites in Funcs and creates their counters
+static EdgeCounters CreateEdgeCounters(Module &M, ArrayRef<Function *> Funcs,
+                                       IntegerType *CounterTy, bool IsAtomic) {
+  auto &CTX = M.getContext();
+  EdgeCounters Edges;
+
+  for (Function *F : Funcs) {
+    unsigned Index = 0;
+    for (auto &I : instructions(F)) {
+      auto *CB = dyn_cast<CallBase>(&I);
+      if (!CB || !isCountedCallSite(*CB))
+        continue;
+      CallSite Site{CB, F, Index++};
+      if (isa<Function>(CB->getCalledOperand()->stripPointerCasts()))
+        Edges.DirectSites.push_back(Site);
+      else
+        Edges.IndirectSites.push_back(Site);
+    }
+  }
+
+  auto *DirectTy = ArrayType::get(CounterTy, Edges.DirectSites.size());
+  Edges.Direct = new GlobalVariable(
+      M, DirectTy, /*isConstant=*/false, GlobalValue::InternalLinkage,
+      Constant::getNullValue(DirectTy), "DynamicCCDirectCounters");
+
+  Edges.SlotTy = StructType::get(CTX, {PointerType::getUnqual(CTX), CounterTy});
+  auto *SlotsTy = ArrayType::get(
+      ArrayType::get(Edges.SlotTy, IndirectTargetsPerSite),
+      Edges.IndirectSites.size());
+  Edges.IndirectSlots = new GlobalVariable(
+      M, SlotsTy, /*isConstant=*/false, GlobalValue::InternalLinkage,
+      Constant::getNullValue(SlotsTy), "DynamicCCIndirectSlots");
+  auto *OtherTy = ArrayType::get(CounterTy, Edges.IndirectSites.size());
+  Edges.IndirectOther = new GlobalVariable(
+      M, OtherTy, /*isConstant=*/false, GlobalValue::InternalLinkage,
+      Constant::getNullValue(OtherTy), "DynamicCCIndirectOther");
+
+  if (!Edges.IndirectSites.empty())
+    Edges.CountIndirect =
+        CreateCountIndirect(M, Edges.SlotTy, CounterTy, IsAtomic);
+
+  return Edges;
+}
+
+// Injects the call-site counting code right before every collected call site
+static void InstrumentCallSites(const EdgeCounters &Edges,
+                                IntegerType *CounterTy, bool IsAtomic) {
+  Align CounterAlign(CounterTy->getBitWidth() / 8);
+  for (auto [ID, Site] : enumerate(Edges.DirectSites)) {
+    IRBuilder<> Builder(Site.CB);
+    CreateIncrement(Builder, CounterTy, CounterAlign,
+                    Builder.CreateConstInBoundsGEP2_64(
+                        Edges.Direct->getValueType(), Edges.Direct, 0, ID),
+                    IsAtomic);
+  }
+
+  for (auto [ID, Site] : enumerate(Edges.IndirectSites)) {
+    IRBuilder<> Builder(Site.CB);
+    Value *Slots = Builder.CreateConstInBoundsGEP2_64(
+        Edges.IndirectSlots->getValueType(), Edges.IndirectSlots, 0, ID);
+    Value *Other = Builder.CreateConstInBoundsGEP2_64(
+        Edges.IndirectOther->getValueType(), Edges.IndirectOther, 0, ID);
+    Builder.CreateCall(Edges.CountIndirect,
+                       {Slots, Other, Site.CB->getCalledOperand()});
+  }
+}
+
+// Creates `dynamic_cc_target_name`, which maps the run-time target of an
+// indirect call back to the function name. Only functions whose address is
+// taken in this module can be targets of indirect calls made from it
+// (functions from other modules are reported as `<unknown>`). It is
+// equivalent to the following C code:
+// ```
+//    const char *dynamic_cc_target_name(void *Target) {
+//      unsigned Name = offsetof("<unknown>");
+//      for (i = 0; i < NumTargets; i++)
+//        if (DynamicCCTargets[i].Fn == Target)
+//          Name = DynamicCCTargets[i].Name;
+//      return &LLVMTutorNames[Name];
+//    }
+// ```
+// (the names are offsets into the name table, see NameTable.h)
+static Function *CreateTargetNameLookup(Module &M, NameTable &Names) {
+  auto &CTX = M.getContext();
+  PointerType *PtrTy = PointerType::getUnqual(CTX);
+  IntegerType *Int32Ty = Type::getInt32Ty(CTX);
+
+  Function *LookupF = Function::Create(FunctionType::get(PtrTy, {PtrTy}, false),
+                                       GlobalValue::InternalLinkage,
+                                       "dynamic_cc_target_name", M);
+  IRBuilder<> Builder(BasicBlock::Create(CTX, "enter", LookupF));
+  Value *Target = LookupF->getArg(0);
+
+  //    struct { void *Fn; unsigned Name; } DynamicCCTargets[NumTargets];
+  auto *TargetTy = StructType::get(CTX, {PtrTy, Int32Ty});
+  SmallVector<Constant *, 16> Entries;
+  for (Function &F : M)
+    if (!F.isIntrinsic() && F.hasAddressTaken() && &F != LookupF)
+      Entries.push_back(ConstantStruct::get(
+          TargetTy, {&F, ConstantInt::get(Int32Ty, Names.add(F.getName()))}));
+
+  Value *Unknown = Builder.getInt32(Names.add("<unknown>"));
+  Names.finalize();
+  if (Entries.empty()) {
+    Builder.CreateRet(Names.CreateAddress(Builder, Unknown));
+    return LookupF;
+  }
+
+  auto *TableTy = ArrayType::get(TargetTy, Entries.size());
+  auto *Table = new GlobalVariable(M, TableTy, /*isConstant=*/true,
+                                   GlobalValue::PrivateLinkage,
+                                   ConstantArray::get(TableTy, Entries),
+                                   "DynamicCCTargets");
+
+  BasicBlock *Preheader = Builder.GetInsertBlock();
+  Value *Name = nullptr;
+  CreateCountedLoop(
+      Builder, Entries.size(), [&](IRBuilder<> &Builder, Value *I) {
+        PHINode *PrevName = Builder.CreatePHI(Int32Ty, 2, "name.offset");
+        PrevName->addIncoming(Unknown, Preheader);
+        Value *Entry = Builder.CreateInBoundsGEP(TargetTy, Table, I);
+        Value *Fn = Builder.CreateLoad(
+            PtrTy, Builder.CreateStructGEP(TargetTy, Entry, 0));
+        Value *FnName = Builder.CreateLoad(
+            Int32Ty, Builder.CreateStructGEP(TargetTy, Entry, 1));
+        Name = Builder.CreateSelect(Builder.CreateICmpEQ(Fn, Target), FnName,
+                                    PrevName);
+        PrevName->addIncoming(Name, Builder.GetInsertBlock());
+      });
+  Builder.CreateRet(Names.CreateAddress(Builder, Name));
+  return LookupF;
+}
+
+// Creates `dynamic_cc_print_edges`, which prints the call-site counters. It
+// is equivalent to the following C code:
+// ```
+//    void dynamic_cc_print_edges() {
+//      printf(Header);
+//      for (i = 0; i < NumDirectSites; i++)
+//        if (DynamicCCDirectCounters[i])
+//          printf(Format, DirectSites[i].Caller, DirectSites[i].Callee,
+//                 DirectSites[i].Index, DynamicCCDirectCounters[i]);
+//      for (i = 0; i < NumIndirectSites; i++) {
+//        for (j = 0; j < IndirectTargetsPerSite; j++)
+//          if (DynamicCCIndirectSlots[i][j].Target)
+//            printf(Format, IndirectSites[i].Caller,
+//                   dynamic_cc_target_name(DynamicCCIndirectSlots[i][j].Target),
+//                   IndirectSites[i].Index, DynamicCCIndirectSlots[i][j].Count);
+//        if (DynamicCCIndirectOther[i])
+//          printf(Format, IndirectSites[i].Caller, "<other>",
+//                 IndirectSites[i].Index, DynamicCCIndirectOther[i]);
+//      }
+//    }
+// ```
+// Only the call sites that were executed at least once are printed.
+static Function *CreateEdgeReport(Module &M, const EdgeCounters &Edges,
+                                  IntegerType *CounterTy, FunctionCallee Printf,
+                                  NameTable &Names) {
+  auto &CTX = M.getContext();
+  PointerType *PtrTy = PointerType::getUnqual(CTX);
+  IntegerType *Int32Ty = Type::getInt32Ty(CTX);
+
+  Function *ReportF = Function::Create(
+      FunctionType::get(Type::getVoidTy(CTX), false),
+      GlobalValue::InternalLinkage, "dynamic_cc_print_edges", M);
+  IRBuilder<> Builder(BasicBlock::Create(CTX, "enter", ReportF));
+
+  // The call sites, indexed like the counters. The names are offsets into the
+  // name table (see NameTable.h), so the tables need no relocations:
+  //    struct { unsigned Caller; unsigned Callee; unsigned Index; }
+  // (Callee is only meaningful for direct call sites)
+  auto *SiteTy = StructType::get(CTX, {Int32Ty, Int32Ty, Int32Ty});
+  auto GetNameOffset = [&](StringRef Name) {
+    return ConstantInt::get(Int32Ty, Names.add(Name));
+  };
+  auto CreateSiteTable = [&](ArrayRef<CallSite> Sites, StringRef TableName) {
+    SmallVector<Constant *, 16> Entries;
+    for (const CallSite &Site : Sites) {
+      auto *Callee = dyn_cast<Function>(
+          Site.CB->getCalledOperand()->stripPointerCasts());
+      Entries.push_back(ConstantStruct::get(
+          SiteTy, {GetNameOffset(Site.Caller->getName()),
+                   Callee ? GetNameOffset(Callee->getName())
+                          : ConstantInt::get(Int32Ty, 0),
+                   ConstantInt::get(Int32Ty, Site.Index)}));
+    }
+    auto *TableTy = ArrayType::get(SiteTy, Entries.size());
+    return new GlobalVariable(M, TableTy, /*isConstant=*/true,
+                              GlobalValue::PrivateLinkage,
+                              ConstantArray::get(TableTy, Entries), TableName);
+  };
+  GlobalVariable *DirectSitesVar =
+      CreateSiteTable(Edges.DirectSites, "DynamicCCDirectSites");
+  GlobalVariable *IndirectSitesVar =
+      CreateSiteTable(Edges.IndirectSites, "DynamicCCIndirectSites");
+  uint32_t OtherName = Names.add("<other>");
+  Names.finalize();
+
+  std::string Header;
+  Header += "=================================================\n";
+  Header += "LLVM-TUTOR: dynamic call graph\n";
+  Header += "=================================================\n";
+  Header += "CALLER               CALLEE               SITE   #N CALLS\n";
+  Header += "-------------------------------------------------\n";
+  Builder.CreateCall(Printf, {Builder.CreateGlobalString(Header)});
+
+  // The conversion specifier has to match the width of the counters exactly
+  Value *Format = Builder.CreateGlobalString(
+      CounterTy->getBitWidth() == 64 ? "%-20s %-20s %-6u %-10llu\n"
+                                     : "%-20s %-20s %-6u %-10u\n");
+
+  // Emits `if (Count) printf(Format, Caller, GetCallee(), Index, Count)`
+  auto CreatePrintEdge = [&](IRBuilder<> &Builder, Value *Site, Value *Count,
+                             function_ref<Value *(IRBuilder<> &)> GetCallee) {
+    BasicBlock *Print = BasicBlock::Create(CTX, "print", ReportF);
+    BasicBlock *Next = BasicBlock::Create(CTX, "next", ReportF);
+    Builder.CreateCondBr(Builder.CreateIsNotNull(Count), Print, Next);
+    Builder.SetInsertPoint(Print);
+    Value *Caller = Names.CreateAddress(
+        Builder, Builder.CreateLoad(Int32Ty,
+                                    Builder.CreateStructGEP(SiteTy, Site, 0)));
+    Value *Index = Builder.CreateLoad(
+        Int32Ty, Builder.CreateStructGEP(SiteTy, Site, 2), "index");
+    Builder.CreateCall(Printf,
+                       {Format, Caller, GetCallee(Builder), Index, Count});
+    Builder.CreateBr(Next);
+    Builder.SetInsertPoint(Next);
+  };
+
+  if (!Edges.DirectSites.empty())
+    CreateCountedLoop(
+        Builder, Edges.DirectSites.size(), [&](IRBuilder<> &Builder, Value *I) {
+          Value *Site = Builder.CreateInBoundsGEP(SiteTy, DirectSitesVar, I);
+          Value *Count = Builder.CreateLoad(
+              CounterTy, Builder.CreateInBoundsGEP(CounterTy, Edges.Direct, I));
+          CreatePrintEdge(Builder, Site, Count, [&](IRBuilder<> &Builder) {
+            return Names.CreateAddress(
+                Builder, Builder.CreateLoad(
+                             Int32Ty, Builder.CreateStructGEP(SiteTy, Site, 1)));
+          });
+        });
+
+  if (!Edges.IndirectSites.empty()) {
+    Function *TargetName = CreateTargetNameLookup(M, Names);
+    Value *OtherStr = Names.getAddress(OtherName);
+    Type *SiteSlotsTy = ArrayType::get(Edges.SlotTy, IndirectTargetsPerSite);
+    CreateCountedLoop(
+        Builder, Edges.IndirectSites.size(),
+        [&](IRBuilder<> &Builder, Value *I) {
+          Value *Site = Builder.CreateInBoundsGEP(SiteTy, IndirectSitesVar, I);
+          Value *Slots =
+              Builder.CreateInBoundsGEP(SiteSlotsTy, Edges.IndirectSlots, I);
+          for (unsigned J = 0; J < IndirectTargetsPerSite; J++) {
+            // A slot is in use iff its counter is non-zero
+            Value *Count = Builder.CreateLoad(
+                CounterTy, Builder.CreateConstInBoundsGEP2_32(Edges.SlotTy,
+                                                              Slots, J, 1));
+            CreatePrintEdge(Builder, Site, Count, [&](IRBuilder<> &Builder) {
+              Value *Target = Builder.CreateLoad(
+                  PtrTy, Builder.CreateConstInBoundsGEP2_32(Edges.SlotTy,
+                                                            Slots, J, 0));
+              return Builder.CreateCall(TargetName, {Target});
+            });
+          }
+          Value *Other = Builder.CreateLoad(
+              CounterTy,
+              Builder.CreateInBoundsGEP(CounterTy, Edges.IndirectOther, I));
+          CreatePrintEdge(Builder, Site, Other,
+                          [&](IRBuilder<> &) { return OtherStr; });
+        });
+  }
+
+  Builder.CreateRetVoid();
+  return ReportF;
 }
 
 //-----------------------------------------------------------------------------
 // DynamicCallCounter implementation
 //-----------------------------------------------------------------------------
 bool DynamicCallCounter::runOnModule(Module &M) {
-  bool Instrumented = false;
+  // Functions to instrument. The position in this vector is the function's ID,
+  // i.e. the index of its counter.
+  SmallVector<Function *, 16> Funcs;
+  InstrumentationFilter Filter(Opts.Filter);
+  for (auto &F : M)
+    if (Filter.shouldInstrument(F))
+      Funcs.push_back(&F);
 
-  // Function name <--> IR variable that holds the call counter
-  llvm::StringMap<Constant *> CallCounterMap;
-  // Function name <--> IR variable that holds the function name
-  llvm::StringMap<Constant *> FuncNameMap;
+  // Stop here if there are no function definitions in this module
+  if (Funcs.empty())
+    return false;
 
   auto &CTX = M.getContext();
 
-  // STEP 1: For each function in the module, inject a call-counting code
-  // --------------------------------------------------------------------
-  for (auto &F : M) {
-    if (F.isDeclaration())
-      continue;
+  // STEP 1: Create the counters (and, in the TLS mode, the code that merges
+  // the per-thread counters)
+  // -----------------------------------------------------------------------
+  CounterLayout Layout =
+      CreateCounterArray(M, Funcs.size(), Opts.CounterWidth, Opts.Padding,
+                         Opts.Shards, Opts.SharedMemory);
 
+  TLSRuntime RT;
+  if (Opts.Mode == CounterUpdateMode::TLS)
+    RT = CreateTLSRuntime(M, Layout);
+
+  SamplingRuntime SamplingRT;
+  if (Opts.SamplePeriod)
+    SamplingRT = CreateSamplingRuntime(M, Layout, Opts.SamplePeriod);
+
+  GlobalVariable *ShardAnchor = nullptr;
+  if (Layout.NumShards > 1)
+    ShardAnchor = new GlobalVariable(
+        M, Type::getInt8Ty(CTX), /*isConstant=*/false,
+        GlobalValue::InternalLinkage, ConstantInt::get(Type::getInt8Ty(CTX), 0),
+        "DynamicCCShardAnchor", /*InsertBefore=*/nullptr,
+        GlobalValue::GeneralDynamicTLSModel);
+
+  // The header and the function-name table of the binary record, shared by
+  // the binary report and the shared-memory mapping
+  GlobalVariable *RecordPrefix = nullptr;
+  if (Opts.Format == ReportFormat::Binary || Opts.SharedMemory)
+    RecordPrefix = CreateRecordPrefix(M, Layout, Funcs);
+
+  if (Opts.SharedMemory)
+    appendToGlobalCtors(M, CreateSharedMemoryMap(M, Layout, RecordPrefix),
+                        /*Priority=*/0);
+
+  // The call sites are collected before any instrumentation is injected, so
+  // that calls made by the instrumentation itself are not counted
+  bool AtomicEdges = Opts.Mode != CounterUpdateMode::Plain;
+  EdgeCounters Edges;
+  if (Opts.CountEdges)
+    Edges = CreateEdgeCounters(M, Funcs, Layout.CounterTy, AtomicEdges);
+
+  MDNode *Unlikely = MDBuilder(CTX).createUnlikelyBranchWeights();
+
+  // Function ID <--> offset of the function name in the name table
+  NameTable Names(M);
+  SmallVector<uint32_t, 16> FuncNameOffsets;
+
+  // STEP 2: For each function in the module, inject a call-counting code
+  // --------------------------------------------------------------------
+  for (auto [ID, F] : enumerate(Funcs)) {
     // Get an IR builder. Sets the insertion point to the top of the function
-    IRBuilder<> Builder(&*F.getEntryBlock().getFirstInsertionPt());
-
-    // Create a global variable to count the calls to this function
-    std::string CounterName = "CounterFor_" + std::string(F.getName());
-    //debug:97 Constant *Var = CreateGlobalCounter(M, CounterName);
-    //(gdb) p CounterName
-    //$1 = "CounterFor_foo"
-    Constant *Var = CreateGlobalCounter(M, CounterName);
-    //
-    CallCounterMap[F.getName()] = Var;
-
-    // Create a global variable to hold the name of this function
-    auto FuncName = Builder.CreateGlobalString(F.getName());
-    FuncNameMap[F.getName()] = FuncName;
-    //get func for print func cuz we need to print func name later
+    IRBuilder<> Builder(&*getInstrumentationPoint(*F));
+
+    // Add the name of this function to the name table (the binary record has
+    // its own name table)
+    if (Opts.Format == ReportFormat::Text)
+      FuncNameOffsets.push_back(Names.add(F->getName()));
 
     // Inject instruction to increment the call count each time this function
     // executes
-    LoadInst *Load2 = Builder.CreateLoad(IntegerType::getInt32Ty(CTX), Var);
-    //%1 = load i32, ptr @CounterFor_foo, align 4
-    Value *Inc2 = Builder.CreateAdd(Builder.getInt32(1), Load2);
-    //%2 = add i32 1, %1
-    Builder.CreateStore(Inc2, Var);
-    //store i32 %2, ptr @CounterFor_foo, align 4
+    switch (Opts.Mode) {
+    case CounterUpdateMode::Plain:
+    case CounterUpdateMode::Atomic: {
+      if (Opts.SamplePeriod) {
+        // Only the expiry of the per-thread countdown touches the counter:
+        //    if (--DynamicCCSampleCountdown <= 0)
+        //      dynamic_cc_take_sample(&DynamicCCCounters[ID * Stride]);
+        Instruction *SplitBefore = &*Builder.GetInsertPoint();
+        Value *CountdownAddr =
+            Builder.CreateThreadLocalAddress(SamplingRT.Countdown);
+        Value *Countdown = Builder.CreateSub(
+            Builder.CreateLoad(Builder.getInt32Ty(), CountdownAddr),
+            Builder.getInt32(1));
+        Builder.CreateStore(Countdown, CountdownAddr);
+        Instruction *ThenTerm = SplitBlockAndInsertIfThen(
+            Builder.CreateICmpSLE(Countdown, Builder.getInt32(0)),
+            SplitBefore->getIterator(), /*Unreachable=*/false, Unlikely);
+
+        IRBuilder<> SampleBuilder(ThenTerm);
+        Value *Idx = SampleBuilder.CreateAdd(
+            CreateShardOffset(SampleBuilder, Layout, ShardAnchor),
+            SampleBuilder.getInt64(ID * Layout.StrideElems));
+        SampleBuilder.CreateCall(
+            SamplingRT.TakeSample,
+            {SampleBuilder.CreateInBoundsGEP(
+                Layout.CounterTy, Layout.getBase(SampleBuilder), Idx)});
+        break;
+      }
+
+      Value *Idx = Builder.CreateAdd(
+          CreateShardOffset(Builder, Layout, ShardAnchor),
+          Builder.getInt64(ID * Layout.StrideElems));
+      Value *Var = Builder.CreateInBoundsGEP(Layout.CounterTy,
+                                             Layout.getBase(Builder), Idx);
+      //%1 = getelementptr inbounds i64, ptr @DynamicCCCounters, i64 ID
+
+      CreateIncrement(Builder, Layout, Var,
+                      Opts.Mode == CounterUpdateMode::Atomic);
+      //%2 = atomicrmw add ptr %1, i64 1 monotonic, align 8
+      // or
+      //%2 = load i64, ptr %1, align 8
+      //%3 = add i64 1, %2
+      //store i64 %3, ptr %1, align 8
+      break;
+    }
+    case CounterUpdateMode::TLS: {
+      Value *TLSAddr = Builder.CreateConstInBoundsGEP1_64(
+          Layout.CounterTy, Builder.CreateThreadLocalAddress(RT.Counters), ID);
+      CreateIncrement(Builder, Layout, TLSAddr, /*IsAtomic=*/false);
+
+      // The first call on every thread registers that thread, so that its
+      // counters are flushed when it exits:
+      //    if (!DynamicCCThreadRegistered)
+      //      dynamic_cc_register_thread();
+      Instruction *SplitBefore = &*Builder.GetInsertPoint();
+      Value *IsRegistered = Builder.CreateLoad(
+          Builder.getInt8Ty(),
+          Builder.CreateThreadLocalAddress(RT.Registered));
+      Instruction *ThenTerm = SplitBlockAndInsertIfThen(
+          Builder.CreateIsNull(IsRegistered), SplitBefore->getIterator(),
+          /*Unreachable=*/false, Unlikely);
+      IRBuilder<>(ThenTerm).CreateCall(RT.RegisterThread);
+      break;
+    }
+    }
 
     // The following is visible only if you pass -debug on the command line
     // *and* you have an assert build.
-    LLVM_DEBUG(dbgs() << " Instrumented: " << F.getName() << "\n");
+    LLVM_DEBUG(dbgs() << " Instrumented: " << F->getName() << " (ID " << ID
+                      << ")\n");
+  }
 
-    Instrumented = true;
+  if (Opts.CountEdges)
+    InstrumentCallSites(Edges, Layout.CounterTy, AtomicEdges);
+
+  // In the binary mode, a single record is written instead of the table below
+  if (Opts.Format == ReportFormat::Binary) {
+    appendToGlobalDtors(M, CreateBinaryDump(M, Layout, RecordPrefix, RT.Flush),
+                        /*Priority=*/0);
+    return true;
   }
 
-  // Stop here if there are no function definitions in this module
-  if (false == Instrumented)
-    return Instrumented;
-
-  // STEP 2: Inject the declaration of printf
-  // ----------------------------------------
-  // Create (or _get_ in cases where it's already available) the following
-  // declaration in the IR module:
-  //    declare i32 @printf(i8*, ...)
-  // It corresponds to the following C declaration:
-  //    int printf(char *, ...)
-  PointerType *PrintfArgTy = PointerType::getUnqual(Type::getInt8Ty(CTX));
-  //char * 8bit ptr
-  FunctionType *PrintfTy =
-      FunctionType::get(IntegerType::getInt32Ty(CTX), PrintfArgTy,
-                        /*IsVarArgs=*/true);
-  //func signature  return int 32bit, first arg char* (8bit ptr), var args
-
-  FunctionCallee Printf = M.getOrInsertFunction("printf", PrintfTy);
-  //check if printf is already in the module, if not insert it with the above signature
-  //we got something like this now:
-  //int printf(const char *format, ...); c style
-  //llvm ir:declare i32 @printf(i8*, ...)
-
-  // Set attributes as per inferLibFuncAttributes in BuildLibCalls.cpp
-  Function *PrintfF = dyn_cast<Function>(Printf.getCallee());
-  PrintfF->setDoesNotThrow();
-  PrintfF->addParamAttr(0, llvm::Attribute::getWithCaptureInfo(
-                               M.getContext(), llvm::CaptureInfo::none()));
-  //don't caputure ptr
-  PrintfF->addParamAttr(0, Attribute::ReadOnly);
-  //first arg is read only
-
-  // STEP 3: Inject a global variable that will hold the printf format string
-  // ------------------------------------------------------------------------
-  llvm::Constant *ResultFormatStr =
-      llvm::ConstantDataArray::getString(CTX, "%-20s %-10lu\n");
-    //create a global string constant with the format we want to use to print results
-  Constant *ResultFormatStrVar =
-      M.getOrInsertGlobal("ResultFormatStrIR", ResultFormatStr->getType());
-    //insert a global variable into the module to hold the format string
-  dyn_cast<GlobalVariable>(ResultFormatStrVar)->setInitializer(ResultFormatStr);
-
-  std::string out = "";
-  out += "=================================================\n";
-  out += "LLVM-TUTOR: dynamic analysis results\n";
-  out += "=================================================\n";
-  out += "NAME                 #N DIRECT CALLS\n";
-  out += "-------------------------------------------------\n";
-
-  llvm::Constant *ResultHeaderStr =
-      llvm::ConstantDataArray::getString(CTX, out.c_str());
-
-  Constant *ResultHeaderStrVar =
-      M.getOrInsertGlobal("ResultHeaderStrIR", ResultHeaderStr->getType());
-  dyn_cast<GlobalVariable>(ResultHeaderStrVar)->setInitializer(ResultHeaderStr);
-
-  // STEP 4: Define a printf wrapper that will print the results
+  // STEP 3: Define a printf wrapper that will print the results
   // -----------------------------------------------------------
-  // Define `printf_wrapper` that will print the results stored in FuncNameMap
-  // and CallCounterMap.  It is equivalent to the following C++ function:
-  // ```
-  //    void printf_wrapper() {
-  //      for (auto &item : Functions)
-  //        printf("llvm-tutor): Function %s was called %d times. \n",
-  //        item.name, item.count);
-  //    }
-  // ```
-  // (item.name comes from FuncNameMap, item.count comes from
-  // CallCounterMap)
-  FunctionType *PrintfWrapperTy =
-      FunctionType::get(llvm::Type::getVoidTy(CTX), {},
-                        /*IsVarArgs=*/false);
-  //void printf_wrapper()
-  Function *PrintfWrapperF = dyn_cast<Function>(
-      M.getOrInsertFunction("printf_wrapper", PrintfWrapperTy).getCallee());
-  //get or insert function into module
-
-  // Create the entry basic block for printf_wrapper ...
-  llvm::BasicBlock *RetBlock =
-      llvm::BasicBlock::Create(CTX, "enter", PrintfWrapperF);
-  IRBuilder<> Builder(RetBlock);
-  //fill the basic block with instructions
-
-  // ... and start inserting calls to printf
-  // (printf requires i8*, so cast the input strings accordingly)
-  llvm::Value *ResultHeaderStrPtr =
-      Builder.CreatePointerCast(ResultHeaderStrVar, PrintfArgTy);
-  llvm::Value *ResultFormatStrPtr =
-      Builder.CreatePointerCast(ResultFormatStrVar, PrintfArgTy);
-  //cast global vars to i8* (char*)
-  //llvm::Constant *ResultFormatStr =
-  // llvm::ConstantDataArray::getString(CTX, "%-20s %-10lu\n");
-  // it is array not a pointer, so we need to cast it
-
-  Builder.CreateCall(Printf, {ResultHeaderStrPtr});
-
-  LoadInst *LoadCounter;
-  for (auto &item : CallCounterMap) {
-    LoadCounter = Builder.CreateLoad(IntegerType::getInt32Ty(CTX), item.second);
-    // LoadCounter = Builder.CreateLoad(item.second);
-    // This is the real function call counter
-    
-    Builder.CreateCall(
-        Printf, {ResultFormatStrPtr, FuncNameMap[item.first()], LoadCounter});
-  }
+  // The table is printed by `printf_wrapper` (see CreateTextReport in
+  // DynamicCCRuntime.h), which sums up the shards.
+  Names.finalize();
+  Function *PrintfWrapperF = CreateTextReport(
+      M, "dynamic analysis results", Layout, Names, FuncNameOffsets,
+      /*ExtraColumn=*/nullptr, /*ExtraColumnName=*/"",
+      Opts.Mode == CounterUpdateMode::TLS ? RT.Flush : nullptr);
 
-  // Finally, insert return instruction
-  Builder.CreateRetVoid();
+  // The call graph goes after the table
+  if (Opts.CountEdges) {
+    IRBuilder<> Builder(PrintfWrapperF->back().getTerminator());
+    Builder.CreateCall(CreateEdgeReport(M, Edges, Layout.CounterTy,
+                                        getOrInsertPrintf(M), Names));
+  }
 
-  // STEP 5: Call `printf_wrapper` at the very end of this module
+  // STEP 4: Call `printf_wrapper` at the very end of this module
   // ------------------------------------------------------------
   appendToGlobalDtors(M, PrintfWrapperF, /*Priority=*/0);
 
@@ -250,14 +1108,134 @@ PreservedAnalyses DynamicCallCounter::run(llvm::Module &M,
 //-----------------------------------------------------------------------------
 // New PM Registration
 //-----------------------------------------------------------------------------
+// Parses the parameters of `dynamic-cc<...>`, e.g.
+// `dynamic-cc<atomic;width=32;pad=64>`.
+// Parameters are separated with `;`.
+static Expected<DynamicCallCounterOptions>
+parseDynamicCallCounterOptions(StringRef Params) {
+  DynamicCallCounterOptions Opts;
+  while (!Params.empty()) {
+    StringRef ParamName;
+    std::tie(ParamName, Params) = Params.split(';');
+
+    Expected<bool> IsFilterParam =
+        parseInstrumentationFilterParam(ParamName, "dynamic-cc", Opts.Filter);
+    if (!IsFilterParam)
+      return IsFilterParam.takeError();
+    if (*IsFilterParam)
+      continue;
+
+    if (ParamName == "atomic") {
+      Opts.Mode = CounterUpdateMode::Atomic;
+    } else if (ParamName == "tls") {
+      Opts.Mode = CounterUpdateMode::TLS;
+    } else if (ParamName.consume_front("width=")) {
+      if (ParamName.getAsInteger(0, Opts.CounterWidth) ||
+          (Opts.CounterWidth != 32 && Opts.CounterWidth != 64))
+        return make_error<StringError>(
+            "dynamic-cc counter width must be 32 or 64, got '" + ParamName +
+                "'",
+            inconvertibleErrorCode());
+    } else if (ParamName.consume_front("sample=")) {
+      if (ParamName.getAsInteger(0, Opts.SamplePeriod) ||
+          Opts.SamplePeriod == 0 || Opts.SamplePeriod > INT32_MAX)
+        return make_error<StringError>(
+            "invalid dynamic-cc sampling period '" + ParamName + "'",
+            inconvertibleErrorCode());
+    } else if (ParamName == "edges") {
+      Opts.CountEdges = true;
+    } else if (ParamName == "shm") {
+      Opts.SharedMemory = true;
+    } else if (ParamName == "format=text") {
+      Opts.Format = ReportFormat::Text;
+    } else if (ParamName == "format=bin") {
+      Opts.Format = ReportFormat::Binary;
+    } else if (ParamName.consume_front("pad=")) {
+      if (ParamName.getAsInteger(0, Opts.Padding))
+        return make_error<StringError>(
+            "invalid dynamic-cc padding '" + ParamName + "'",
+            inconvertibleErrorCode());
+    } else if (ParamName.consume_front("shards=")) {
+      if (ParamName.getAsInteger(0, Opts.Shards) ||
+          !isPowerOf2_32(Opts.Shards))
+        return make_error<StringError>(
+            "dynamic-cc shards must be a power of two, got '" + ParamName +
+                "'",
+            inconvertibleErrorCode());
+    } else {
+      return make_error<StringError>(
+          "invalid dynamic-cc pass parameter '" + ParamName + "'",
+          inconvertibleErrorCode());
+    }
+  }
+
+  // Checked once the counter width is known. Any other stride would either be
+  // rounded down or leave the counters unaligned to the padding.
+  if (Opts.Padding &&
+      (!isPowerOf2_32(Opts.Padding) || Opts.Padding < Opts.CounterWidth / 8))
+    return make_error<StringError>(
+        "dynamic-cc padding must be a power of two of at least " +
+            Twine(Opts.CounterWidth / 8) + " bytes, got '" +
+            Twine(Opts.Padding) + "'",
+        inconvertibleErrorCode());
+
+  if (Opts.Mode == CounterUpdateMode::TLS && Opts.Shards > 1)
+    return make_error<StringError>(
+        "dynamic-cc: 'shards' cannot be combined with 'tls'",
+        inconvertibleErrorCode());
+
+  if (Opts.Mode == CounterUpdateMode::TLS && Opts.SamplePeriod)
+    return make_error<StringError>(
+        "dynamic-cc: 'sample' cannot be combined with 'tls'",
+        inconvertibleErrorCode());
+
+  if (Opts.Mode == CounterUpdateMode::TLS && Opts.SharedMemory)
+    return make_error<StringError>(
+        "dynamic-cc: 'shm' cannot be combined with 'tls'",
+        inconvertibleErrorCode());
+
+  if (Opts.CountEdges &&
+      (Opts.Format != ReportFormat::Text || Opts.SharedMemory))
+    return make_error<StringError>(
+        "dynamic-cc: 'edges' requires 'format=text' and cannot be combined "
+        "with 'shm'",
+        inconvertibleErrorCode());
+
+  return Opts;
+}
+
 llvm::PassPluginLibraryInfo getDynamicCallCounterPluginInfo() {
   return {LLVM_PLUGIN_API_VERSION, "dynamic-cc", LLVM_VERSION_STRING,
           [](PassBuilder &PB) {
             PB.registerPipelineParsingCallback(
                 [](StringRef Name, ModulePassManager &MPM,
                    ArrayRef<PassBuilder::PipelineElement>) {
-                  if (Name == "dynamic-cc") {
-                    MPM.addPass(DynamicCallCounter());
+                  // Function passes are not wrapped automatically in module
+                  // pipelines, e.g. in
+                  //    "dynamic-cc,default<O2>,dynamic-cc-promote"
+                  if (Name == "dynamic-cc-promote") {
+                    MPM.addPass(
+                        createModuleToFunctionPassAdaptor(DynamicCCPromote()));
+                    return true;
+                  }
+                  if (!PassBuilder::checkParametrizedPassName(Name,
+                                                              "dynamic-cc"))
+                    return false;
+
+                  auto Opts = PassBuilder::parsePassParameters(
+                      parseDynamicCallCounterOptions, Name, "dynamic-cc");
+                  if (!Opts) {
+                    errs() << toString(Opts.takeError()) << "\n";
+                    return false;
+                  }
+                  MPM.addPass(DynamicCallCounter(*Opts));
+                  return true;
+                });
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, FunctionPassManager &FPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+                  if (Name == "dynamic-cc-promote") {
+                    FPM.addPass(DynamicCCPromote());
                     return true;
                   }
                   return false;
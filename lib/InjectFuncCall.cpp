@@ -20,28 +20,479 @@
 //    (llvm-tutor)   number of arguments: 3
 //    ```
 //
+//    printf serialises all threads on the stdio lock and formats every
+//    message, which makes the instrumented program very slow. In the trace
+//    mode (`inject-func-call<trace>`), every function entry records a binary
+//    event (function ID, number of arguments, timestamp) in a per-thread
+//    lock-free ring buffer instead. The buffers are written to a file when the
+//    module exits (see FuncTraceRecord.h) and can be printed with
+//    `trace-dump`. Parameters (separated with `;`):
+//      * `trace`      - enable the trace mode
+//      * `events=N`   - the capacity of every ring buffer (a power of 2,
+//                       16384 by default). Older events are overwritten.
+//      * `args=K`     - also record the values of the first K (at most 8)
+//                       arguments. The conversion to a 64-bit slot is chosen
+//                       at compile time from the type of every argument (see
+//                       FuncTraceArgKind), so nothing is formatted at
+//                       run-time.
+//
 // USAGE:
 //      $ opt -load-pass-plugin <BUILD_DIR>/lib/libInjectFunctCall.so `\`
 //        -passes=-"inject-func-call" <bitcode-file>
+//      $ opt -load-pass-plugin <BUILD_DIR>/lib/libInjectFunctCall.so `\`
+//        -passes="inject-func-call<trace>" <bitcode-file> -o instrumented.bin
+//      $ LLVM_TUTOR_TRACE_OUTPUT=trace.bin lli instrumented.bin
+//      $ <BUILD_DIR>/bin/trace-dump trace.bin
 //
 // License: MIT
 //========================================================================
 #include "InjectFuncCall.h"
+#include "FuncTraceRecord.h"
+#include "NameTable.h"
+#include "TraceClock.h"
 
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
 #include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
 
 using namespace llvm;
 
 #define DEBUG_TYPE "inject-func-call"
 
+//-----------------------------------------------------------------------------
+// Trace mode runtime
+//-----------------------------------------------------------------------------
+// Everything that the trace mode needs at run-time. The injected code is
+// equivalent to this C code (see FuncTraceRecord.h for the types):
+// ```
+//    struct FuncTraceBuffer {
+//      struct FuncTraceBuffer *Next;
+//      uint64_t Head;
+//      uint32_t ThreadIndex;
+//      struct {
+//        FuncTraceEvent Event;
+//        uint64_t Args[ArgsPerEvent];
+//      } Events[EventsPerThread];
+//    };
+//    static struct FuncTraceBuffer *FuncTraceBuffers;
+//    static uint32_t FuncTraceNumThreads;
+//    static __thread struct FuncTraceBuffer *FuncTraceThreadBuffer;
+//
+//    static struct FuncTraceBuffer *func_trace_new_buffer() {
+//      struct FuncTraceBuffer *Buf = calloc(1, sizeof(*Buf));
+//      if (!Buf)
+//        return NULL;
+//      Buf->ThreadIndex = __atomic_fetch_add(&FuncTraceNumThreads, 1,
+//                                            __ATOMIC_RELAXED);
+//      Buf->Next = __atomic_load_n(&FuncTraceBuffers, __ATOMIC_RELAXED);
+//      while (!__atomic_compare_exchange_n(&FuncTraceBuffers, &Buf->Next, Buf,
+//                                          /*weak=*/1, __ATOMIC_RELEASE,
+//                                          __ATOMIC_RELAXED))
+//        ;
+//      FuncTraceThreadBuffer = Buf;
+//      return Buf;
+//    }
+//    static void func_trace_record(uint32_t FuncID, uint32_t NumArgs,
+//                                  uint64_t Arg0, ..., uint64_t ArgK_1) {
+//      struct FuncTraceBuffer *Buf = FuncTraceThreadBuffer;
+//      if (!Buf && !(Buf = func_trace_new_buffer()))
+//        return;
+//      uint64_t Head = Buf->Head;
+//      __typeof__(Buf->Events[0]) *Slot =
+//          &Buf->Events[Head & (EventsPerThread - 1)];
+//      Slot->Event.Timestamp = <clock, see TraceClock.h>;
+//      Slot->Event.FuncID = FuncID;
+//      Slot->Event.NumArgs = NumArgs;
+//      Slot->Args[0] = Arg0; ...; Slot->Args[K - 1] = ArgK_1;
+//      __atomic_store_n(&Buf->Head, Head + 1, __ATOMIC_RELEASE);
+//    }
+//    static void func_trace_flush() {
+//      const char *Path = getenv("LLVM_TUTOR_TRACE_OUTPUT");
+//      FILE *Out = fopen(Path ? Path : "func-trace.bin", "wb");
+//      if (!Out)
+//        return;
+//      fwrite(&FuncTracePrefix, sizeof(FuncTracePrefix), 1, Out);
+//      for (Buf = __atomic_load_n(&FuncTraceBuffers, __ATOMIC_ACQUIRE); Buf;
+//           Buf = Buf->Next) {
+//        FuncTraceChunkHeader Chunk;
+//        Chunk.Head = __atomic_load_n(&Buf->Head, __ATOMIC_ACQUIRE);
+//        Chunk.ThreadIndex = Buf->ThreadIndex;
+//        Chunk.NumEvents = min(Chunk.Head, EventsPerThread);
+//        fwrite(&Chunk, sizeof(Chunk), 1, Out);
+//        fwrite(Buf->Events, sizeof(Buf->Events[0]), Chunk.NumEvents, Out);
+//      }
+//      fclose(Out);
+//    }
+// ```
+// Every buffer has a single writer (its thread), so recording an event takes
+// neither locks nor read-modify-write atomics. Buffers are never freed, so the
+// events of threads that have already exited are written out as well. Events
+// that other threads record while func_trace_flush runs may be torn.
+struct FuncTraceRuntime {
+  Function *Record = nullptr;
+  Function *Flush = nullptr;
+};
+
+// Returns how an argument of type Ty is recorded in the trace
+static FuncTraceArgKind getTraceArgKind(Type *Ty) {
+  if (Ty->isIntegerTy() && Ty->getIntegerBitWidth() <= 64)
+    return FuncTraceArgKind::Int;
+  if (Ty->isPointerTy())
+    return FuncTraceArgKind::Pointer;
+  if (Ty->isFloatingPointTy())
+    return FuncTraceArgKind::Float;
+  return FuncTraceArgKind::None;
+}
+
+// Converts Arg to its 64-bit slot in the trace event (see FuncTraceArgKind)
+static Value *CreateTraceArgValue(IRBuilder<> &Builder, Value *Arg) {
+  Type *Ty = Arg->getType();
+  IntegerType *Int64Ty = Builder.getInt64Ty();
+  switch (getTraceArgKind(Ty)) {
+  case FuncTraceArgKind::Int:
+    return Ty->isIntegerTy(1) ? Builder.CreateZExt(Arg, Int64Ty)
+                              : Builder.CreateSExtOrTrunc(Arg, Int64Ty);
+  case FuncTraceArgKind::Pointer:
+    return Builder.CreatePtrToInt(Arg, Int64Ty);
+  case FuncTraceArgKind::Float:
+    return Builder.CreateBitCast(
+        Builder.CreateFPCast(Arg, Builder.getDoubleTy()), Int64Ty);
+  case FuncTraceArgKind::None:
+    break;
+  }
+  return Builder.getInt64(0);
+}
+
+// Creates `FuncTracePrefix`, the constant that precedes the per-thread chunks
+// in the trace: the header, the function-name table and the argument-kind
+// table.
+static GlobalVariable *CreateTracePrefix(Module &M, ArrayRef<Function *> Funcs,
+                                         unsigned EventsPerThread,
+                                         unsigned ArgsPerEvent) {
+  auto &CTX = M.getContext();
+
+  std::string NameTable;
+  SmallVector<uint8_t, 64> ArgKinds;
+  for (Function *F : Funcs) {
+    NameTable += F->getName();
+    NameTable.push_back('\0');
+    for (unsigned I = 0; I < ArgsPerEvent; I++)
+      ArgKinds.push_back(static_cast<uint8_t>(
+          I < F->arg_size() ? getTraceArgKind(F->getArg(I)->getType())
+                            : FuncTraceArgKind::None));
+  }
+
+  uint32_t Header[] = {FuncTraceHeader::MagicValue,
+                       FuncTraceHeader::CurrentVersion,
+                       static_cast<uint32_t>(Funcs.size()),
+                       static_cast<uint32_t>(NameTable.size()),
+                       EventsPerThread,
+                       traceClockCountsCycles(M)
+                           ? FuncTraceHeader::ClockCycles
+                           : FuncTraceHeader::ClockNanoseconds,
+                       ArgsPerEvent,
+                       /*Reserved=*/0};
+  static_assert(sizeof(Header) == sizeof(FuncTraceHeader),
+                "Header does not match FuncTraceHeader");
+
+  // Packed, so that the chunks follow the argument-kind table directly (the
+  // tables have arbitrary lengths and trace-dump doesn't expect any padding)
+  Constant *Init = ConstantStruct::getAnon(
+      {ConstantDataArray::get(CTX, Header),
+       ConstantDataArray::getString(CTX, NameTable, /*AddNull=*/false),
+       ConstantDataArray::get(CTX, ArgKinds)},
+      /*Packed=*/true);
+  assert(M.getDataLayout().getTypeAllocSize(Init->getType()) ==
+             sizeof(Header) + NameTable.size() + ArgKinds.size() &&
+         "The trace prefix must not contain any padding");
+  return new GlobalVariable(M, Init->getType(), /*isConstant=*/true,
+                            GlobalValue::PrivateLinkage, Init,
+                            "FuncTracePrefix");
+}
+
+static FuncTraceRuntime CreateFuncTraceRuntime(Module &M,
+                                               ArrayRef<Function *> Funcs,
+                                               unsigned EventsPerThread,
+                                               unsigned ArgsPerEvent) {
+  auto &CTX = M.getContext();
+  const DataLayout &DL = M.getDataLayout();
+  PointerType *PtrTy = PointerType::getUnqual(CTX);
+  IntegerType *Int32Ty = Type::getInt32Ty(CTX);
+  IntegerType *Int64Ty = Type::getInt64Ty(CTX);
+  IntegerType *SizeTy = DL.getIntPtrType(CTX);
+  Type *VoidTy = Type::getVoidTy(CTX);
+  FuncTraceRuntime RT;
+
+  // The types from FuncTraceRecord.h. Every event is followed by the values
+  // of the captured arguments.
+  auto *EventTy = StructType::get(CTX, {Int64Ty, Int32Ty, Int32Ty,
+                                        ArrayType::get(Int64Ty, ArgsPerEvent)});
+  auto *ChunkTy = StructType::get(CTX, {Int64Ty, Int32Ty, Int32Ty});
+  auto *BufferTy = StructType::get(
+      CTX, {PtrTy, Int64Ty, Int32Ty, ArrayType::get(EventTy, EventsPerThread)});
+  const Align HeadAlign(8);
+
+  auto *Buffers = new GlobalVariable(M, PtrTy, /*isConstant=*/false,
+                                     GlobalValue::InternalLinkage,
+                                     ConstantPointerNull::get(PtrTy),
+                                     "FuncTraceBuffers");
+  auto *NumThreads = new GlobalVariable(
+      M, Int32Ty, /*isConstant=*/false, GlobalValue::InternalLinkage,
+      ConstantInt::get(Int32Ty, 0), "FuncTraceNumThreads");
+  auto *ThreadBuffer = new GlobalVariable(
+      M, PtrTy, /*isConstant=*/false, GlobalValue::InternalLinkage,
+      ConstantPointerNull::get(PtrTy), "FuncTraceThreadBuffer",
+      /*InsertBefore=*/nullptr, GlobalValue::GeneralDynamicTLSModel);
+
+  // struct FuncTraceBuffer *func_trace_new_buffer()
+  FunctionCallee Calloc = M.getOrInsertFunction(
+      "calloc", FunctionType::get(PtrTy, {SizeTy, SizeTy}, false));
+  Function *NewBuffer = Function::Create(FunctionType::get(PtrTy, false),
+                                         GlobalValue::InternalLinkage,
+                                         "func_trace_new_buffer", M);
+  NewBuffer->addFnAttr(Attribute::Cold);
+  NewBuffer->addFnAttr(Attribute::NoInline);
+  {
+    BasicBlock *Entry = BasicBlock::Create(CTX, "enter", NewBuffer);
+    BasicBlock *Allocated = BasicBlock::Create(CTX, "allocated", NewBuffer);
+    BasicBlock *Publish = BasicBlock::Create(CTX, "publish", NewBuffer);
+    BasicBlock *Published = BasicBlock::Create(CTX, "published", NewBuffer);
+    BasicBlock *Failed = BasicBlock::Create(CTX, "failed", NewBuffer);
+
+    IRBuilder<> Builder(Entry);
+    Value *Buf = Builder.CreateCall(
+        Calloc, {ConstantInt::get(SizeTy, 1),
+                 ConstantInt::get(SizeTy, DL.getTypeAllocSize(BufferTy))});
+    Builder.CreateCondBr(Builder.CreateIsNull(Buf), Failed, Allocated);
+
+    Builder.SetInsertPoint(Allocated);
+    Value *Index = Builder.CreateAtomicRMW(
+        AtomicRMWInst::Add, NumThreads, Builder.getInt32(1), Align(4),
+        AtomicOrdering::Monotonic);
+    Builder.CreateStore(Index, Builder.CreateStructGEP(BufferTy, Buf, 2));
+    LoadInst *First = Builder.CreateAlignedLoad(PtrTy, Buffers, Align(8));
+    First->setAtomic(AtomicOrdering::Monotonic);
+    Value *NextAddr = Builder.CreateStructGEP(BufferTy, Buf, 0);
+    Builder.CreateBr(Publish);
+
+    // Push Buf onto FuncTraceBuffers
+    Builder.SetInsertPoint(Publish);
+    PHINode *Expected = Builder.CreatePHI(PtrTy, 2, "expected");
+    Expected->addIncoming(First, Allocated);
+    Builder.CreateStore(Expected, NextAddr);
+    AtomicCmpXchgInst *CmpXchg = Builder.CreateAtomicCmpXchg(
+        Buffers, Expected, Buf, Align(8), AtomicOrdering::Release,
+        AtomicOrdering::Monotonic);
+    CmpXchg->setWeak(true);
+    Expected->addIncoming(Builder.CreateExtractValue(CmpXchg, 0), Publish);
+    Builder.CreateCondBr(Builder.CreateExtractValue(CmpXchg, 1), Published,
+                         Publish);
+
+    Builder.SetInsertPoint(Published);
+    Builder.CreateStore(Buf, Builder.CreateThreadLocalAddress(ThreadBuffer));
+    Builder.CreateRet(Buf);
+
+    Builder.SetInsertPoint(Failed);
+    Builder.CreateRet(ConstantPointerNull::get(PtrTy));
+  }
+
+  // void func_trace_record(uint32_t FuncID, uint32_t NumArgs,
+  //                        uint64_t Arg0, ..., uint64_t ArgK_1)
+  SmallVector<Type *, 2 + FuncTraceMaxArgsPerEvent> RecordParamTys = {
+      Int32Ty, Int32Ty};
+  RecordParamTys.append(ArgsPerEvent, Int64Ty);
+  RT.Record = Function::Create(FunctionType::get(VoidTy, RecordParamTys, false),
+                               GlobalValue::InternalLinkage,
+                               "func_trace_record", M);
+  RT.Record->addFnAttr(Attribute::NoUnwind);
+  {
+    BasicBlock *Entry = BasicBlock::Create(CTX, "enter", RT.Record);
+    BasicBlock *Slow = BasicBlock::Create(CTX, "slow", RT.Record);
+    BasicBlock *Fast = BasicBlock::Create(CTX, "record", RT.Record);
+    BasicBlock *Exit = BasicBlock::Create(CTX, "exit", RT.Record);
+    MDNode *Unlikely = MDBuilder(CTX).createUnlikelyBranchWeights();
+
+    IRBuilder<> Builder(Entry);
+    Value *Buf = Builder.CreateLoad(
+        PtrTy, Builder.CreateThreadLocalAddress(ThreadBuffer), "buf");
+    Builder.CreateCondBr(Builder.CreateIsNull(Buf), Slow, Fast, Unlikely);
+
+    Builder.SetInsertPoint(Slow);
+    Value *NewBuf = Builder.CreateCall(NewBuffer);
+    Builder.CreateCondBr(Builder.CreateIsNull(NewBuf), Exit, Fast);
+
+    Builder.SetInsertPoint(Fast);
+    PHINode *Cur = Builder.CreatePHI(PtrTy, 2, "cur");
+    Cur->addIncoming(Buf, Entry);
+    Cur->addIncoming(NewBuf, Slow);
+    Value *HeadAddr = Builder.CreateStructGEP(BufferTy, Cur, 1);
+    Value *Head = Builder.CreateAlignedLoad(Int64Ty, HeadAddr, HeadAlign);
+    Value *Slot = Builder.CreateAnd(Head, EventsPerThread - 1);
+    Value *Event = Builder.CreateInBoundsGEP(
+        BufferTy, Cur, {Builder.getInt32(0), Builder.getInt32(3), Slot});
+    Builder.CreateStore(CreateReadTraceClock(Builder, M),
+                        Builder.CreateStructGEP(EventTy, Event, 0));
+    Builder.CreateStore(RT.Record->getArg(0),
+                        Builder.CreateStructGEP(EventTy, Event, 1));
+    Builder.CreateStore(RT.Record->getArg(1),
+                        Builder.CreateStructGEP(EventTy, Event, 2));
+    for (unsigned I = 0; I < ArgsPerEvent; I++)
+      Builder.CreateStore(RT.Record->getArg(2 + I),
+                          Builder.CreateConstInBoundsGEP2_32(
+                              EventTy->getElementType(3),
+                              Builder.CreateStructGEP(EventTy, Event, 3), 0,
+                              I));
+    // Publish the event
+    StoreInst *NewHead = Builder.CreateAlignedStore(
+        Builder.CreateAdd(Head, Builder.getInt64(1)), HeadAddr, HeadAlign);
+    NewHead->setAtomic(AtomicOrdering::Release);
+    Builder.CreateBr(Exit);
+
+    Builder.SetInsertPoint(Exit);
+    Builder.CreateRetVoid();
+  }
+
+  // void func_trace_flush()
+  GlobalVariable *Prefix =
+      CreateTracePrefix(M, Funcs, EventsPerThread, ArgsPerEvent);
+  FunctionCallee Getenv = M.getOrInsertFunction(
+      "getenv", FunctionType::get(PtrTy, {PtrTy}, false));
+  FunctionCallee Fopen = M.getOrInsertFunction(
+      "fopen", FunctionType::get(PtrTy, {PtrTy, PtrTy}, false));
+  FunctionCallee Fwrite = M.getOrInsertFunction(
+      "fwrite",
+      FunctionType::get(SizeTy, {PtrTy, SizeTy, SizeTy, PtrTy}, false));
+  FunctionCallee Fclose = M.getOrInsertFunction(
+      "fclose", FunctionType::get(Int32Ty, {PtrTy}, false));
+
+  RT.Flush = Function::Create(FunctionType::get(VoidTy, false),
+                              GlobalValue::InternalLinkage, "func_trace_flush",
+                              M);
+  {
+    BasicBlock *Entry = BasicBlock::Create(CTX, "enter", RT.Flush);
+    BasicBlock *Write = BasicBlock::Create(CTX, "write", RT.Flush);
+    BasicBlock *Loop = BasicBlock::Create(CTX, "loop", RT.Flush);
+    BasicBlock *Body = BasicBlock::Create(CTX, "chunk", RT.Flush);
+    BasicBlock *Done = BasicBlock::Create(CTX, "done", RT.Flush);
+    BasicBlock *Exit = BasicBlock::Create(CTX, "exit", RT.Flush);
+
+    IRBuilder<> Builder(Entry);
+    Value *Chunk = Builder.CreateAlloca(ChunkTy, nullptr, "chunk");
+    Value *EnvPath = Builder.CreateCall(
+        Getenv, {Builder.CreateGlobalString(FuncTraceOutputEnvVar)});
+    Value *Path = Builder.CreateSelect(
+        Builder.CreateIsNull(EnvPath),
+        Builder.CreateGlobalString(FuncTraceDefaultOutput), EnvPath);
+    Value *Out =
+        Builder.CreateCall(Fopen, {Path, Builder.CreateGlobalString("wb")});
+    Builder.CreateCondBr(Builder.CreateIsNull(Out), Exit, Write);
+
+    Builder.SetInsertPoint(Write);
+    Builder.CreateCall(
+        Fwrite,
+        {Prefix,
+         ConstantInt::get(SizeTy, DL.getTypeAllocSize(Prefix->getValueType())),
+         ConstantInt::get(SizeTy, 1), Out});
+    LoadInst *First = Builder.CreateAlignedLoad(PtrTy, Buffers, Align(8));
+    First->setAtomic(AtomicOrdering::Acquire);
+    Builder.CreateBr(Loop);
+
+    Builder.SetInsertPoint(Loop);
+    PHINode *Buf = Builder.CreatePHI(PtrTy, 2, "buf");
+    Buf->addIncoming(First, Write);
+    Builder.CreateCondBr(Builder.CreateIsNull(Buf), Done, Body);
+
+    Builder.SetInsertPoint(Body);
+    LoadInst *Head = Builder.CreateAlignedLoad(
+        Int64Ty, Builder.CreateStructGEP(BufferTy, Buf, 1), HeadAlign);
+    Head->setAtomic(AtomicOrdering::Acquire);
+    Value *NumEvents = Builder.CreateTrunc(
+        Builder.CreateBinaryIntrinsic(Intrinsic::umin, Head,
+                                      Builder.getInt64(EventsPerThread)),
+        Int32Ty);
+    Builder.CreateStore(Head, Builder.CreateStructGEP(ChunkTy, Chunk, 0));
+    Builder.CreateStore(
+        Builder.CreateLoad(Int32Ty, Builder.CreateStructGEP(BufferTy, Buf, 2)),
+        Builder.CreateStructGEP(ChunkTy, Chunk, 1));
+    Builder.CreateStore(NumEvents, Builder.CreateStructGEP(ChunkTy, Chunk, 2));
+    Builder.CreateCall(
+        Fwrite, {Chunk, ConstantInt::get(SizeTy, DL.getTypeAllocSize(ChunkTy)),
+                 ConstantInt::get(SizeTy, 1), Out});
+    Builder.CreateCall(
+        Fwrite, {Builder.CreateStructGEP(BufferTy, Buf, 3),
+                 ConstantInt::get(SizeTy, DL.getTypeAllocSize(EventTy)),
+                 Builder.CreateZExt(NumEvents, SizeTy), Out});
+    Buf->addIncoming(
+        Builder.CreateLoad(PtrTy, Builder.CreateStructGEP(BufferTy, Buf, 0)),
+        Body);
+    Builder.CreateBr(Loop);
+
+    Builder.SetInsertPoint(Done);
+    Builder.CreateCall(Fclose, {Out});
+    Builder.CreateBr(Exit);
+
+    Builder.SetInsertPoint(Exit);
+    Builder.CreateRetVoid();
+  }
+
+  return RT;
+}
+
 //-----------------------------------------------------------------------------
 // InjectFuncCall implementation
 //-----------------------------------------------------------------------------
 bool InjectFuncCall::runOnModule(Module &M) {
+  return Opts.Trace ? injectTrace(M) : injectPrintf(M);
+}
+
+bool InjectFuncCall::injectTrace(Module &M) {
+  // Functions to instrument. The position in this vector is the function's ID.
+  SmallVector<Function *, 16> Funcs;
+  InstrumentationFilter Filter(Opts.Filter);
+  for (auto &F : M)
+    if (Filter.shouldInstrument(F))
+      Funcs.push_back(&F);
+
+  if (Funcs.empty())
+    return false;
+
+  FuncTraceRuntime RT = CreateFuncTraceRuntime(
+      M, Funcs, Opts.EventsPerThread, Opts.ArgsPerEvent);
+
+  for (auto [ID, F] : enumerate(Funcs)) {
+    IRBuilder<> Builder(&*F->getEntryBlock().getFirstInsertionPt());
+    SmallVector<Value *, 2 + FuncTraceMaxArgsPerEvent> RecordArgs = {
+        Builder.getInt32(ID), Builder.getInt32(F->arg_size())};
+    for (unsigned I = 0; I < Opts.ArgsPerEvent; I++)
+      RecordArgs.push_back(I < F->arg_size()
+                               ? CreateTraceArgValue(Builder, F->getArg(I))
+                               : Builder.getInt64(0));
+    Builder.CreateCall(RT.Record, RecordArgs);
+
+    LLVM_DEBUG(dbgs() << " Injecting trace event inside " << F->getName()
+                      << " (ID " << ID << ")\n");
+  }
+
+  // Write the trace when the module exits
+  appendToGlobalDtors(M, RT.Flush, /*Priority=*/0);
+
+  return true;
+}
+
+bool InjectFuncCall::injectPrintf(Module &M) {
   bool InsertedAtLeastOnePrintf = false;
 
+  // Functions to instrument, selected before any code is injected
+  SmallVector<Function *, 16> Funcs;
+  InstrumentationFilter Filter(Opts.Filter);
+  for (auto &F : M)
+    if (Filter.shouldInstrument(F))
+      Funcs.push_back(&F);
+
   auto &CTX = M.getContext();
   PointerType *PrintfArgTy = PointerType::getUnqual(CTX);
 
@@ -68,25 +519,32 @@ bool InjectFuncCall::runOnModule(Module &M) {
 
 
   // STEP 2: Inject a global variable that will hold the printf format string
+  // and add the function names to the name table
   // ------------------------------------------------------------------------
+  // The format string is private, so that it doesn't clash with the globals
+  // injected by other passes (e.g. InjectFuncCallRet).
   llvm::Constant *PrintfFormatStr = llvm::ConstantDataArray::getString(
       CTX, "(llvm-tutor) Hello from: %s\n(llvm-tutor)   number of arguments: %d\n");
 
-  Constant *PrintfFormatStrVar =
-      M.getOrInsertGlobal("PrintfFormatStr", PrintfFormatStr->getType());
-  dyn_cast<GlobalVariable>(PrintfFormatStrVar)->setInitializer(PrintfFormatStr);
+  Constant *PrintfFormatStrVar = new GlobalVariable(
+      M, PrintfFormatStr->getType(), /*isConstant=*/true,
+      GlobalValue::PrivateLinkage, PrintfFormatStr, "PrintfFormatStr");
+
+  // Every function name is stored once in the name table (see NameTable.h)
+  NameTable Names(M);
+  for (Function *F : Funcs)
+    Names.add(F->getName());
+  Names.finalize();
 
   // STEP 3: For each function in the module, inject a call to printf
   // ----------------------------------------------------------------
-  for (auto &F : M) {
-    if (F.isDeclaration())
-      continue;
+  for (Function *F : Funcs) {
 
     // Get an IR builder. Sets the insertion point to the top of the function
-    IRBuilder<> Builder(&*F.getEntryBlock().getFirstInsertionPt());
+    IRBuilder<> Builder(&*F->getEntryBlock().getFirstInsertionPt());
 
-    // Inject a global variable that contains the function name
-    auto FuncName = Builder.CreateGlobalString(F.getName());
+    // The function name (an entry in the name table)
+    Constant *FuncName = Names.getAddress(F->getName());
 
     // Printf requires i8*, but PrintfFormatStrVar is an array: [n x i8]. Add
     // a cast: [n x i8] -> i8*
@@ -95,12 +553,12 @@ bool InjectFuncCall::runOnModule(Module &M) {
 
     // The following is visible only if you pass -debug on the command line
     // *and* you have an assert build.
-    LLVM_DEBUG(dbgs() << " Injecting call to printf inside " << F.getName()
+    LLVM_DEBUG(dbgs() << " Injecting call to printf inside " << F->getName()
                       << "\n");
 
     // Finally, inject a call to printf
     Builder.CreateCall(
-        Printf, {FormatStrPtr, FuncName, Builder.getInt32(F.arg_size())});
+        Printf, {FormatStrPtr, FuncName, Builder.getInt32(F->arg_size())});
 
     InsertedAtLeastOnePrintf = true;
   }
@@ -120,17 +578,76 @@ PreservedAnalyses InjectFuncCall::run(llvm::Module &M,
 //-----------------------------------------------------------------------------
 // New PM Registration
 //-----------------------------------------------------------------------------
+// Parses the parameters of `inject-func-call<...>`, e.g.
+// `inject-func-call<trace;events=65536;args=2>`. Parameters are separated
+// with `;`.
+static Expected<InjectFuncCallOptions>
+parseInjectFuncCallOptions(StringRef Params) {
+  InjectFuncCallOptions Opts;
+  bool EventsSet = false;
+  bool ArgsSet = false;
+  while (!Params.empty()) {
+    StringRef ParamName;
+    std::tie(ParamName, Params) = Params.split(';');
+
+    Expected<bool> IsFilterParam = parseInstrumentationFilterParam(
+        ParamName, "inject-func-call", Opts.Filter);
+    if (!IsFilterParam)
+      return IsFilterParam.takeError();
+    if (*IsFilterParam)
+      continue;
+
+    if (ParamName == "trace") {
+      Opts.Trace = true;
+    } else if (ParamName.consume_front("events=")) {
+      if (ParamName.getAsInteger(0, Opts.EventsPerThread) ||
+          !isPowerOf2_32(Opts.EventsPerThread))
+        return make_error<StringError>(
+            "inject-func-call events must be a power of 2, got '" +
+                ParamName + "'",
+            inconvertibleErrorCode());
+      EventsSet = true;
+    } else if (ParamName.consume_front("args=")) {
+      if (ParamName.getAsInteger(0, Opts.ArgsPerEvent) ||
+          Opts.ArgsPerEvent > FuncTraceMaxArgsPerEvent)
+        return make_error<StringError>(
+            "inject-func-call args must be at most " +
+                Twine(FuncTraceMaxArgsPerEvent) + ", got '" + ParamName + "'",
+            inconvertibleErrorCode());
+      ArgsSet = true;
+    } else {
+      return make_error<StringError>(
+          "invalid inject-func-call pass parameter '" + ParamName + "'",
+          inconvertibleErrorCode());
+    }
+  }
+
+  if ((EventsSet || ArgsSet) && !Opts.Trace)
+    return make_error<StringError>(
+        "inject-func-call: 'events' and 'args' require 'trace'",
+        inconvertibleErrorCode());
+
+  return Opts;
+}
+
 llvm::PassPluginLibraryInfo getInjectFuncCallPluginInfo() {
   return {LLVM_PLUGIN_API_VERSION, "inject-func-call", LLVM_VERSION_STRING,
           [](PassBuilder &PB) {
             PB.registerPipelineParsingCallback(
                 [](StringRef Name, ModulePassManager &MPM,
                    ArrayRef<PassBuilder::PipelineElement>) {
-                  if (Name == "inject-func-call") {
-                    MPM.addPass(InjectFuncCall());
-                    return true;
+                  if (!PassBuilder::checkParametrizedPassName(
+                          Name, "inject-func-call"))
+                    return false;
+
+                  auto Opts = PassBuilder::parsePassParameters(
+                      parseInjectFuncCallOptions, Name, "inject-func-call");
+                  if (!Opts) {
+                    errs() << toString(Opts.takeError()) << "\n";
+                    return false;
                   }
-                  return false;
+                  MPM.addPass(InjectFuncCall(*Opts));
+                  return true;
                 });
           }};
 }
@@ -1,48 +1,1132 @@
 //========================================================================
 // FILE:
-//    InjectFuncCall.cpp
+//    InjectFuncCallRet.cpp
 //
 // DESCRIPTION:
-//    For each function defined in the input IR module, InjectFuncCall inserts
-//    a call to printf (from the C standard I/O library). The injected IR code
-//    corresponds to the following function call in ANSI C:
+//    A variation of InjectFuncCall: for each function defined in the input IR
+//    module, InjectFuncCallRet inserts a call to printf right before every
+//    point at which the function exits (rather than at its beginning): every
+//    `ret`, but also every exit through an exception (`resume`, or calls that
+//    may throw, which are turned into invokes with a new cleanup) and every
+//    call to a `noreturn` function such as `longjmp` or `exit`. The injected
+//    IR code corresponds to the following function call in ANSI C:
 //    ```C
 //      printf("(llvm-tutor) Hello from: %s\n(llvm-tutor)   number of arguments: %d\n",
 //             FuncName, FuncNumArgs);
 //    ```
-//    This code is inserted at the beginning of each function, i.e. before any
-//    other instruction is executed.
 //
-//    To illustrate, for `void foo(int a, int b, int c)`, the code added by InjectFuncCall
-//    will generated the following output at runtime:
-//    ```
-//    (llvm-tutor) Hello World from: foo
-//    (llvm-tutor)   number of arguments: 3
-//    ```
+//    In the timing mode (`inject-func-call-ret<timing>`), the clock (see
+//    TraceClock.h) is read at the beginning of every function and right
+//    before every exit point instead. The elapsed time is recorded in a
+//    per-function log-linear histogram: 8 sub-buckets for every power of 2,
+//    i.e. the bucket that a value falls into is at most 12.5% wider than the
+//    value. When the module exits, the number of recorded calls and the
+//    p50/p99/p99.9 latencies (the upper bounds of the respective buckets) are
+//    printed for every function that returned at least once.
+//
+//    In the stacks mode (`inject-func-call-ret<stacks>`), every function
+//    pushes itself on a per-thread shadow stack on entry and pops itself at
+//    every exit point. Every push counts one call of the current calling
+//    context (the path from the outermost frame) in a per-thread trie. When
+//    the module exits, the tries are written as collapsed stacks, which
+//    flame-graph tools (e.g. flamegraph.pl) accept as input. Parameters:
+//      * `stacks`          - enable the stacks mode
+//      * `stack-nodes=N`   - the number of distinct calling contexts that
+//                            every thread can record (a power of 2, 65536 by
+//                            default). Calls in new contexts beyond that
+//                            are counted as `[dropped]`.
 //
 // USAGE:
-//      $ opt -load-pass-plugin <BUILD_DIR>/lib/libInjectFunctCall.so `\`
-//        -passes=-"inject-func-call" <bitcode-file>
+//      $ opt -load-pass-plugin <BUILD_DIR>/lib/libInjectFuncCallRet.so `\`
+//        -passes="inject-func-call-ret" <bitcode-file>
+//      $ opt -load-pass-plugin <BUILD_DIR>/lib/libInjectFuncCallRet.so `\`
+//        -passes="inject-func-call-ret<timing>" <bitcode-file>
+//      $ opt -load-pass-plugin <BUILD_DIR>/lib/libInjectFuncCallRet.so `\`
+//        -passes="inject-func-call-ret<stacks>" <bitcode-file> -o instr.bin
+//      $ LLVM_TUTOR_STACKS_OUTPUT=stacks.txt lli instr.bin
+//      $ flamegraph.pl stacks.txt > flame.svg
 //
 // License: MIT
 //========================================================================
 #include "InjectFuncCallRet.h"
+#include "DynamicCCRuntime.h"
+#include "NameTable.h"
+#include "TraceClock.h"
 
+#include "llvm/IR/EHPersonalities.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
 #include "llvm/Passes/PassBuilder.h"
+#include "llvm/IR/InstIterator.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Transforms/Utils/EscapeEnumerator.h"
+#include "llvm/Transforms/Utils/Local.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
 
 using namespace llvm;
 
 #define DEBUG_TYPE "inject-func-call"
 
 //-----------------------------------------------------------------------------
-// InjectFuncCall implementation
+// Latency histograms
+//-----------------------------------------------------------------------------
+// Every histogram covers [0, 2^(HistMaxExponent + 1)) with 2^HistSubBucketBits
+// buckets per power of 2 (and one bucket per value below 2^HistSubBucketBits).
+// Larger values are counted in the last bucket.
+static constexpr unsigned HistSubBucketBits = 3;
+static constexpr unsigned HistMaxExponent = 40;
+static constexpr uint64_t HistNumBuckets =
+    (HistMaxExponent - HistSubBucketBits + 2) << HistSubBucketBits;
+
+// Everything that the timing mode needs at run-time. The injected code is
+// equivalent to this C code:
+// ```
+//    static uint64_t FuncTimingHistograms[NumFuncs][HistNumBuckets];
+//
+//    static void func_timing_record(uint32_t FuncID, int64_t Elapsed) {
+//      uint64_t V = Elapsed < 0 ? 0 : Elapsed; // e.g. unsynchronised TSCs
+//      unsigned E = 63 - clz(V);
+//      unsigned Bucket;
+//      if (V < (1 << HistSubBucketBits))
+//        Bucket = V;
+//      else if (E > HistMaxExponent)
+//        Bucket = HistNumBuckets - 1;
+//      else
+//        Bucket = ((E - HistSubBucketBits + 1) << HistSubBucketBits) |
+//                 ((V >> (E - HistSubBucketBits)) & SubBucketMask);
+//      __atomic_fetch_add(&FuncTimingHistograms[FuncID][Bucket], 1,
+//                         __ATOMIC_RELAXED);
+//    }
+//    // Returns the upper bound of the first bucket at which the cumulative
+//    // count reaches Target
+//    static uint64_t func_timing_percentile(const uint64_t *Hist,
+//                                           uint64_t Target) {
+//      uint64_t Seen = 0;
+//      for (B = 0; B < HistNumBuckets - 1; B++)
+//        if ((Seen += Hist[B]) >= Target)
+//          break;
+//      return upper_bound(B);
+//    }
+//    static void func_timing_print(const char *Name, const uint64_t *Hist) {
+//      uint64_t Total = 0;
+//      for (B = 0; B < HistNumBuckets; B++)
+//        Total += Hist[B];
+//      if (Total)
+//        printf(Format, Name, Total,
+//               func_timing_percentile(Hist, ceil(Total * 0.5)),
+//               func_timing_percentile(Hist, ceil(Total * 0.99)),
+//               func_timing_percentile(Hist, ceil(Total * 0.999)));
+//    }
+// ```
+struct TimingRuntime {
+  GlobalVariable *Histograms = nullptr;
+  Function *Record = nullptr;
+  Function *Print = nullptr;
+};
+
+// Emits the upper bound of the values counted in Bucket
+static Value *CreateBucketUpperBound(IRBuilder<> &Builder, Value *Bucket) {
+  Value *Group = Builder.CreateLShr(Bucket, HistSubBucketBits);
+  Value *SubBucket =
+      Builder.CreateAnd(Bucket, (uint64_t(1) << HistSubBucketBits) - 1);
+  Value *Shift = Builder.CreateSub(Group, Builder.getInt64(1));
+  Value *Lower = Builder.CreateShl(
+      Builder.CreateOr(SubBucket, uint64_t(1) << HistSubBucketBits), Shift);
+  Value *Upper = Builder.CreateSub(
+      Builder.CreateAdd(Lower, Builder.CreateShl(Builder.getInt64(1), Shift)),
+      Builder.getInt64(1));
+  // The buckets of the values below 2^HistSubBucketBits hold a single value
+  return Builder.CreateSelect(
+      Builder.CreateICmpULT(Bucket,
+                            Builder.getInt64(1 << HistSubBucketBits)),
+      Bucket, Upper);
+}
+
+static TimingRuntime CreateTimingRuntime(Module &M, uint64_t NumFuncs,
+                                         FunctionCallee Printf,
+                                         Value *Format) {
+  auto &CTX = M.getContext();
+  PointerType *PtrTy = PointerType::getUnqual(CTX);
+  IntegerType *Int32Ty = Type::getInt32Ty(CTX);
+  IntegerType *Int64Ty = Type::getInt64Ty(CTX);
+  Type *VoidTy = Type::getVoidTy(CTX);
+  TimingRuntime RT;
+
+  auto *HistTy = ArrayType::get(Int64Ty, HistNumBuckets);
+  auto *HistogramsTy = ArrayType::get(HistTy, NumFuncs);
+  RT.Histograms = new GlobalVariable(M, HistogramsTy, /*isConstant=*/false,
+                                     GlobalValue::InternalLinkage,
+                                     Constant::getNullValue(HistogramsTy),
+                                     "FuncTimingHistograms");
+
+  // void func_timing_record(uint32_t FuncID, int64_t Elapsed)
+  RT.Record = Function::Create(
+      FunctionType::get(VoidTy, {Int32Ty, Int64Ty}, false),
+      GlobalValue::InternalLinkage, "func_timing_record", M);
+  RT.Record->addFnAttr(Attribute::NoUnwind);
+  {
+    IRBuilder<> Builder(BasicBlock::Create(CTX, "enter", RT.Record));
+    Value *V = Builder.CreateBinaryIntrinsic(
+        Intrinsic::smax, RT.Record->getArg(1), Builder.getInt64(0));
+    Value *E = Builder.CreateSub(
+        Builder.getInt64(63),
+        Builder.CreateBinaryIntrinsic(Intrinsic::ctlz, V,
+                                      Builder.getFalse()));
+    Value *SubBucket = Builder.CreateAnd(
+        Builder.CreateLShr(V, Builder.CreateSub(
+                                  E, Builder.getInt64(HistSubBucketBits))),
+        (uint64_t(1) << HistSubBucketBits) - 1);
+    Value *Bucket = Builder.CreateOr(
+        Builder.CreateShl(
+            Builder.CreateSub(E, Builder.getInt64(HistSubBucketBits - 1)),
+            HistSubBucketBits),
+        SubBucket);
+    Bucket = Builder.CreateSelect(
+        Builder.CreateICmpUGT(E, Builder.getInt64(HistMaxExponent)),
+        Builder.getInt64(HistNumBuckets - 1), Bucket);
+    Bucket = Builder.CreateSelect(
+        Builder.CreateICmpULT(V, Builder.getInt64(1 << HistSubBucketBits)), V,
+        Bucket, "bucket");
+
+    Value *Slot = Builder.CreateInBoundsGEP(
+        HistogramsTy, RT.Histograms,
+        {Builder.getInt64(0),
+         Builder.CreateZExt(RT.Record->getArg(0), Int64Ty), Bucket});
+    Builder.CreateAtomicRMW(AtomicRMWInst::Add, Slot, Builder.getInt64(1),
+                            Align(8), AtomicOrdering::Monotonic);
+    Builder.CreateRetVoid();
+  }
+
+  // uint64_t func_timing_percentile(const uint64_t *Hist, uint64_t Target)
+  Function *Percentile = Function::Create(
+      FunctionType::get(Int64Ty, {PtrTy, Int64Ty}, false),
+      GlobalValue::InternalLinkage, "func_timing_percentile", M);
+  {
+    BasicBlock *Entry = BasicBlock::Create(CTX, "enter", Percentile);
+    BasicBlock *Loop = BasicBlock::Create(CTX, "loop", Percentile);
+    BasicBlock *Done = BasicBlock::Create(CTX, "done", Percentile);
+    Value *Hist = Percentile->getArg(0);
+    Value *Target = Percentile->getArg(1);
+
+    IRBuilder<> Builder(Entry);
+    Builder.CreateBr(Loop);
+
+    Builder.SetInsertPoint(Loop);
+    PHINode *B = Builder.CreatePHI(Int64Ty, 2, "b");
+    PHINode *Seen = Builder.CreatePHI(Int64Ty, 2, "seen");
+    B->addIncoming(Builder.getInt64(0), Entry);
+    Seen->addIncoming(Builder.getInt64(0), Entry);
+    Value *NewSeen = Builder.CreateAdd(
+        Seen, Builder.CreateLoad(Int64Ty,
+                                 Builder.CreateInBoundsGEP(Int64Ty, Hist, B)));
+    Value *Found = Builder.CreateOr(
+        Builder.CreateICmpUGE(NewSeen, Target),
+        Builder.CreateICmpEQ(B, Builder.getInt64(HistNumBuckets - 1)));
+    B->addIncoming(Builder.CreateAdd(B, Builder.getInt64(1)), Loop);
+    Seen->addIncoming(NewSeen, Loop);
+    Builder.CreateCondBr(Found, Done, Loop);
+
+    Builder.SetInsertPoint(Done);
+    Builder.CreateRet(CreateBucketUpperBound(Builder, B));
+  }
+
+  // void func_timing_print(const char *Name, const uint64_t *Hist)
+  RT.Print = Function::Create(FunctionType::get(VoidTy, {PtrTy, PtrTy}, false),
+                              GlobalValue::InternalLinkage,
+                              "func_timing_print", M);
+  {
+    BasicBlock *Entry = BasicBlock::Create(CTX, "enter", RT.Print);
+    BasicBlock *Print = BasicBlock::Create(CTX, "print", RT.Print);
+    BasicBlock *Exit = BasicBlock::Create(CTX, "exit", RT.Print);
+    Value *Name = RT.Print->getArg(0);
+    Value *Hist = RT.Print->getArg(1);
+
+    IRBuilder<> Builder(Entry);
+    Value *Total = nullptr;
+    CreateCountedLoop(Builder, HistNumBuckets,
+                      [&](IRBuilder<> &Builder, Value *B) {
+                        // The running sum (Total is only used after the loop)
+                        BasicBlock *Loop = Builder.GetInsertBlock();
+                        PHINode *Sum = Builder.CreatePHI(Int64Ty, 2, "sum");
+                        Sum->addIncoming(Builder.getInt64(0), Entry);
+                        Total = Builder.CreateAdd(
+                            Sum, Builder.CreateLoad(
+                                     Int64Ty, Builder.CreateInBoundsGEP(
+                                                  Int64Ty, Hist, B)));
+                        Sum->addIncoming(Total, Loop);
+                      });
+    Builder.CreateCondBr(Builder.CreateIsNull(Total), Exit, Print);
+
+    Builder.SetInsertPoint(Print);
+    // Target = ceil(Total * PerMille / 1000)
+    auto CreatePercentile = [&](uint64_t PerMille) {
+      Value *Target = Builder.CreateUDiv(
+          Builder.CreateAdd(Builder.CreateMul(Total, Builder.getInt64(PerMille)),
+                            Builder.getInt64(999)),
+          Builder.getInt64(1000));
+      return Builder.CreateCall(Percentile, {Hist, Target});
+    };
+    Builder.CreateCall(Printf, {Format, Name, Total, CreatePercentile(500),
+                                CreatePercentile(990), CreatePercentile(999)});
+    Builder.CreateBr(Exit);
+
+    Builder.SetInsertPoint(Exit);
+    Builder.CreateRetVoid();
+  }
+
+  return RT;
+}
+
+//-----------------------------------------------------------------------------
+// Shadow stacks
+//-----------------------------------------------------------------------------
+// The maximum depth of every shadow stack, including the root. Deeper frames
+// are counted as dropped.
+static constexpr unsigned StackMaxDepth = 1024;
+
+// The shadow-stack entry of a dropped frame. It is never a trie node, so all
+// calls made under a dropped frame are counted as dropped too (rather than
+// being charged to the context of the dropped frame's caller).
+static constexpr uint32_t StackDroppedNode = ~uint32_t(0);
+
+// The environment variable that names the file with the collapsed stacks and
+// its default value
+static constexpr const char *StacksOutputEnvVar = "LLVM_TUTOR_STACKS_OUTPUT";
+static constexpr const char *StacksDefaultOutput = "func-stacks.txt";
+
+// Everything that the stacks mode needs at run-time. Every thread owns a
+// calling-context trie: node 0 is the root and every other node stands for a
+// function (FuncID) called from the context of its parent. The children are
+// found through an open-addressing hash table keyed by (Parent, FuncID), so
+// that the trie and its index live in a single per-thread arena. The shadow
+// stack holds the trie nodes of the active frames. The injected code is
+// equivalent to this C code:
+// ```
+//    struct FuncStackNode {
+//      uint32_t FuncID;
+//      uint32_t Parent;
+//      uint64_t Count;
+//    };
+//    struct FuncStackThread {
+//      struct FuncStackThread *Next;
+//      uint32_t Depth;
+//      uint32_t NumNodes;
+//      uint64_t Dropped;
+//      uint32_t Stack[StackMaxDepth + 1]; // + 1 for StackDroppedNode
+//      struct FuncStackNode Nodes[MaxNodes];
+//      uint32_t Buckets[2 * MaxNodes]; // 0 means "empty"
+//    };
+//    static struct FuncStackThread *FuncStackThreads;
+//    static __thread struct FuncStackThread *FuncStackCurrent;
+//
+//    static struct FuncStackThread *func_stack_new_thread() {
+//      struct FuncStackThread *T = calloc(1, sizeof(*T));
+//      if (!T)
+//        return NULL;
+//      T->NumNodes = 1;
+//      <push T onto FuncStackThreads, see func_trace_new_buffer in
+//       InjectFuncCall.cpp>
+//      FuncStackCurrent = T;
+//      return T;
+//    }
+//    // Returns the depth to restore on exit
+//    static uint32_t func_stack_enter(uint32_t FuncID) {
+//      struct FuncStackThread *T = FuncStackCurrent;
+//      if (!T && !(T = func_stack_new_thread()))
+//        return 0;
+//      uint32_t Depth = T->Depth, Parent = T->Stack[Depth];
+//      if (Parent == StackDroppedNode)
+//        goto count_dropped;
+//      if (Depth + 1 == StackMaxDepth)
+//        goto dropped;
+//      uint32_t H = hash(Parent, FuncID), Node;
+//      while ((Node = T->Buckets[H])) {
+//        if (T->Nodes[Node].FuncID == FuncID &&
+//            T->Nodes[Node].Parent == Parent)
+//          goto found;
+//        H = (H + 1) & (2 * MaxNodes - 1);
+//      }
+//      if (T->NumNodes == MaxNodes)
+//        goto dropped;
+//      Node = T->NumNodes++;
+//      T->Nodes[Node] = (struct FuncStackNode){FuncID, Parent, 0};
+//      T->Buckets[H] = Node;
+//    found:
+//      T->Nodes[Node].Count++;
+//      T->Stack[Depth + 1] = Node;
+//      T->Depth = Depth + 1;
+//      return Depth;
+//    dropped:
+//      T->Stack[Depth + 1] = StackDroppedNode;
+//      T->Depth = Depth + 1;
+//    count_dropped:
+//      T->Dropped++;
+//      return Depth;
+//    }
+//    static void func_stack_exit(uint32_t Depth) {
+//      if (FuncStackCurrent)
+//        FuncStackCurrent->Depth = Depth;
+//    }
+// ```
+// A dropped frame is pushed as StackDroppedNode, which makes the nested calls
+// dropped until it exits. Restoring the depth saved on entry (rather than
+// decrementing it) keeps the stack consistent when frames are skipped by
+// longjmp. Every thread is the
+// only writer of its trie, so nothing is atomic apart from publishing the
+// thread in FuncStackThreads.
+struct StacksRuntime {
+  StructType *NodeTy = nullptr;
+  StructType *ThreadTy = nullptr;
+  GlobalVariable *Threads = nullptr;
+  Function *Enter = nullptr;
+  Function *Exit = nullptr;
+};
+
+static StacksRuntime CreateStacksRuntime(Module &M, unsigned MaxNodes) {
+  auto &CTX = M.getContext();
+  const DataLayout &DL = M.getDataLayout();
+  PointerType *PtrTy = PointerType::getUnqual(CTX);
+  IntegerType *Int32Ty = Type::getInt32Ty(CTX);
+  IntegerType *Int64Ty = Type::getInt64Ty(CTX);
+  IntegerType *SizeTy = DL.getIntPtrType(CTX);
+  const uint64_t NumBuckets = 2 * uint64_t(MaxNodes);
+  StacksRuntime RT;
+
+  RT.NodeTy = StructType::get(CTX, {Int32Ty, Int32Ty, Int64Ty});
+  RT.ThreadTy = StructType::get(
+      CTX, {PtrTy, Int32Ty, Int32Ty, Int64Ty,
+            ArrayType::get(Int32Ty, StackMaxDepth + 1),
+            ArrayType::get(RT.NodeTy, MaxNodes),
+            ArrayType::get(Int32Ty, NumBuckets)});
+  StructType *ThreadTy = RT.ThreadTy;
+  StructType *NodeTy = RT.NodeTy;
+
+  RT.Threads = new GlobalVariable(M, PtrTy, /*isConstant=*/false,
+                                  GlobalValue::InternalLinkage,
+                                  ConstantPointerNull::get(PtrTy),
+                                  "FuncStackThreads");
+  auto *Current = new GlobalVariable(
+      M, PtrTy, /*isConstant=*/false, GlobalValue::InternalLinkage,
+      ConstantPointerNull::get(PtrTy), "FuncStackCurrent",
+      /*InsertBefore=*/nullptr, GlobalValue::GeneralDynamicTLSModel);
+
+  // struct FuncStackThread *func_stack_new_thread()
+  FunctionCallee Calloc = M.getOrInsertFunction(
+      "calloc", FunctionType::get(PtrTy, {SizeTy, SizeTy}, false));
+  Function *NewThread = Function::Create(FunctionType::get(PtrTy, false),
+                                         GlobalValue::InternalLinkage,
+                                         "func_stack_new_thread", M);
+  NewThread->addFnAttr(Attribute::Cold);
+  NewThread->addFnAttr(Attribute::NoInline);
+  NewThread->addFnAttr(Attribute::NoUnwind);
+  {
+    BasicBlock *Entry = BasicBlock::Create(CTX, "enter", NewThread);
+    BasicBlock *Allocated = BasicBlock::Create(CTX, "allocated", NewThread);
+    BasicBlock *Publish = BasicBlock::Create(CTX, "publish", NewThread);
+    BasicBlock *Published = BasicBlock::Create(CTX, "published", NewThread);
+    BasicBlock *Failed = BasicBlock::Create(CTX, "failed", NewThread);
+
+    IRBuilder<> Builder(Entry);
+    Value *T = Builder.CreateCall(
+        Calloc, {ConstantInt::get(SizeTy, 1),
+                 ConstantInt::get(SizeTy, DL.getTypeAllocSize(ThreadTy))});
+    Builder.CreateCondBr(Builder.CreateIsNull(T), Failed, Allocated);
+
+    Builder.SetInsertPoint(Allocated);
+    Builder.CreateStore(Builder.getInt32(1),
+                        Builder.CreateStructGEP(ThreadTy, T, 2));
+    LoadInst *First = Builder.CreateAlignedLoad(PtrTy, RT.Threads, Align(8));
+    First->setAtomic(AtomicOrdering::Monotonic);
+    Value *NextAddr = Builder.CreateStructGEP(ThreadTy, T, 0);
+    Builder.CreateBr(Publish);
+
+    // Push T onto FuncStackThreads
+    Builder.SetInsertPoint(Publish);
+    PHINode *Expected = Builder.CreatePHI(PtrTy, 2, "expected");
+    Expected->addIncoming(First, Allocated);
+    Builder.CreateStore(Expected, NextAddr);
+    AtomicCmpXchgInst *CmpXchg = Builder.CreateAtomicCmpXchg(
+        RT.Threads, Expected, T, Align(8), AtomicOrdering::Release,
+        AtomicOrdering::Monotonic);
+    CmpXchg->setWeak(true);
+    Expected->addIncoming(Builder.CreateExtractValue(CmpXchg, 0), Publish);
+    Builder.CreateCondBr(Builder.CreateExtractValue(CmpXchg, 1), Published,
+                         Publish);
+
+    Builder.SetInsertPoint(Published);
+    Builder.CreateStore(T, Builder.CreateThreadLocalAddress(Current));
+    Builder.CreateRet(T);
+
+    Builder.SetInsertPoint(Failed);
+    Builder.CreateRet(ConstantPointerNull::get(PtrTy));
+  }
+
+  // uint32_t func_stack_enter(uint32_t FuncID)
+  RT.Enter = Function::Create(FunctionType::get(Int32Ty, {Int32Ty}, false),
+                              GlobalValue::InternalLinkage, "func_stack_enter",
+                              M);
+  RT.Enter->addFnAttr(Attribute::NoUnwind);
+  {
+    BasicBlock *Entry = BasicBlock::Create(CTX, "enter", RT.Enter);
+    BasicBlock *Slow = BasicBlock::Create(CTX, "slow", RT.Enter);
+    BasicBlock *Failed = BasicBlock::Create(CTX, "failed", RT.Enter);
+    BasicBlock *Fast = BasicBlock::Create(CTX, "fast", RT.Enter);
+    BasicBlock *CheckDepth = BasicBlock::Create(CTX, "check_depth", RT.Enter);
+    BasicBlock *Lookup = BasicBlock::Create(CTX, "lookup", RT.Enter);
+    BasicBlock *Probe = BasicBlock::Create(CTX, "probe", RT.Enter);
+    BasicBlock *Check = BasicBlock::Create(CTX, "check", RT.Enter);
+    BasicBlock *Insert = BasicBlock::Create(CTX, "insert", RT.Enter);
+    BasicBlock *NewNode = BasicBlock::Create(CTX, "new_node", RT.Enter);
+    BasicBlock *Found = BasicBlock::Create(CTX, "found", RT.Enter);
+    BasicBlock *Dropped = BasicBlock::Create(CTX, "dropped", RT.Enter);
+    BasicBlock *CountDropped =
+        BasicBlock::Create(CTX, "count_dropped", RT.Enter);
+    MDNode *Unlikely = MDBuilder(CTX).createUnlikelyBranchWeights();
+    Value *FuncID = RT.Enter->getArg(0);
+
+    IRBuilder<> Builder(Entry);
+    Value *Cur = Builder.CreateLoad(
+        PtrTy, Builder.CreateThreadLocalAddress(Current), "cur");
+    Builder.CreateCondBr(Builder.CreateIsNull(Cur), Slow, Fast, Unlikely);
+
+    Builder.SetInsertPoint(Slow);
+    Value *NewT = Builder.CreateCall(NewThread);
+    Builder.CreateCondBr(Builder.CreateIsNull(NewT), Failed, Fast);
+
+    Builder.SetInsertPoint(Failed);
+    Builder.CreateRet(Builder.getInt32(0));
+
+    Builder.SetInsertPoint(Fast);
+    PHINode *T = Builder.CreatePHI(PtrTy, 2, "t");
+    T->addIncoming(Cur, Entry);
+    T->addIncoming(NewT, Slow);
+    Value *DepthAddr = Builder.CreateStructGEP(ThreadTy, T, 1);
+    Value *Depth = Builder.CreateLoad(Int32Ty, DepthAddr, "depth");
+    Value *Parent = Builder.CreateLoad(
+        Int32Ty,
+        Builder.CreateInBoundsGEP(ThreadTy, T,
+                                  {Builder.getInt32(0), Builder.getInt32(4),
+                                   Depth}),
+        "parent");
+    Value *NewDepth = Builder.CreateAdd(Depth, Builder.getInt32(1));
+    // Called under a dropped frame
+    Builder.CreateCondBr(
+        Builder.CreateICmpEQ(Parent, Builder.getInt32(StackDroppedNode)),
+        CountDropped, CheckDepth, Unlikely);
+
+    Builder.SetInsertPoint(CheckDepth);
+    Builder.CreateCondBr(
+        Builder.CreateICmpEQ(NewDepth, Builder.getInt32(StackMaxDepth)),
+        Dropped, Lookup, Unlikely);
+
+    // Fibonacci hashing of (Parent, FuncID)
+    Builder.SetInsertPoint(Lookup);
+    Value *Key = Builder.CreateOr(
+        Builder.CreateShl(Builder.CreateZExt(Parent, Int64Ty), 32),
+        Builder.CreateZExt(FuncID, Int64Ty));
+    Value *Hash = Builder.CreateTrunc(
+        Builder.CreateLShr(
+            Builder.CreateMul(Key, Builder.getInt64(0x9e3779b97f4a7c15ULL)),
+            64 - Log2_64(NumBuckets)),
+        Int32Ty);
+    Builder.CreateBr(Probe);
+
+    Builder.SetInsertPoint(Probe);
+    PHINode *H = Builder.CreatePHI(Int32Ty, 2, "h");
+    H->addIncoming(Hash, Lookup);
+    Value *BucketAddr = Builder.CreateInBoundsGEP(
+        ThreadTy, T, {Builder.getInt32(0), Builder.getInt32(6), H});
+    Value *Idx = Builder.CreateLoad(Int32Ty, BucketAddr, "idx");
+    Builder.CreateCondBr(Builder.CreateIsNull(Idx), Insert, Check);
+
+    auto CreateNodeGEP = [&](Value *Node, unsigned Field) {
+      return Builder.CreateInBoundsGEP(
+          ThreadTy, T,
+          {Builder.getInt32(0), Builder.getInt32(5), Node,
+           Builder.getInt32(Field)});
+    };
+
+    Builder.SetInsertPoint(Check);
+    Value *Matches = Builder.CreateAnd(
+        Builder.CreateICmpEQ(
+            Builder.CreateLoad(Int32Ty, CreateNodeGEP(Idx, 0)), FuncID),
+        Builder.CreateICmpEQ(
+            Builder.CreateLoad(Int32Ty, CreateNodeGEP(Idx, 1)), Parent));
+    H->addIncoming(Builder.CreateAnd(Builder.CreateAdd(H, Builder.getInt32(1)),
+                                     NumBuckets - 1),
+                   Check);
+    Builder.CreateCondBr(Matches, Found, Probe);
+
+    // At most half of the buckets are ever used, so the probing above always
+    // finds an empty one
+    Builder.SetInsertPoint(Insert);
+    Value *NumNodesAddr = Builder.CreateStructGEP(ThreadTy, T, 2);
+    Value *New = Builder.CreateLoad(Int32Ty, NumNodesAddr, "new");
+    Builder.CreateCondBr(
+        Builder.CreateICmpEQ(New, Builder.getInt32(MaxNodes)), Dropped,
+        NewNode, Unlikely);
+
+    Builder.SetInsertPoint(NewNode);
+    Builder.CreateStore(FuncID, CreateNodeGEP(New, 0));
+    Builder.CreateStore(Parent, CreateNodeGEP(New, 1));
+    Builder.CreateStore(Builder.getInt64(0), CreateNodeGEP(New, 2));
+    Builder.CreateStore(New, BucketAddr);
+    Builder.CreateStore(Builder.CreateAdd(New, Builder.getInt32(1)),
+                        NumNodesAddr);
+    Builder.CreateBr(Found);
+
+    Builder.SetInsertPoint(Found);
+    PHINode *Node = Builder.CreatePHI(Int32Ty, 2, "node");
+    Node->addIncoming(Idx, Check);
+    Node->addIncoming(New, NewNode);
+    Value *CountAddr = CreateNodeGEP(Node, 2);
+    Builder.CreateStore(
+        Builder.CreateAdd(Builder.CreateLoad(Int64Ty, CountAddr),
+                          Builder.getInt64(1)),
+        CountAddr);
+    Builder.CreateStore(Node, Builder.CreateInBoundsGEP(
+                                  ThreadTy, T,
+                                  {Builder.getInt32(0), Builder.getInt32(4),
+                                   NewDepth}));
+    Builder.CreateStore(NewDepth, DepthAddr);
+    Builder.CreateRet(Depth);
+
+    Builder.SetInsertPoint(Dropped);
+    Builder.CreateStore(Builder.getInt32(StackDroppedNode),
+                        Builder.CreateInBoundsGEP(
+                            ThreadTy, T,
+                            {Builder.getInt32(0), Builder.getInt32(4),
+                             NewDepth}));
+    Builder.CreateStore(NewDepth, DepthAddr);
+    Builder.CreateBr(CountDropped);
+
+    Builder.SetInsertPoint(CountDropped);
+    Value *DroppedAddr = Builder.CreateStructGEP(ThreadTy, T, 3);
+    Builder.CreateStore(
+        Builder.CreateAdd(Builder.CreateLoad(Int64Ty, DroppedAddr),
+                          Builder.getInt64(1)),
+        DroppedAddr);
+    Builder.CreateRet(Depth);
+  }
+
+  // void func_stack_exit(uint32_t Depth)
+  RT.Exit = Function::Create(
+      FunctionType::get(Type::getVoidTy(CTX), {Int32Ty}, false),
+      GlobalValue::InternalLinkage, "func_stack_exit", M);
+  RT.Exit->addFnAttr(Attribute::NoUnwind);
+  {
+    BasicBlock *Entry = BasicBlock::Create(CTX, "enter", RT.Exit);
+    BasicBlock *Restore = BasicBlock::Create(CTX, "restore", RT.Exit);
+    BasicBlock *Exit = BasicBlock::Create(CTX, "exit", RT.Exit);
+
+    IRBuilder<> Builder(Entry);
+    Value *T = Builder.CreateLoad(
+        PtrTy, Builder.CreateThreadLocalAddress(Current), "t");
+    Builder.CreateCondBr(Builder.CreateIsNull(T), Exit, Restore);
+
+    Builder.SetInsertPoint(Restore);
+    Builder.CreateStore(RT.Exit->getArg(0),
+                        Builder.CreateStructGEP(ThreadTy, T, 1));
+    Builder.CreateBr(Exit);
+
+    Builder.SetInsertPoint(Exit);
+    Builder.CreateRetVoid();
+  }
+
+  return RT;
+}
+
+// Creates `func_stack_report`, which writes the tries of all threads as
+// collapsed stacks (one `caller;...;callee count` line per trie node), i.e.
+// the input format of flamegraph.pl and similar tools. It is equivalent to
+// this C code:
+// ```
+//    static void func_stack_report() {
+//      const char *Path = getenv("LLVM_TUTOR_STACKS_OUTPUT");
+//      FILE *Out = fopen(Path ? Path : "func-stacks.txt", "w");
+//      if (!Out)
+//        return;
+//      uint32_t Frames[StackMaxDepth];
+//      for (T = __atomic_load_n(&FuncStackThreads, __ATOMIC_ACQUIRE); T;
+//           T = T->Next) {
+//        for (N = 1; N < T->NumNodes; N++) {
+//          uint32_t Len = 0;
+//          for (C = N; C; C = T->Nodes[C].Parent)
+//            Frames[Len++] = C;
+//          for (I = Len; I; I--) {
+//            uint32_t FuncID = T->Nodes[Frames[I - 1]].FuncID;
+//            fprintf(Out, I == Len ? "%s" : ";%s",
+//                    &LLVMTutorNames[NameOffsets[FuncID]]);
+//          }
+//          fprintf(Out, " %llu\n", T->Nodes[N].Count);
+//        }
+//        if (T->Dropped)
+//          fprintf(Out, "[dropped] %llu\n", T->Dropped);
+//      }
+//      fclose(Out);
+//    }
+// ```
+// Identical stacks of different threads are summed up by the flame-graph
+// tools.
+static Function *CreateStacksReport(Module &M, const StacksRuntime &RT,
+                                    NameTable &Names,
+                                    GlobalVariable *NameOffsets) {
+  auto &CTX = M.getContext();
+  PointerType *PtrTy = PointerType::getUnqual(CTX);
+  IntegerType *Int32Ty = Type::getInt32Ty(CTX);
+  IntegerType *Int64Ty = Type::getInt64Ty(CTX);
+  StructType *ThreadTy = RT.ThreadTy;
+
+  FunctionCallee Getenv = M.getOrInsertFunction(
+      "getenv", FunctionType::get(PtrTy, {PtrTy}, false));
+  FunctionCallee Fopen = M.getOrInsertFunction(
+      "fopen", FunctionType::get(PtrTy, {PtrTy, PtrTy}, false));
+  FunctionCallee Fprintf = M.getOrInsertFunction(
+      "fprintf", FunctionType::get(Int32Ty, {PtrTy, PtrTy}, true));
+  FunctionCallee Fclose = M.getOrInsertFunction(
+      "fclose", FunctionType::get(Int32Ty, {PtrTy}, false));
+
+  Function *ReportF = Function::Create(
+      FunctionType::get(Type::getVoidTy(CTX), false),
+      GlobalValue::InternalLinkage, "func_stack_report", M);
+  BasicBlock *Entry = BasicBlock::Create(CTX, "enter", ReportF);
+  BasicBlock *Write = BasicBlock::Create(CTX, "write", ReportF);
+  BasicBlock *ThreadLoop = BasicBlock::Create(CTX, "thread", ReportF);
+  BasicBlock *ThreadBody = BasicBlock::Create(CTX, "thread_body", ReportF);
+  BasicBlock *NodeLoop = BasicBlock::Create(CTX, "node", ReportF);
+  BasicBlock *PathLoop = BasicBlock::Create(CTX, "path", ReportF);
+  BasicBlock *PrintLoop = BasicBlock::Create(CTX, "print", ReportF);
+  BasicBlock *NodeDone = BasicBlock::Create(CTX, "node_done", ReportF);
+  BasicBlock *ThreadDone = BasicBlock::Create(CTX, "thread_done", ReportF);
+  BasicBlock *PrintDropped = BasicBlock::Create(CTX, "dropped", ReportF);
+  BasicBlock *NextThread = BasicBlock::Create(CTX, "next_thread", ReportF);
+  BasicBlock *Done = BasicBlock::Create(CTX, "done", ReportF);
+  BasicBlock *Exit = BasicBlock::Create(CTX, "exit", ReportF);
+
+  IRBuilder<> Builder(Entry);
+  auto *FramesTy = ArrayType::get(Int32Ty, StackMaxDepth);
+  Value *Frames = Builder.CreateAlloca(FramesTy, nullptr, "frames");
+  Value *EnvPath = Builder.CreateCall(
+      Getenv, {Builder.CreateGlobalString(StacksOutputEnvVar)});
+  Value *OutPath = Builder.CreateSelect(
+      Builder.CreateIsNull(EnvPath),
+      Builder.CreateGlobalString(StacksDefaultOutput), EnvPath);
+  Value *Out =
+      Builder.CreateCall(Fopen, {OutPath, Builder.CreateGlobalString("w")});
+  Builder.CreateCondBr(Builder.CreateIsNull(Out), Exit, Write);
+
+  Builder.SetInsertPoint(Write);
+  Value *FirstFmt = Builder.CreateGlobalString("%s");
+  Value *NextFmt = Builder.CreateGlobalString(";%s");
+  Value *CountFmt = Builder.CreateGlobalString(" %llu\n");
+  Value *DroppedFmt = Builder.CreateGlobalString("[dropped] %llu\n");
+  LoadInst *First = Builder.CreateAlignedLoad(PtrTy, RT.Threads, Align(8));
+  First->setAtomic(AtomicOrdering::Acquire);
+  Builder.CreateBr(ThreadLoop);
+
+  // for (T = FuncStackThreads; T; T = T->Next)
+  Builder.SetInsertPoint(ThreadLoop);
+  PHINode *T = Builder.CreatePHI(PtrTy, 2, "t");
+  T->addIncoming(First, Write);
+  Builder.CreateCondBr(Builder.CreateIsNull(T), Done, ThreadBody);
+
+  auto CreateNodeGEP = [&](Value *Node, unsigned Field) {
+    return Builder.CreateInBoundsGEP(
+        ThreadTy, T,
+        {Builder.getInt32(0), Builder.getInt32(5), Node,
+         Builder.getInt32(Field)});
+  };
+
+  Builder.SetInsertPoint(ThreadBody);
+  Value *NumNodes = Builder.CreateLoad(
+      Int32Ty, Builder.CreateStructGEP(ThreadTy, T, 2), "num_nodes");
+  Builder.CreateCondBr(Builder.CreateICmpUGT(NumNodes, Builder.getInt32(1)),
+                       NodeLoop, ThreadDone);
+
+  // for (N = 1; N < NumNodes; N++)
+  Builder.SetInsertPoint(NodeLoop);
+  PHINode *N = Builder.CreatePHI(Int32Ty, 2, "n");
+  N->addIncoming(Builder.getInt32(1), ThreadBody);
+  Builder.CreateBr(PathLoop);
+
+  // Collect the path from N to the root (the root itself is not printed)
+  Builder.SetInsertPoint(PathLoop);
+  PHINode *C = Builder.CreatePHI(Int32Ty, 2, "c");
+  PHINode *Len = Builder.CreatePHI(Int32Ty, 2, "len");
+  C->addIncoming(N, NodeLoop);
+  Len->addIncoming(Builder.getInt32(0), NodeLoop);
+  Builder.CreateStore(
+      C,
+      Builder.CreateInBoundsGEP(FramesTy, Frames, {Builder.getInt32(0), Len}));
+  Value *NewLen = Builder.CreateAdd(Len, Builder.getInt32(1), "new_len");
+  Value *CParent = Builder.CreateLoad(Int32Ty, CreateNodeGEP(C, 1));
+  C->addIncoming(CParent, PathLoop);
+  Len->addIncoming(NewLen, PathLoop);
+  Builder.CreateCondBr(Builder.CreateIsNull(CParent), PrintLoop, PathLoop);
+
+  // Print the path, outermost frame first
+  Builder.SetInsertPoint(PrintLoop);
+  PHINode *I = Builder.CreatePHI(Int32Ty, 2, "i");
+  I->addIncoming(NewLen, PathLoop);
+  Value *IMinus1 = Builder.CreateSub(I, Builder.getInt32(1));
+  Value *Frame = Builder.CreateLoad(
+      Int32Ty,
+      Builder.CreateInBoundsGEP(FramesTy, Frames,
+                                {Builder.getInt32(0), IMinus1}));
+  Value *FuncID = Builder.CreateLoad(Int32Ty, CreateNodeGEP(Frame, 0));
+  Value *Name = Names.CreateAddress(
+      Builder, Builder.CreateLoad(Int32Ty, Builder.CreateInBoundsGEP(
+                                               Int32Ty, NameOffsets, FuncID)));
+  Builder.CreateCall(
+      Fprintf, {Out,
+                Builder.CreateSelect(Builder.CreateICmpEQ(I, NewLen), FirstFmt,
+                                     NextFmt),
+                Name});
+  I->addIncoming(IMinus1, PrintLoop);
+  Builder.CreateCondBr(Builder.CreateIsNull(IMinus1), NodeDone, PrintLoop);
+
+  Builder.SetInsertPoint(NodeDone);
+  Builder.CreateCall(
+      Fprintf,
+      {Out, CountFmt, Builder.CreateLoad(Int64Ty, CreateNodeGEP(N, 2))});
+  Value *NextN = Builder.CreateAdd(N, Builder.getInt32(1));
+  N->addIncoming(NextN, NodeDone);
+  Builder.CreateCondBr(Builder.CreateICmpULT(NextN, NumNodes), NodeLoop,
+                       ThreadDone);
+
+  Builder.SetInsertPoint(ThreadDone);
+  Value *NumDropped = Builder.CreateLoad(
+      Int64Ty, Builder.CreateStructGEP(ThreadTy, T, 3), "dropped");
+  Builder.CreateCondBr(Builder.CreateIsNull(NumDropped), NextThread,
+                       PrintDropped);
+
+  Builder.SetInsertPoint(PrintDropped);
+  Builder.CreateCall(Fprintf, {Out, DroppedFmt, NumDropped});
+  Builder.CreateBr(NextThread);
+
+  Builder.SetInsertPoint(NextThread);
+  T->addIncoming(
+      Builder.CreateLoad(PtrTy, Builder.CreateStructGEP(ThreadTy, T, 0)),
+      NextThread);
+  Builder.CreateBr(ThreadLoop);
+
+  Builder.SetInsertPoint(Done);
+  Builder.CreateCall(Fclose, {Out});
+  Builder.CreateBr(Exit);
+
+  Builder.SetInsertPoint(Exit);
+  Builder.CreateRetVoid();
+
+  return ReportF;
+}
+
+//-----------------------------------------------------------------------------
+// Exit points
+//-----------------------------------------------------------------------------
+// The `funclet` bundle for the calls in Pad (none if Pad is `none`). Calls in
+// a funclet without it are treated as unreachable by WinEHPrepare.
+static SmallVector<OperandBundleDef, 1> getFuncletBundle(Value *Pad) {
+  SmallVector<OperandBundleDef, 1> Bundles;
+  if (!isa<ConstantTokenNone>(Pad))
+    Bundles.emplace_back("funclet", Pad);
+  return Bundles;
+}
+
+// The funclet (pad) that I belongs to, or `none`
+static Value *getFuncletPad(Instruction &I) {
+  auto *CB = dyn_cast<CallBase>(&I);
+  if (CB)
+    if (auto Bundle = CB->getOperandBundle(LLVMContext::OB_funclet))
+      return Bundle->Inputs[0];
+  return ConstantTokenNone::get(I.getContext());
+}
+
+// The exits through exceptions of a function that uses funclet-based EH (e.g.
+// MSVC C++), which EscapeEnumerator doesn't support. These are the unwind
+// edges to the caller:
+//   * `cleanupret ... unwind to caller` and `catchswitch ... unwind to caller`,
+//     which are recreated with a new cleanup as their unwind destination,
+//   * calls that may throw, which are turned into invokes that unwind to that
+//     cleanup.
+// The cleanup is a single top-level `cleanuppad within none` that is
+// instrumented and then unwinds to the caller. Every unwind edge to the
+// caller is replaced with an edge to the same pad, so the unwind destinations
+// of the funclets stay consistent.
+static unsigned instrumentFuncletExitPoints(
+    Function &F, function_ref<void(IRBuilder<> &)> Instrument) {
+  SmallVector<CleanupReturnInst *, 4> CleanupRets;
+  SmallVector<CatchSwitchInst *, 4> CatchSwitches;
+  SmallVector<CallInst *, 16> Calls;
+  for (Instruction &I : instructions(F)) {
+    if (auto *CRI = dyn_cast<CleanupReturnInst>(&I)) {
+      if (CRI->unwindsToCaller())
+        CleanupRets.push_back(CRI);
+    } else if (auto *CSI = dyn_cast<CatchSwitchInst>(&I)) {
+      if (CSI->unwindsToCaller())
+        CatchSwitches.push_back(CSI);
+    } else if (auto *CI = dyn_cast<CallInst>(&I)) {
+      if (!CI->doesNotThrow() && !CI->isMustTailCall())
+        Calls.push_back(CI);
+    }
+  }
+
+  if (CleanupRets.empty() && CatchSwitches.empty() && Calls.empty())
+    return 0;
+
+  auto &CTX = F.getContext();
+  BasicBlock *CleanupBB = BasicBlock::Create(CTX, "func_exit_cleanup", &F);
+  IRBuilder<> Builder(CleanupBB);
+  CleanupPadInst *Pad =
+      Builder.CreateCleanupPad(ConstantTokenNone::get(CTX), {});
+  CleanupReturnInst *Resume =
+      Builder.CreateCleanupRet(Pad, /*UnwindBB=*/nullptr);
+  auto Bundles = getFuncletBundle(Pad);
+  IRBuilder<> ExitBuilder(Resume, /*FPMathTag=*/nullptr, Bundles);
+  Instrument(ExitBuilder);
+
+  // Neither instruction can get an unwind destination, so they're recreated
+  for (CleanupReturnInst *CRI : CleanupRets) {
+    CleanupReturnInst::Create(CRI->getCleanupPad(), CleanupBB, CRI);
+    CRI->eraseFromParent();
+  }
+  for (CatchSwitchInst *CSI : CatchSwitches) {
+    auto *NewCSI = CatchSwitchInst::Create(
+        CSI->getParentPad(), CleanupBB, CSI->getNumHandlers(), "", CSI);
+    for (BasicBlock *Handler : CSI->handlers())
+      NewCSI->addHandler(Handler);
+    NewCSI->takeName(CSI);
+    CSI->replaceAllUsesWith(NewCSI);
+    CSI->eraseFromParent();
+  }
+
+  // The invokes keep their `funclet` bundles
+  for (CallInst *CI : Calls)
+    changeToInvokeAndSplitBasicBlock(CI, CleanupBB);
+
+  return 1;
+}
+
+// Calls Instrument with a builder positioned right before every point at which
+// F can exit and returns the number of such points. These are:
+//   * every `ret` (or the `musttail` call that precedes it - nothing can be
+//     inserted between the two),
+//   * every `resume`, i.e. the ends of the existing cleanups,
+//   * every call that may throw: unless F is `nounwind`, such calls are turned
+//     into invokes that unwind to a new cleanup block, which is instrumented
+//     and then resumes unwinding (see EscapeEnumerator),
+//   * every call to a `noreturn` function that cannot throw, e.g. `longjmp`,
+//     `exit` or `abort`.
+// Functions with funclet-based EH (e.g. MSVC C++) have no `resume`s. Their
+// exceptions leave through `cleanupret`s and `catchswitch`es instead, see
+// instrumentFuncletExitPoints.
+// With longjmp, only the frame that calls it is covered - the frames between
+// that one and the one that called setjmp are discarded without executing any
+// code.
+static unsigned instrumentExitPoints(
+    Function &F, function_ref<void(IRBuilder<> &)> Instrument) {
+  unsigned NumExitPoints = 0;
+
+  // Collected first, so that the calls injected by Instrument are not visited
+  SmallVector<CallInst *, 4> NoReturnCalls;
+  for (Instruction &I : instructions(F)) {
+    auto *CI = dyn_cast<CallInst>(&I);
+    if (CI && CI->doesNotReturn() && !isa<IntrinsicInst>(CI) &&
+        (CI->doesNotThrow() || F.doesNotThrow()))
+      NoReturnCalls.push_back(CI);
+  }
+  for (CallInst *CI : NoReturnCalls) {
+    auto Bundles = getFuncletBundle(getFuncletPad(*CI));
+    IRBuilder<> Builder(CI, /*FPMathTag=*/nullptr, Bundles);
+    Instrument(Builder);
+    NumExitPoints++;
+  }
+
+  // The calls injected by Instrument must not throw, otherwise they would be
+  // turned into invokes as well
+  bool ScopedEH = F.hasPersonalityFn() &&
+                  isScopedEHPersonality(
+                      classifyEHPersonality(F.getPersonalityFn()));
+  EscapeEnumerator EE(F, "func_exit_cleanup",
+                      /*HandleExceptions=*/!ScopedEH);
+  while (IRBuilder<> *AtExit = EE.Next()) {
+    Instrument(*AtExit);
+    NumExitPoints++;
+  }
+  if (ScopedEH && !F.doesNotThrow())
+    NumExitPoints += instrumentFuncletExitPoints(F, Instrument);
+
+  return NumExitPoints;
+}
+
+//-----------------------------------------------------------------------------
+// InjectFuncCallRet implementation
 //-----------------------------------------------------------------------------
 bool InjectFuncCallRet::runOnModule(Module &M) {
+  if (Opts.Stacks)
+    return injectStacks(M);
+  return Opts.Timing ? injectTiming(M) : injectPrintf(M);
+}
+
+bool InjectFuncCallRet::injectTiming(Module &M) {
+  // Functions to instrument. The position in this vector is the function's ID,
+  // i.e. the index of its histogram.
+  SmallVector<Function *, 16> Funcs;
+  InstrumentationFilter Filter(Opts.Filter);
+  for (auto &F : M)
+    if (Filter.shouldInstrument(F))
+      Funcs.push_back(&F);
+
+  if (Funcs.empty())
+    return false;
+
+  auto &CTX = M.getContext();
+  FunctionCallee Printf = getOrInsertPrintf(M);
+
+  // The report, `func_timing_report`, is equivalent to this C code:
+  // ```
+  //    void func_timing_report() {
+  //      printf(Header);
+  //      for (i = 0; i < NumFuncs; i++)
+  //        func_timing_print(&LLVMTutorNames[NameOffsets[i]],
+  //                          FuncTimingHistograms[i]);
+  //    }
+  // ```
+  Function *ReportF = Function::Create(
+      FunctionType::get(Type::getVoidTy(CTX), false),
+      GlobalValue::InternalLinkage, "func_timing_report", M);
+  IRBuilder<> Builder(BasicBlock::Create(CTX, "enter", ReportF));
+
+  // The runtime functions are not in Funcs, so they are not timed themselves
+  TimingRuntime RT = CreateTimingRuntime(
+      M, Funcs.size(), Printf,
+      Builder.CreateGlobalString("%-20s %-10llu %-12llu %-12llu %-12llu\n"));
+
+  // STEP 1: Time every function
+  // ---------------------------
+  NameTable Names(M);
+  SmallVector<uint32_t, 16> NameOffsets;
+  for (auto [ID, F] : enumerate(Funcs)) {
+    NameOffsets.push_back(Names.add(F->getName()));
+
+    // The clock is read at the entry only if the function can exit at all.
+    // The entry dominates every exit point, including the new cleanups.
+    Value *Start = nullptr;
+    unsigned NumExitPoints =
+        instrumentExitPoints(*F, [&](IRBuilder<> &ExitBuilder) {
+          if (!Start) {
+            IRBuilder<> EntryBuilder(
+                &*F->getEntryBlock().getFirstInsertionPt());
+            Start = CreateReadTraceClock(EntryBuilder, M);
+          }
+          Value *Elapsed = ExitBuilder.CreateSub(
+              CreateReadTraceClock(ExitBuilder, M), Start);
+          ExitBuilder.CreateCall(RT.Record,
+                                 {ExitBuilder.getInt32(ID), Elapsed});
+        });
+
+    LLVM_DEBUG(dbgs() << " Timing " << F->getName() << " (ID " << ID
+                      << ", " << NumExitPoints << " exit points)\n");
+    (void)NumExitPoints;
+  }
+  Names.finalize();
+
+  // STEP 2: Print the percentiles when the module exits
+  // ---------------------------------------------------
+  std::string Header;
+  Header += "=================================================\n";
+  Header += "LLVM-TUTOR: function latency ";
+  Header += traceClockCountsCycles(M) ? "(cycles)\n" : "(ns)\n";
+  Header += "=================================================\n";
+  Header += "NAME                 #N CALLS   P50          P99          P99.9\n";
+  Header += "-------------------------------------------------\n";
+  Builder.CreateCall(Printf, {Builder.CreateGlobalString(Header)});
+
+  Constant *NameOffsetsInit = ConstantDataArray::get(CTX, NameOffsets);
+  auto *NameOffsetsVar = new GlobalVariable(
+      M, NameOffsetsInit->getType(), /*isConstant=*/true,
+      GlobalValue::PrivateLinkage, NameOffsetsInit, "FuncTimingNameOffsets");
+  CreateCountedLoop(
+      Builder, Funcs.size(), [&](IRBuilder<> &Builder, Value *I) {
+        Value *Name = Names.CreateAddress(
+            Builder, Builder.CreateLoad(Builder.getInt32Ty(),
+                                        Builder.CreateInBoundsGEP(
+                                            Builder.getInt32Ty(),
+                                            NameOffsetsVar, I)));
+        Value *Hist = Builder.CreateInBoundsGEP(
+            RT.Histograms->getValueType(), RT.Histograms,
+            {Builder.getInt64(0), I});
+        Builder.CreateCall(RT.Print, {Name, Hist});
+      });
+  Builder.CreateRetVoid();
+  appendToGlobalDtors(M, ReportF, /*Priority=*/0);
+
+  return true;
+}
+
+bool InjectFuncCallRet::injectStacks(Module &M) {
+  // Functions to instrument. The position in this vector is the function's ID.
+  SmallVector<Function *, 16> Funcs;
+  InstrumentationFilter Filter(Opts.Filter);
+  for (auto &F : M)
+    if (Filter.shouldInstrument(F))
+      Funcs.push_back(&F);
+
+  if (Funcs.empty())
+    return false;
+
+  // The runtime functions are not in Funcs, so they don't appear in the stacks
+  StacksRuntime RT = CreateStacksRuntime(M, Opts.StackNodes);
+
+  // STEP 1: Push every function on entry and pop it on exit
+  // -------------------------------------------------------
+  NameTable Names(M);
+  SmallVector<uint32_t, 16> NameOffsets;
+  for (auto [ID, F] : enumerate(Funcs)) {
+    NameOffsets.push_back(Names.add(F->getName()));
+
+    // Functions that never exit are pushed too, so that their callees get the
+    // right context
+    IRBuilder<> EntryBuilder(&*F->getEntryBlock().getFirstInsertionPt());
+    Value *SavedDepth = EntryBuilder.CreateCall(
+        RT.Enter, {EntryBuilder.getInt32(ID)}, "saved_depth");
+    unsigned NumExitPoints =
+        instrumentExitPoints(*F, [&](IRBuilder<> &ExitBuilder) {
+          ExitBuilder.CreateCall(RT.Exit, {SavedDepth});
+        });
+
+    LLVM_DEBUG(dbgs() << " Tracking the stack of " << F->getName() << " (ID "
+                      << ID << ", " << NumExitPoints << " exit points)\n");
+    (void)NumExitPoints;
+  }
+  Names.finalize();
+
+  // STEP 2: Write the collapsed stacks when the module exits
+  // --------------------------------------------------------
+  Constant *NameOffsetsInit =
+      ConstantDataArray::get(M.getContext(), NameOffsets);
+  auto *NameOffsetsVar = new GlobalVariable(
+      M, NameOffsetsInit->getType(), /*isConstant=*/true,
+      GlobalValue::PrivateLinkage, NameOffsetsInit, "FuncStackNameOffsets");
+  appendToGlobalDtors(M, CreateStacksReport(M, RT, Names, NameOffsetsVar),
+                      /*Priority=*/0);
+
+  return true;
+}
+
+bool InjectFuncCallRet::injectPrintf(Module &M) {
   bool InsertedAtLeastOnePrintf = false;
 
+  // Functions to instrument, selected before any code is injected
+  SmallVector<Function *, 16> Funcs;
+  InstrumentationFilter Filter(Opts.Filter);
+  for (auto &F : M)
+    if (Filter.shouldInstrument(F))
+      Funcs.push_back(&F);
+
   auto &CTX = M.getContext();
   PointerType *PrintfArgTy = PointerType::getUnqual(CTX);
 
@@ -69,42 +1153,43 @@ bool InjectFuncCallRet::runOnModule(Module &M) {
 
 
   // STEP 2: Inject a global variable that will hold the printf format string
+  // and add the function names to the name table
   // ------------------------------------------------------------------------
+  // The format string is private, so that it doesn't clash with the globals
+  // injected by other passes (e.g. InjectFuncCall).
   llvm::Constant *PrintfFormatStr = llvm::ConstantDataArray::getString(
       CTX, "(llvm-tutor) Hello from: %s\n(llvm-tutor)   number of arguments: %d\n");
 
-  Constant *PrintfFormatStrVar =
-      M.getOrInsertGlobal("PrintfFormatStr", PrintfFormatStr->getType());
-  dyn_cast<GlobalVariable>(PrintfFormatStrVar)->setInitializer(PrintfFormatStr);
+  Constant *PrintfFormatStrVar = new GlobalVariable(
+      M, PrintfFormatStr->getType(), /*isConstant=*/true,
+      GlobalValue::PrivateLinkage, PrintfFormatStr, "PrintfFormatStr");
+
+  // Every function name is stored once in the name table (see NameTable.h),
+  // no matter how many returns the function has
+  NameTable Names(M);
+  for (Function *F : Funcs)
+    Names.add(F->getName());
+  Names.finalize();
 
   // STEP 3: For each function in the module, inject a call to printf
   // ----------------------------------------------------------------
-  for (auto &F : M) {
-    if (F.isDeclaration())
-      continue;
-    for (auto &BB : F) {
-      for (auto &Inst : BB)
-      {
-        if(isa<ReturnInst>(Inst))
-        {
-          Instruction *RetInst  = dyn_cast<ReturnInst>(&Inst);
-          
-          IRBuilder<> Builder(RetInst);
+  // The calls are injected before every exit point - not only `ret`, but also
+  // exits through exceptions, longjmp etc. (see instrumentExitPoints)
+  for (Function *F : Funcs) {
 
-          auto FuncName = Builder.CreateGlobalString(F.getName());
+    unsigned NumExitPoints =
+        instrumentExitPoints(*F, [&](IRBuilder<> &Builder) {
+          Constant *FuncName = Names.getAddress(F->getName());
 
           llvm::Value *FormatStrPtr =
           Builder.CreatePointerCast(PrintfFormatStrVar, PrintfArgTy, "formatStr");
 
           Builder.CreateCall(
-            Printf, {FormatStrPtr, FuncName, Builder.getInt32(F.arg_size())});
-
-          InsertedAtLeastOnePrintf = true;
-
-        }
-      }
-    }
+            Printf, {FormatStrPtr, FuncName, Builder.getInt32(F->arg_size())});
+        });
 
+    if (NumExitPoints)
+      InsertedAtLeastOnePrintf = true;
   }
 
   return InsertedAtLeastOnePrintf;
@@ -122,17 +1207,76 @@ PreservedAnalyses InjectFuncCallRet::run(llvm::Module &M,
 //-----------------------------------------------------------------------------
 // New PM Registration
 //-----------------------------------------------------------------------------
+// Parses the parameters of `inject-func-call-ret<...>`, e.g.
+// `inject-func-call-ret<stacks;stack-nodes=4096>`. Parameters are separated
+// with `;`.
+static Expected<InjectFuncCallRetOptions>
+parseInjectFuncCallRetOptions(StringRef Params) {
+  InjectFuncCallRetOptions Opts;
+  bool StackNodesSet = false;
+  while (!Params.empty()) {
+    StringRef ParamName;
+    std::tie(ParamName, Params) = Params.split(';');
+
+    Expected<bool> IsFilterParam = parseInstrumentationFilterParam(
+        ParamName, "inject-func-call-ret", Opts.Filter);
+    if (!IsFilterParam)
+      return IsFilterParam.takeError();
+    if (*IsFilterParam)
+      continue;
+
+    if (ParamName == "timing") {
+      Opts.Timing = true;
+    } else if (ParamName == "stacks") {
+      Opts.Stacks = true;
+    } else if (ParamName.consume_front("stack-nodes=")) {
+      if (ParamName.getAsInteger(0, Opts.StackNodes) ||
+          !isPowerOf2_32(Opts.StackNodes) || Opts.StackNodes > (1u << 24))
+        return make_error<StringError>(
+            "inject-func-call-ret stack-nodes must be a power of 2 (at most "
+            "2^24), got '" +
+                ParamName + "'",
+            inconvertibleErrorCode());
+      StackNodesSet = true;
+    } else {
+      return make_error<StringError>(
+          "invalid inject-func-call-ret pass parameter '" + ParamName + "'",
+          inconvertibleErrorCode());
+    }
+  }
+
+  if (Opts.Timing && Opts.Stacks)
+    return make_error<StringError>(
+        "inject-func-call-ret: 'timing' cannot be combined with 'stacks'",
+        inconvertibleErrorCode());
+
+  if (StackNodesSet && !Opts.Stacks)
+    return make_error<StringError>(
+        "inject-func-call-ret: 'stack-nodes' requires 'stacks'",
+        inconvertibleErrorCode());
+
+  return Opts;
+}
+
 llvm::PassPluginLibraryInfo getInjectFuncCallRetPluginInfo() {
   return {LLVM_PLUGIN_API_VERSION, "inject-func-call", LLVM_VERSION_STRING,
           [](PassBuilder &PB) {
             PB.registerPipelineParsingCallback(
                 [](StringRef Name, ModulePassManager &MPM,
                    ArrayRef<PassBuilder::PipelineElement>) {
-                  if (Name == "inject-func-call-ret") {
-                    MPM.addPass(InjectFuncCallRet());
-                    return true;
+                  if (!PassBuilder::checkParametrizedPassName(
+                          Name, "inject-func-call-ret"))
+                    return false;
+
+                  auto Opts = PassBuilder::parsePassParameters(
+                      parseInjectFuncCallRetOptions, Name,
+                      "inject-func-call-ret");
+                  if (!Opts) {
+                    errs() << toString(Opts.takeError()) << "\n";
+                    return false;
                   }
-                  return false;
+                  MPM.addPass(InjectFuncCallRet(*Opts));
+                  return true;
                 });
           }};
 }
@@ -0,0 +1,154 @@
+//========================================================================
+// FILE:
+//    InstrumentationFilter.cpp
+//
+// DESCRIPTION:
+//    Implements InstrumentationFilter, see InstrumentationFilter.h. This file
+//    is compiled into every plugin that uses it.
+//
+// License: MIT
+//========================================================================
+#include "InstrumentationFilter.h"
+
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/Twine.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/LineIterator.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+using namespace llvm;
+
+#define DEBUG_TYPE "instrumentation-filter"
+
+//-----------------------------------------------------------------------------
+// Parsing
+//-----------------------------------------------------------------------------
+// Reads the filter file, FileName, into Opts
+static Error readFilterFile(StringRef FileName, StringRef PassName,
+                            InstrumentationFilterOptions &Opts) {
+  auto BufferOrErr = MemoryBuffer::getFile(FileName, /*IsText=*/true);
+  if (!BufferOrErr)
+    return make_error<StringError>(
+        PassName + ": cannot read filter file '" + FileName +
+            "': " + BufferOrErr.getError().message(),
+        inconvertibleErrorCode());
+
+  for (line_iterator Line(**BufferOrErr, /*SkipBlanks=*/true,
+                          /*CommentMarker=*/'#');
+       !Line.is_at_eof(); ++Line) {
+    auto Invalid = [&](const Twine &Msg) {
+      return make_error<StringError>(PassName + ": " + FileName + ":" +
+                                         Twine(Line.line_number()) + ": " +
+                                         Msg,
+                                     inconvertibleErrorCode());
+    };
+
+    StringRef Kind, Pattern;
+    std::tie(Kind, Pattern) = Line->trim().split(':');
+    if (Pattern.empty())
+      return Invalid("expected '<kind>:<pattern>', got '" + *Line + "'");
+
+    if (Kind == "allow" || Kind == "deny") {
+      if (auto Glob = GlobPattern::create(Pattern); !Glob)
+        return Invalid("invalid glob '" + Pattern +
+                       "': " + toString(Glob.takeError()));
+      (Kind == "allow" ? Opts.AllowGlobs : Opts.DenyGlobs)
+          .push_back(Pattern.str());
+    } else if (Kind == "allow-regex" || Kind == "deny-regex") {
+      std::string RegexError;
+      if (!Regex(Pattern).isValid(RegexError))
+        return Invalid("invalid regex '" + Pattern + "': " + RegexError);
+      (Kind == "allow-regex" ? Opts.AllowRegexes : Opts.DenyRegexes)
+          .push_back(Pattern.str());
+    } else {
+      return Invalid("unknown pattern kind '" + Kind +
+                     "' (expected allow, deny, allow-regex or deny-regex)");
+    }
+  }
+
+  return Error::success();
+}
+
+Expected<bool> parseInstrumentationFilterParam(
+    StringRef Param, StringRef PassName, InstrumentationFilterOptions &Opts) {
+  if (Param.consume_front("filter=")) {
+    if (Error Err = readFilterFile(Param, PassName, Opts))
+      return std::move(Err);
+    return true;
+  }
+
+  if (Param.consume_front("min-insts=")) {
+    if (Param.getAsInteger(0, Opts.MinInstructions))
+      return make_error<StringError>(
+          "invalid " + PassName + " min-insts '" + Param + "'",
+          inconvertibleErrorCode());
+    return true;
+  }
+
+  if (Param.consume_front("min-entry-count=")) {
+    if (Param.getAsInteger(0, Opts.MinEntryCount))
+      return make_error<StringError>(
+          "invalid " + PassName + " min-entry-count '" + Param + "'",
+          inconvertibleErrorCode());
+    return true;
+  }
+
+  return false;
+}
+
+//-----------------------------------------------------------------------------
+// InstrumentationFilter
+//-----------------------------------------------------------------------------
+InstrumentationFilter::InstrumentationFilter(
+    const InstrumentationFilterOptions &Opts)
+    : MinInstructions(Opts.MinInstructions),
+      MinEntryCount(Opts.MinEntryCount) {
+  // The patterns have been validated by parseInstrumentationFilterParam
+  for (const std::string &Pattern : Opts.AllowGlobs)
+    AllowGlobs.push_back(cantFail(GlobPattern::create(Pattern)));
+  for (const std::string &Pattern : Opts.DenyGlobs)
+    DenyGlobs.push_back(cantFail(GlobPattern::create(Pattern)));
+  for (const std::string &Pattern : Opts.AllowRegexes)
+    AllowRegexes.emplace_back(Pattern);
+  for (const std::string &Pattern : Opts.DenyRegexes)
+    DenyRegexes.emplace_back(Pattern);
+}
+
+bool InstrumentationFilter::matchesNamePatterns(StringRef Name) const {
+  auto MatchesGlob = [Name](const GlobPattern &P) { return P.match(Name); };
+  auto MatchesRegex = [Name](const Regex &R) { return R.match(Name); };
+
+  if (any_of(DenyGlobs, MatchesGlob) || any_of(DenyRegexes, MatchesRegex))
+    return false;
+
+  if (AllowGlobs.empty() && AllowRegexes.empty())
+    return true;
+  return any_of(AllowGlobs, MatchesGlob) || any_of(AllowRegexes, MatchesRegex);
+}
+
+bool InstrumentationFilter::shouldInstrument(const Function &F) const {
+  if (F.isDeclaration())
+    return false;
+
+  if (!matchesNamePatterns(F.getName())) {
+    LLVM_DEBUG(dbgs() << " Skipping " << F.getName() << " (filtered out)\n");
+    return false;
+  }
+
+  if (MinEntryCount) {
+    auto EntryCount = F.getEntryCount();
+    if (EntryCount && EntryCount->getCount() < MinEntryCount) {
+      LLVM_DEBUG(dbgs() << " Skipping " << F.getName() << " (entry count "
+                        << EntryCount->getCount() << ")\n");
+      return false;
+    }
+  }
+
+  // Last, as getInstructionCount walks the whole function
+  if (MinInstructions && F.getInstructionCount() < MinInstructions) {
+    LLVM_DEBUG(dbgs() << " Skipping " << F.getName() << " (too small)\n");
+    return false;
+  }
+
+  return true;
+}
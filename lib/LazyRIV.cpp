@@ -0,0 +1,161 @@
+//=============================================================================
+// FILE:
+//    LazyRIV.cpp
+//
+// DESCRIPTION:
+//    Implements LazyRIV, see LazyRIV.h. This file is compiled into the RIV
+//    plugin.
+//
+// ALGORITHM:
+//    -------------------------------------------------------------------------
+//    v_N = the integer values defined in BB_N
+//    E = the integer globals and arguments
+//    IDom(N) = the immediate dominator of BB_N
+//    |RIV_N| = |E|                          if BB_N is the entry block
+//            = |RIV_IDom(N)| + |v_IDom(N)|  otherwise
+//    -------------------------------------------------------------------------
+//    isReachable(BB_N, V):
+//      V is in E, or V is defined in a block that strictly dominates BB_N
+//    -------------------------------------------------------------------------
+//    getReachable(BB_N, K):
+//      K < |E|: the K-th value of E
+//      Otherwise, v_M occupies the indices [|RIV_M|, |RIV_M| + |v_M|) in
+//      RIV_N for every BB_M that strictly dominates BB_N. Walk up from
+//      IDom(N) until |RIV_M| <= K.
+//    -------------------------------------------------------------------------
+//    forgetBlock(BB_N):
+//      |RIV_M| only depends on the dominators of BB_M, so only the counts in
+//      the subtree of BB_N (and v_N) can become stale. The counts are always
+//      memoized for whole paths from the root, so the walk over the subtree
+//      stops at blocks without a count.
+//    -------------------------------------------------------------------------
+//
+// License: MIT
+//=============================================================================
+#include "LazyRIV.h"
+
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/IR/Module.h"
+
+using namespace llvm;
+
+//-----------------------------------------------------------------------------
+// LazyRIVResult
+//-----------------------------------------------------------------------------
+ArrayRef<Value *> LazyRIVResult::getEntryValues() {
+  if (!EntryValues) {
+    EntryValues.emplace();
+    for (GlobalVariable &Global : F.getParent()->globals())
+      if (Global.getValueType()->isIntegerTy())
+        EntryValues->push_back(&Global);
+
+    for (Argument &Arg : F.args())
+      if (Arg.getType()->isIntegerTy())
+        EntryValues->push_back(&Arg);
+  }
+  return *EntryValues;
+}
+
+ArrayRef<Value *> LazyRIVResult::getDefs(const BasicBlock *BB) {
+  auto [It, Inserted] = Defs.try_emplace(BB);
+  if (Inserted)
+    for (const Instruction &Inst : *BB)
+      if (Inst.getType()->isIntegerTy())
+        It->second.push_back(const_cast<Instruction *>(&Inst));
+  return It->second;
+}
+
+bool LazyRIVResult::isReachable(const BasicBlock *BB, const Value *V) const {
+  if (!DT.isReachableFromEntry(BB))
+    return false;
+
+  if (auto *Arg = dyn_cast<Argument>(V))
+    return Arg->getParent() == &F && Arg->getType()->isIntegerTy();
+
+  if (auto *Global = dyn_cast<GlobalVariable>(V))
+    return Global->getParent() == F.getParent() &&
+           Global->getValueType()->isIntegerTy();
+
+  if (auto *Inst = dyn_cast<Instruction>(V))
+    return Inst->getType()->isIntegerTy() && Inst->getParent() != BB &&
+           DT.dominates(Inst->getParent(), BB);
+
+  return false;
+}
+
+size_t LazyRIVResult::getNumReachable(const BasicBlock *BB) {
+  const DomTreeNode *Node = DT.getNode(BB);
+  if (!Node)
+    return 0;
+
+  // Walk up to the closest dominator whose count is known ...
+  SmallVector<const DomTreeNode *, 16> Path;
+  for (const DomTreeNode *N = Node; N && !NumReachable.count(N->getBlock());
+       N = N->getIDom())
+    Path.push_back(N);
+
+  // ... and compute the counts on the way back down
+  for (const DomTreeNode *N : reverse(Path)) {
+    const DomTreeNode *IDom = N->getIDom();
+    size_t Count = IDom ? NumReachable.lookup(IDom->getBlock()) +
+                              getDefs(IDom->getBlock()).size()
+                        : getEntryValues().size();
+    NumReachable[N->getBlock()] = Count;
+  }
+
+  return NumReachable.lookup(BB);
+}
+
+Value *LazyRIVResult::getReachable(const BasicBlock *BB, size_t K) {
+  // This also memoizes the counts of all the dominators of BB
+  size_t Count = getNumReachable(BB);
+  assert(K < Count && "Index out of range");
+  (void)Count;
+
+  ArrayRef<Value *> EntryBBValues = getEntryValues();
+  if (K < EntryBBValues.size())
+    return EntryBBValues[K];
+
+  for (const DomTreeNode *N = DT.getNode(BB)->getIDom();;
+       N = N->getIDom()) {
+    size_t Offset = NumReachable.lookup(N->getBlock());
+    if (K >= Offset)
+      return getDefs(N->getBlock())[K - Offset];
+  }
+}
+
+void LazyRIVResult::forgetBlock(const BasicBlock *BB) {
+  Defs.erase(BB);
+
+  const DomTreeNode *Node = DT.getNode(BB);
+  if (!Node)
+    return;
+
+  SmallVector<const DomTreeNode *, 16> Worklist;
+  Worklist.push_back(Node);
+  while (!Worklist.empty()) {
+    const DomTreeNode *N = Worklist.pop_back_val();
+    if (!NumReachable.erase(N->getBlock()))
+      continue;
+    Worklist.append(N->begin(), N->end());
+  }
+}
+
+bool LazyRIVResult::invalidate(Function &F, const PreservedAnalyses &PA,
+                               FunctionAnalysisManager::Invalidator &Inv) {
+  auto PAC = PA.getChecker<LazyRIV>();
+  return !(PAC.preserved() || PAC.preservedSet<AllAnalysesOn<Function>>()) ||
+         Inv.invalidate<DominatorTreeAnalysis>(F, PA);
+}
+
+//-----------------------------------------------------------------------------
+// LazyRIV Implementation
+//-----------------------------------------------------------------------------
+LazyRIV::Result LazyRIV::run(Function &F, FunctionAnalysisManager &FAM) {
+  return LazyRIVResult(F, FAM.getResult<DominatorTreeAnalysis>(F));
+}
+
+//-----------------------------------------------------------------------------
+// New PM Registration (see getRIVPluginInfo in RIV.cpp)
+//-----------------------------------------------------------------------------
+AnalysisKey LazyRIV::Key;
@@ -0,0 +1,302 @@
+//==============================================================================
+// FILE:
+//    MBA.cpp
+//
+// DESCRIPTION:
+//    Obfuscates integer add and sub instructions through Mixed Boolean
+//    Arithmetic (MBA) using the default rules of the MBA engine (see
+//    MBARules.h):
+//      a + b == (((a ^ b) + 2 * (a & b)) * A + B) * C + D   (i8 to i64)
+//      a - b == (a + ~b) + 1                                 (any width)
+//    A and B are different for every width and C and D are computed from
+//    them at compile time. Vectors of integers (fixed and scalable) are
+//    rewritten too, with splatted constants. Every instruction is matched
+//    against all the rules at once, so the function is only traversed once.
+//
+//    Every rewrite grows one instruction into up to 8. To keep hot code fast,
+//    the pass accepts limits (see MBAOptions in MBA.h):
+//      * budget=<N>, module-budget=<N> - the maximum code growth (TTI code
+//        size) per function and per module,
+//      * max-trip-count=<N> - skip code that runs more than N times per call,
+//      * max-hotness=<X> - skip blocks X times more frequent than the entry,
+//      * max-slowdown=<X> - keep every innermost loop within X times its
+//        original cost (TTI reciprocal throughput) per iteration.
+//    With a budget, instructions in cold blocks are rewritten first.
+//
+// USAGE:
+//      $ opt -load-pass-plugin <BUILD_DIR>/lib/libMBA.so `\`
+//        -passes=-"mba" <bitcode-file>
+//      $ opt -load-pass-plugin <BUILD_DIR>/lib/libMBA.so `\`
+//        -passes=-"mba<budget=200;max-slowdown=1.5>" <bitcode-file>
+//
+// License: MIT
+//==============================================================================
+#include "MBA.h"
+#include "MBARules.h"
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace llvm;
+
+#define DEBUG_TYPE "mba"
+
+STATISTIC(SubstCount, "The # of substituted instructions");
+STATISTIC(SkippedCount, "The # of instructions skipped due to the limits");
+
+//-----------------------------------------------------------------------------
+// MBA Implementation
+//-----------------------------------------------------------------------------
+bool MBA::isCandidate(const Instruction &Inst) {
+  return findMBARule(getDefaultMBARules(), Inst);
+}
+
+Value *MBA::emitReplacement(IRBuilderBase &Builder, BinaryOperator &BinOp,
+                            MBAConstantFn GetConstant) {
+  const MBARule *Rule = findMBARule(getDefaultMBARules(), BinOp);
+  assert(Rule && "Not an MBA candidate");
+  return emitMBARule(Builder, BinOp, *Rule, GetConstant);
+}
+
+bool MBA::runOnBasicBlock(BasicBlock &BB) {
+  bool Changed = false;
+
+  // Replacing instructions erases them, hence the early-increment range. The
+  // new instructions are inserted before the current one and are not visited.
+  for (Instruction &Inst : make_early_inc_range(BB)) {
+    const MBARule *Rule = findMBARule(getDefaultMBARules(), Inst);
+    if (!Rule)
+      continue;
+    auto *BinOp = cast<BinaryOperator>(&Inst);
+
+    IRBuilder<> Builder(BinOp);
+    Value *NewValue = emitMBARule(Builder, *BinOp, *Rule, getMBAConstant);
+
+    // The following is visible only if you pass -debug on the command line
+    // *and* you have an assert build.
+    LLVM_DEBUG(dbgs() << *BinOp << " -> " << *NewValue << "\n");
+
+    replaceWithMBA(*BinOp, NewValue);
+    Changed = true;
+
+    // Update the statistics
+    ++SubstCount;
+  }
+  return Changed;
+}
+
+// Returns the number of times BB runs per call of its function, based on the
+// maximum trip counts of the enclosing loops. Returns UINT64_MAX if any of
+// them is unknown.
+static uint64_t getMaxExecutionCount(const BasicBlock &BB, const LoopInfo &LI,
+                                     ScalarEvolution &SE) {
+  uint64_t Count = 1;
+  for (Loop *L = LI.getLoopFor(&BB); L; L = L->getParentLoop()) {
+    uint64_t TripCount = SE.getSmallConstantMaxTripCount(L);
+    if (!TripCount || Count > UINT64_MAX / TripCount)
+      return UINT64_MAX;
+    Count *= TripCount;
+  }
+  return Count;
+}
+
+// Returns the cost of one iteration of L (i.e. of all its blocks)
+static InstructionCost getLoopCost(const Loop &L,
+                                   const TargetTransformInfo &TTI) {
+  InstructionCost Cost = 0;
+  for (const BasicBlock *BB : L.blocks())
+    for (const Instruction &Inst : *BB)
+      Cost += TTI.getInstructionCost(&Inst,
+                                     TargetTransformInfo::TCK_RecipThroughput);
+  return Cost;
+}
+
+bool MBA::runWithLimits(Function &F, FunctionAnalysisManager &FAM) {
+  auto &TTI = FAM.getResult<TargetIRAnalysis>(F);
+  auto &LI = FAM.getResult<LoopAnalysis>(F);
+  auto &BFI = FAM.getResult<BlockFrequencyAnalysis>(F);
+  ScalarEvolution *SE = Opts.MaxTripCount
+                            ? &FAM.getResult<ScalarEvolutionAnalysis>(F)
+                            : nullptr;
+
+  struct Candidate {
+    BinaryOperator *BinOp;
+    const MBARule *Rule;
+    double Hotness;
+  };
+
+  // STEP 1: Collect the candidates outside the loops and blocks that are too
+  // hot
+  std::vector<Candidate> Candidates;
+  for (BasicBlock &BB : F) {
+    double Hotness = BFI.getBlockFreqRelativeToEntryBlock(&BB);
+    bool TooHot =
+        (Opts.MaxHotness && Hotness > Opts.MaxHotness) ||
+        (SE && getMaxExecutionCount(BB, LI, *SE) > Opts.MaxTripCount);
+
+    for (Instruction &Inst : BB) {
+      const MBARule *Rule = findMBARule(getDefaultMBARules(), Inst);
+      if (!Rule)
+        continue;
+      if (TooHot) {
+        ++SkippedCount;
+        continue;
+      }
+      Candidates.push_back({cast<BinaryOperator>(&Inst), Rule, Hotness});
+    }
+  }
+
+  // STEP 2: Rewrite cold code first, so that the budget is spent where it
+  // costs the least. The order of the new instructions in F doesn't depend
+  // on this.
+  std::stable_sort(Candidates.begin(), Candidates.end(),
+                   [](const Candidate &A, const Candidate &B) {
+                     return A.Hotness < B.Hotness;
+                   });
+
+  // STEP 3: The cost of the innermost loops before any rewrites
+  DenseMap<const Loop *, InstructionCost> LoopCost, LoopGrowth;
+  if (Opts.MaxSlowdown)
+    for (const Candidate &C : Candidates)
+      if (const Loop *L = LI.getLoopFor(C.BinOp->getParent()))
+        if (!LoopCost.count(L))
+          LoopCost[L] = getLoopCost(*L, TTI);
+  // The slowdown in per mille, to stay in integer arithmetic
+  auto MaxSlowdown =
+      static_cast<int64_t>(std::lround(Opts.MaxSlowdown * 1000));
+
+  // STEP 4: Rewrite the candidates that fit into the limits
+  bool Changed = false;
+  InstructionCost FuncGrowth = 0;
+  for (const Candidate &C : Candidates) {
+    Type *Ty = C.BinOp->getType();
+    InstructionCost SizeDelta = getMBARuleCostDelta(
+        *C.Rule, Ty, TTI, TargetTransformInfo::TCK_CodeSize);
+    InstructionCost SpeedDelta = getMBARuleCostDelta(
+        *C.Rule, Ty, TTI, TargetTransformInfo::TCK_RecipThroughput);
+    const Loop *L = LI.getLoopFor(C.BinOp->getParent());
+
+    bool FitsBudget =
+        SizeDelta.isValid() &&
+        (!Opts.Budget ||
+         FuncGrowth + SizeDelta <= InstructionCost(Opts.Budget)) &&
+        (!Opts.ModuleBudget ||
+         *ModuleGrowth + SizeDelta <= InstructionCost(Opts.ModuleBudget));
+    bool FitsSlowdown =
+        !MaxSlowdown || !L ||
+        (SpeedDelta.isValid() && (LoopGrowth[L] + SpeedDelta) * 1000 <=
+                                     LoopCost[L] * (MaxSlowdown - 1000));
+    if (!FitsBudget || !FitsSlowdown) {
+      LLVM_DEBUG(dbgs() << "Skipping (over budget) " << *C.BinOp << "\n");
+      ++SkippedCount;
+      continue;
+    }
+
+    IRBuilder<> Builder(C.BinOp);
+    Value *NewValue = emitMBARule(Builder, *C.BinOp, *C.Rule, getMBAConstant);
+    LLVM_DEBUG(dbgs() << *C.BinOp << " -> " << *NewValue << "\n");
+    replaceWithMBA(*C.BinOp, NewValue);
+
+    FuncGrowth += SizeDelta;
+    *ModuleGrowth += SizeDelta;
+    if (L)
+      LoopGrowth[L] += SpeedDelta;
+    Changed = true;
+    ++SubstCount;
+  }
+
+  return Changed;
+}
+
+PreservedAnalyses MBA::run(llvm::Function &F,
+                           llvm::FunctionAnalysisManager &FAM) {
+  if (Opts.hasLimits()) {
+    bool Changed = runWithLimits(F, FAM);
+    return (Changed ? llvm::PreservedAnalyses::none()
+                    : llvm::PreservedAnalyses::all());
+  }
+
+  bool Changed = false;
+
+  for (auto &BB : F) {
+    Changed |= runOnBasicBlock(BB);
+  }
+  return (Changed ? llvm::PreservedAnalyses::none()
+                  : llvm::PreservedAnalyses::all());
+}
+
+//-----------------------------------------------------------------------------
+// New PM Registration
+//-----------------------------------------------------------------------------
+// Parses the parameters of `mba<...>`, e.g. `mba<budget=200;max-slowdown=1.5>`.
+// Parameters are separated with `;`.
+static Expected<MBAOptions> parseMBAOptions(StringRef Params) {
+  MBAOptions Opts;
+  while (!Params.empty()) {
+    StringRef ParamName;
+    std::tie(ParamName, Params) = Params.split(';');
+
+    auto Invalid = [&](StringRef Name, StringRef Expected) {
+      return make_error<StringError>("mba " + Name + " must be " + Expected +
+                                         ", got '" + ParamName + "'",
+                                     inconvertibleErrorCode());
+    };
+
+    if (ParamName.consume_front("budget=")) {
+      if (ParamName.getAsInteger(0, Opts.Budget))
+        return Invalid("budget", "an integer");
+    } else if (ParamName.consume_front("module-budget=")) {
+      if (ParamName.getAsInteger(0, Opts.ModuleBudget))
+        return Invalid("module-budget", "an integer");
+    } else if (ParamName.consume_front("max-trip-count=")) {
+      if (ParamName.getAsInteger(0, Opts.MaxTripCount))
+        return Invalid("max-trip-count", "an integer");
+    } else if (ParamName.consume_front("max-hotness=")) {
+      if (ParamName.getAsDouble(Opts.MaxHotness) || Opts.MaxHotness <= 0)
+        return Invalid("max-hotness", "a positive number");
+    } else if (ParamName.consume_front("max-slowdown=")) {
+      if (ParamName.getAsDouble(Opts.MaxSlowdown) || Opts.MaxSlowdown < 1)
+        return Invalid("max-slowdown", "a number >= 1");
+    } else {
+      return make_error<StringError>("invalid mba pass parameter '" +
+                                         ParamName + "'",
+                                     inconvertibleErrorCode());
+    }
+  }
+  return Opts;
+}
+
+llvm::PassPluginLibraryInfo getMBAPluginInfo() {
+  return {LLVM_PLUGIN_API_VERSION, "mba", LLVM_VERSION_STRING,
+          [](PassBuilder &PB) {
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, FunctionPassManager &FPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+                  if (!PassBuilder::checkParametrizedPassName(Name, "mba"))
+                    return false;
+
+                  auto Opts = PassBuilder::parsePassParameters(
+                      parseMBAOptions, Name, "mba");
+                  if (!Opts) {
+                    errs() << toString(Opts.takeError()) << "\n";
+                    return false;
+                  }
+                  FPM.addPass(MBA(*Opts));
+                  return true;
+                });
+          }};
+}
+
+extern "C" LLVM_ATTRIBUTE_WEAK ::llvm::PassPluginLibraryInfo
+llvmGetPassPluginInfo() {
+  return getMBAPluginInfo();
+}
@@ -4,9 +4,11 @@
 //
 // DESCRIPTION:
 //    This pass performs a substitution for 8-bit integer add
-//    instruction based on this Mixed Boolean-Airthmetic expression:
+//    instruction (scalar or vector, e.g. <16 x i8>) based on this Mixed
+//    Boolean-Airthmetic expression:
 //      a + b == (((a ^ b) + 2 * (a & b)) * 39 + 23) * 151 + 111
-//    See formula (3) in [1].
+//    See formula (3) in [1]. The expression is emitted by the MBA engine
+//    (MBARules.h); the `mba` pass applies the same formula to other widths.
 //
 // USAGE:
 //      $ opt -load-pass-plugin <BUILD_DIR>/lib/libMBAAdd.so `\`
@@ -20,6 +22,7 @@
 // License: MIT
 //==============================================================================
 #include "MBAAdd.h"
+#include "MBARules.h"
 
 #include "llvm/ADT/Statistic.h"
 #include "llvm/IR/IRBuilder.h"
@@ -37,82 +40,53 @@ STATISTIC(SubstCount, "The # of substituted instructions");
 //-----------------------------------------------------------------------------
 // MBAAdd Implementation
 //-----------------------------------------------------------------------------
+// a + b == (((a ^ b) + 2 * (a & b)) * 39 + 23) * 151 + 111, for 8-bit
+// integers (and vectors of those) only (the constants are computed by
+// makeMBAAffineMask)
+static constexpr MBARule MBAAddRule = {Instruction::Add, 8,
+                                       MBAIdentity::AddViaXorAnd,
+                                       makeMBAAffineMask(39, 23, 8)};
+static_assert(MBAAddRule.Mask.C == 151 && MBAAddRule.Mask.D == 111,
+              "Unexpected MBAAdd constants");
+
+bool MBAAdd::isCandidate(const Instruction &Inst) {
+  //call BB.dump()
+  //  %3 = add i8 %1, %0
+  //ret i8 %3
+  //HANDLE_BINARY_INST(13, Add  , BinaryOperator)
+  // Skip everything apart from 8-bit integer (or <N x i8>) add
+  return findMBARule(MBAAddRule, Inst);
+}
+
+Value *MBAAdd::emitReplacement(IRBuilderBase &Builder, BinaryOperator &BinOp,
+                               MBAConstantFn GetConstant) {
+  // Build an instruction representing `(((a ^ b) + 2 * (a & b)) * 39 + 23) *
+  // 151 + 111`
+  return emitMBARule(Builder, BinOp, MBAAddRule, GetConstant);
+}
+
 bool MBAAdd::runOnBasicBlock(BasicBlock &BB) {
   bool Changed = false;
   
-  // Loop over all instructions in the block. Replacing instructions requires
-  // iterators, hence a for-range loop wouldn't be suitable
-  for (auto Inst = BB.begin(), IE = BB.end(); Inst != IE; ++Inst) {
-    //call BB.dump()
-    //  %3 = add i8 %1, %0
-    //ret i8 %3
-    // Skip non-binary (e.g. unary or compare) instructions
-    auto *BinOp = dyn_cast<BinaryOperator>(Inst);
-    //HANDLE_BINARY_INST(13, Add  , BinaryOperator)
-    //(gdb) p BinOp
-    //$1 = (llvm::BinaryOperator *) 0x5555555f1b20
-    if (!BinOp)
-      continue;
-
-    // Skip instructions other than add
-    if (BinOp->getOpcode() != Instruction::Add)
-      continue;
-
-    // Skip if the result is not 8-bit wide (this implies that the operands are
-    // also 8-bit wide)
-    if (!BinOp->getType()->isIntegerTy() ||
-        !(BinOp->getType()->getIntegerBitWidth() == 8))
+  // Loop over all instructions in the block. Replacing instructions erases
+  // them, hence the early-increment range
+  for (Instruction &Inst : make_early_inc_range(BB)) {
+    if (!isCandidate(Inst))
       continue;
+    auto *BinOp = cast<BinaryOperator>(&Inst);
 
     // A uniform API for creating instructions and inserting
     // them into basic blocks
     IRBuilder<> Builder(BinOp);
-
-    // Constants used in building the instruction for substitution
-    auto Val39 = ConstantInt::get(BinOp->getType(), 39);
-    auto Val151 = ConstantInt::get(BinOp->getType(), 151);
-    auto Val23 = ConstantInt::get(BinOp->getType(), 23);
-    auto Val2 = ConstantInt::get(BinOp->getType(), 2);
-    auto Val111 = ConstantInt::get(BinOp->getType(), 111);
-
-    // Build an instruction representing `(((a ^ b) + 2 * (a & b)) * 39 + 23) *
-    // 151 + 111`
-    Instruction *NewInst =
-        // E = e5 + 111
-        BinaryOperator::CreateAdd(
-            Val111,
-            // e5 = e4 * 151
-            Builder.CreateMul(
-                Val151,
-                // e4 = e2 + 23
-                Builder.CreateAdd(
-                    Val23,
-                    // e3 = e2 * 39
-                    Builder.CreateMul(
-                        Val39,
-                        // e2 = e0 + e1
-                        Builder.CreateAdd(
-                            // e0 = a ^ b
-                            Builder.CreateXor(BinOp->getOperand(0),
-                                              BinOp->getOperand(1)),//step 1
-                            // e1 = 2 * (a & b)
-                            Builder.CreateMul(
-                                Val2, Builder.CreateAnd(BinOp->getOperand(0),
-                                                        BinOp->getOperand(1)) //step 2
-                                                      )
-                                                      ) 
-                    ) // e3 = e2 * 39
-                ) // e4 = e2 + 23
-            ) // e5 = e4 * 151
-        ); // E = e5 + 111
+    Value *NewValue = emitReplacement(Builder, *BinOp, getMBAConstant);
 
     // The following is visible only if you pass -debug on the command line
     // *and* you have an assert build.
-    LLVM_DEBUG(dbgs() << *BinOp << " -> " << *NewInst << "\n");
+    LLVM_DEBUG(dbgs() << *BinOp << " -> " << *NewValue << "\n");
 
     // Replace `(a + b)` (original instructions) with `(((a ^ b) + 2 * (a & b))
     // * 39 + 23) * 151 + 111` (the new instruction)
-    ReplaceInstWithInst(&BB, Inst, NewInst);
+    replaceWithMBA(*BinOp, NewValue);
     Changed = true;
 
     // Update the statistics
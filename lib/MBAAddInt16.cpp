@@ -8,7 +8,8 @@
 //    This pass performs a substitution for 16-bit integer add
 //    instruction based on this Mixed Boolean-Airthmetic expression:
 //      a + b == (((a ^ b) + 2 * (a & b)) * 42601 + 49826) * 18905 + 53934
-//    You can generate these magic number by scripts/Int16MagicNumGen.py
+//    18905 and 53934 are derived from 42601 and 49826 at compile time, see
+//    makeMBAAffineMask in MBARules.h
 //
 // USAGE:
 //      $ opt -load-pass-plugin <BUILD_DIR>/lib/libMBAAddInt16.so `\`
@@ -22,6 +23,7 @@
 // License: MIT
 //==============================================================================
 #include "MBAAddInt16.h"
+#include "MBARules.h"
 
 #include "llvm/ADT/Statistic.h"
 #include "llvm/IR/IRBuilder.h"
@@ -37,64 +39,48 @@ using namespace llvm;
 STATISTIC(SubstCount, "The # of substituted instructions");
 
 
+// a + b == (((a ^ b) + 2 * (a & b)) * 42601 + 49826) * 18905 + 53934, for
+// 16-bit integers (and vectors of those) only (the constants are computed by
+// makeMBAAffineMask)
+static constexpr MBARule MBAAddInt16Rule = {
+    Instruction::Add, 16, MBAIdentity::AddViaXorAnd,
+    makeMBAAffineMask(42601, 49826, 16)};
+static_assert(MBAAddInt16Rule.Mask.C == 18905 &&
+                  MBAAddInt16Rule.Mask.D == 53934,
+              "Unexpected MBAAddInt16 constants");
+
+bool MBAAddInt16::isCandidate(const Instruction &Inst)
+{
+  // Skip instructions other than 16-bit add (the constants are only valid
+  // for 16 bits)
+  return findMBARule(MBAAddInt16Rule, Inst);
+}
+
+Value *MBAAddInt16::emitReplacement(IRBuilderBase &Builder,
+                                    BinaryOperator &BinOp,
+                                    MBAConstantFn GetConstant)
+{
+  return emitMBARule(Builder, BinOp, MBAAddInt16Rule, GetConstant);
+}
+
 bool MBAAddInt16::runOnBasicBlock(BasicBlock &BB)
 {
   bool Changed = false;
 
-  for(auto Inst=BB.begin(), IE=BB.end(); Inst!=IE ;++Inst)
+  for(Instruction &Inst : make_early_inc_range(BB))
   {
-      auto *BinOp = dyn_cast<BinaryOperator>(Inst);
-
-      if (!BinOp)
-      continue;
-
-    // Skip instructions other than add
-    if (BinOp->getOpcode() != Instruction::Add)
+    if (!isCandidate(Inst))
       continue;
+    auto *BinOp = cast<BinaryOperator>(&Inst);
 
     IRBuilder<> Builder(BinOp);
-
-    auto Val42601=ConstantInt::get(BinOp->getType(), 42601);
-    auto Val49826=ConstantInt::get(BinOp->getType(), 49826);
-    auto Val18905=ConstantInt::get(BinOp->getType(), 18905);
-    auto Val53934=ConstantInt::get(BinOp->getType(), 53934);
-    auto Val2=ConstantInt::get(BinOp->getType(), 2);
-
-
-        Instruction *NewInst =
-        // E = e5 + 111
-        BinaryOperator::CreateAdd(
-            Val53934,
-            // e5 = e4 * 151
-            Builder.CreateMul(
-                Val18905,
-                // e4 = e2 + 23
-                Builder.CreateAdd(
-                    Val49826,
-                    // e3 = e2 * 39
-                    Builder.CreateMul(
-                        Val42601,
-                        // e2 = e0 + e1
-                        Builder.CreateAdd(
-                            // e0 = a ^ b
-                            Builder.CreateXor(BinOp->getOperand(0),
-                                              BinOp->getOperand(1)),//step 1
-                            // e1 = 2 * (a & b)
-                            Builder.CreateMul(
-                                Val2, Builder.CreateAnd(BinOp->getOperand(0),
-                                                        BinOp->getOperand(1)) //step 2
-                                                      )
-                                                      ) 
-                    ) // e3 = e2 * 39
-                ) // e4 = e2 + 23
-            ) // e5 = e4 * 151
-        ); // E = e5 + 111
+    Value *NewValue = emitReplacement(Builder, *BinOp, getMBAConstant);
     
-  LLVM_DEBUG(dbgs() << *BinOp << " -> " << *NewInst << "\n");
+  LLVM_DEBUG(dbgs() << *BinOp << " -> " << *NewValue << "\n");
 
     // Replace `(a + b)` (original instructions) with `(((a ^ b) + 2 * (a & b))
-    // * 39 + 23) * 151 + 111` (the new instruction)
-    ReplaceInstWithInst(&BB, Inst, NewInst);
+    // * 42601 + 49826) * 18905 + 53934` (the new instruction)
+    replaceWithMBA(*BinOp, NewValue);
     Changed = true;
 
     // Update the statistics
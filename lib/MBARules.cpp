@@ -0,0 +1,132 @@
+//========================================================================
+// FILE:
+//    MBARules.cpp
+//
+// DESCRIPTION:
+//    Implements the table-driven MBA engine, see MBARules.h. This file is
+//    compiled into every plugin that uses it.
+//
+// License: MIT
+//========================================================================
+#include "MBARules.h"
+
+using namespace llvm;
+
+//-----------------------------------------------------------------------------
+// Default rules
+//-----------------------------------------------------------------------------
+// The multipliers (A) are arbitrary odd numbers and the addends (B) are
+// arbitrary. The 8 and 16 bit ones are the constants historically used by
+// MBAAdd and MBAAddInt16.
+static constexpr MBARule DefaultMBARules[] = {
+    {Instruction::Add, 8, MBAIdentity::AddViaXorAnd,
+     makeMBAAffineMask(39, 23, 8)},
+    {Instruction::Add, 16, MBAIdentity::AddViaXorAnd,
+     makeMBAAffineMask(42601, 49826, 16)},
+    {Instruction::Add, 32, MBAIdentity::AddViaXorAnd,
+     makeMBAAffineMask(0x9E3779B1, 0x7F4A7C15, 32)},
+    {Instruction::Add, 64, MBAIdentity::AddViaXorAnd,
+     makeMBAAffineMask(0x9E3779B97F4A7C15, 0xBF58476D1CE4E5B9, 64)},
+    {Instruction::Sub, 0, MBAIdentity::SubViaAddNot, MBANoAffineMask},
+};
+
+static_assert(areValidMBARules(DefaultMBARules),
+              "The default MBA rules are broken");
+static_assert(DefaultMBARules[0].Mask.C == 151 &&
+                  DefaultMBARules[0].Mask.D == 111,
+              "Unexpected 8-bit constants");
+static_assert(DefaultMBARules[1].Mask.C == 18905 &&
+                  DefaultMBARules[1].Mask.D == 53934,
+              "Unexpected 16-bit constants");
+
+ArrayRef<MBARule> getDefaultMBARules() { return DefaultMBARules; }
+
+//-----------------------------------------------------------------------------
+// Engine
+//-----------------------------------------------------------------------------
+const MBARule *findMBARule(ArrayRef<MBARule> Rules, const Instruction &Inst) {
+  // Skip non-binary (e.g. unary or compare) instructions. Integer vectors
+  // (fixed and scalable) are matched on their element width, the constants
+  // are splatted by the MBAConstantFn.
+  auto *BinOp = dyn_cast<BinaryOperator>(&Inst);
+  if (!BinOp || !BinOp->getType()->isIntOrIntVectorTy())
+    return nullptr;
+
+  unsigned BitWidth = BinOp->getType()->getScalarSizeInBits();
+  for (const MBARule &Rule : Rules)
+    if (BinOp->getOpcode() == Rule.Opcode &&
+        (!Rule.BitWidth || BitWidth == Rule.BitWidth))
+      return &Rule;
+
+  return nullptr;
+}
+
+// Emits the identity of Rule (without the affine mask)
+static Value *emitMBAIdentity(IRBuilderBase &Builder, BinaryOperator &BinOp,
+                              MBAIdentity Identity,
+                              MBAConstantFn GetConstant) {
+  Value *A = BinOp.getOperand(0);
+  Value *B = BinOp.getOperand(1);
+  Type *Ty = BinOp.getType();
+
+  switch (Identity) {
+  case MBAIdentity::AddViaXorAnd: {
+    // e0 = a ^ b
+    Value *Xor = Builder.CreateXor(A, B);
+    // e1 = 2 * (a & b)
+    Value *And = Builder.CreateAnd(A, B);
+    Value *TwiceAnd = Builder.CreateMul(GetConstant(Ty, 2), And);
+    // e2 = e0 + e1
+    return Builder.CreateAdd(Xor, TwiceAnd);
+  }
+  case MBAIdentity::SubViaAddNot: {
+    // ~b is spelled out as b ^ -1 (rather than CreateNot) so that the
+    // constant comes from GetConstant
+    Value *NotB = Builder.CreateXor(B, GetConstant(Ty, -1));
+    // (a + ~b) + 1
+    return Builder.CreateAdd(Builder.CreateAdd(A, NotB), GetConstant(Ty, 1));
+  }
+  }
+  llvm_unreachable("Unknown MBA identity");
+}
+
+InstructionCost
+getMBARuleCostDelta(const MBARule &Rule, Type *Ty,
+                    const TargetTransformInfo &TTI,
+                    TargetTransformInfo::TargetCostKind CostKind) {
+  // The opcodes of the instructions emitted by emitMBARule, in order
+  SmallVector<unsigned, 8> Opcodes;
+  switch (Rule.Identity) {
+  case MBAIdentity::AddViaXorAnd:
+    Opcodes.append({Instruction::Xor, Instruction::And, Instruction::Mul,
+                    Instruction::Add});
+    break;
+  case MBAIdentity::SubViaAddNot:
+    Opcodes.append({Instruction::Xor, Instruction::Add, Instruction::Add});
+    break;
+  }
+  if (!Rule.Mask.isIdentity())
+    Opcodes.append({Instruction::Mul, Instruction::Add, Instruction::Mul,
+                    Instruction::Add});
+
+  InstructionCost Cost = 0;
+  for (unsigned Opcode : Opcodes)
+    Cost += TTI.getArithmeticInstrCost(Opcode, Ty, CostKind);
+  return Cost - TTI.getArithmeticInstrCost(Rule.Opcode, Ty, CostKind);
+}
+
+Value *emitMBARule(IRBuilderBase &Builder, BinaryOperator &BinOp,
+                   const MBARule &Rule, MBAConstantFn GetConstant) {
+  Value *E = emitMBAIdentity(Builder, BinOp, Rule.Identity, GetConstant);
+  if (Rule.Mask.isIdentity())
+    return E;
+
+  // ((E * A + B) * C + D), with the constants on the left as in the
+  // original MBAAdd
+  Type *Ty = BinOp.getType();
+  const MBAAffineMask &Mask = Rule.Mask;
+  E = Builder.CreateMul(GetConstant(Ty, Mask.A), E);
+  E = Builder.CreateAdd(GetConstant(Ty, Mask.B), E);
+  E = Builder.CreateMul(GetConstant(Ty, Mask.C), E);
+  return Builder.CreateAdd(GetConstant(Ty, Mask.D), E);
+}
@@ -18,6 +18,7 @@
 // License: MIT
 //==============================================================================
 #include "MBASub.h"
+#include "MBARules.h"
 
 #include "llvm/ADT/Statistic.h"
 #include "llvm/IR/IRBuilder.h"
@@ -36,29 +37,20 @@ STATISTIC(SubstCount, "The # of substituted instructions");
 //-----------------------------------------------------------------------------
 // MBASub Implementaion
 //-----------------------------------------------------------------------------
-bool MBASub::runOnBasicBlock(BasicBlock &BB) {
-  bool Changed = false;
-
-  // Loop over all instructions in the block. Replacing instructions requires
-  // iterators, hence a for-range loop wouldn't be suitable.
-  for (auto Inst = BB.begin(), IE = BB.end(); Inst != IE; ++Inst) {
-
-    // Skip non-binary (e.g. unary or compare) instruction.
-    auto *BinOp = dyn_cast<BinaryOperator>(Inst);
-    if (!BinOp)
-      continue;
-
-    /// Skip instructions other than integer sub.
-    // source code : llvm/include/llvm/IR/Instruction.def
-    // HANDLE_BINARY_INST(15, Sub  , BinaryOperator)
-    unsigned Opcode = BinOp->getOpcode();
-    if (Opcode != Instruction::Sub || !BinOp->getType()->isIntegerTy())
-      continue;
-
-    // A uniform API for creating instructions and inserting
-    // them into basic blocks.
-    IRBuilder<> Builder(BinOp);
+// a - b == (a + ~b) + 1, for integers (and vectors of integers) of any width
+static constexpr MBARule MBASubRule = {Instruction::Sub, 0,
+                                       MBAIdentity::SubViaAddNot,
+                                       MBANoAffineMask};
+
+bool MBASub::isCandidate(const Instruction &Inst) {
+  /// Skip instructions other than integer sub.
+  // source code : llvm/include/llvm/IR/Instruction.def
+  // HANDLE_BINARY_INST(15, Sub  , BinaryOperator)
+  return findMBARule(MBASubRule, Inst);
+}
 
+Value *MBASub::emitReplacement(IRBuilderBase &Builder, BinaryOperator &BinOp,
+                               MBAConstantFn GetConstant) {
   //-----------------------------------------------------------------------------
   // Debug process:
   // step 0: original instruction
@@ -104,14 +96,25 @@ bool MBASub::runOnBasicBlock(BasicBlock &BB) {
   // ret i32 %9
   //-----------------------------------------------------------------------------
 
-    // Create an instruction representing (a + ~b) + 1
-    // %7 = sub nsw i32 %5, %6 %5=getOperand(0), %6=getOperand(1)
-    Instruction *NewValue = BinaryOperator::CreateAdd(
-        Builder.CreateAdd(BinOp->getOperand(0),
-                          Builder.CreateNot(BinOp->getOperand(1))//%7 = xor i32 %6, -1 (step 1)
-                         ),//%8 = add i32 %5, %7  (step 2)
-        ConstantInt::get(BinOp->getType(), 1)
-                                                    );  //<badref> = add i32 %8, 1 (step 3)
+  // Create an instruction representing (a + ~b) + 1
+  // %7 = sub nsw i32 %5, %6 %5=getOperand(0), %6=getOperand(1)
+  return emitMBARule(Builder, BinOp, MBASubRule, GetConstant);
+}
+
+bool MBASub::runOnBasicBlock(BasicBlock &BB) {
+  bool Changed = false;
+
+  // Loop over all instructions in the block. Replacing instructions erases
+  // them, hence the early-increment range.
+  for (Instruction &Inst : make_early_inc_range(BB)) {
+    if (!isCandidate(Inst))
+      continue;
+    auto *BinOp = cast<BinaryOperator>(&Inst);
+
+    // A uniform API for creating instructions and inserting
+    // them into basic blocks.
+    IRBuilder<> Builder(BinOp);
+    Value *NewValue = emitReplacement(Builder, *BinOp, getMBAConstant);
 
     // The following is visible only if you pass -debug on the command line
     // *and* you have an assert build.
@@ -119,7 +122,7 @@ bool MBASub::runOnBasicBlock(BasicBlock &BB) {
 
     // Replace `(a - b)` (original instructions) with `(a + ~b) + 1`
     // (the new instruction)
-    ReplaceInstWithInst(&BB, Inst, NewValue); // replace %9 = sub nsw i32 %5, %6 to %9 = add i32 %8, 1 (step 4)
+    replaceWithMBA(*BinOp, NewValue); // %9 takes over the name of the sub (step 4)
     Changed = true;
 
     // Update the statistics
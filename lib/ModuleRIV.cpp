@@ -0,0 +1,98 @@
+//=============================================================================
+// FILE:
+//    ModuleRIV.cpp
+//
+// DESCRIPTION:
+//    Computes RIV (see RIV.cpp) for all functions in a module in parallel.
+//    See ModuleRIV.h. This file is compiled into the RIV plugin.
+//
+// ALGORITHM:
+//    -------------------------------------------------------------------------
+//    STEP 1:
+//    Collect the functions with a body and reserve a result slot for each
+//    -------------------------------------------------------------------------
+//    STEP 2:
+//    Start one worker per thread. Every worker pulls the next function from
+//    a shared index, builds its dominator tree and its RIV result, and stores
+//    the result in that function's slot. Nothing is shared between the
+//    workers apart from the (read-only) module, so the results don't depend
+//    on the scheduling.
+//    -------------------------------------------------------------------------
+//
+// USAGE:
+//      $ opt -load-pass-plugin <BUILD_DIR>/lib/libRIV.so `\`
+//        -passes="print<riv-module>" -disable-output <bitcode-file>
+//
+// License: MIT
+//=============================================================================
+#include "ModuleRIV.h"
+
+#include "llvm/IR/Dominators.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+
+#include <atomic>
+
+using namespace llvm;
+
+//-----------------------------------------------------------------------------
+// ModuleRIVResult
+//-----------------------------------------------------------------------------
+const RIVResult *ModuleRIVResult::lookup(const Function *F) const {
+  auto It = Index.find(F);
+  return It == Index.end() ? nullptr : &Results[It->second];
+}
+
+//-----------------------------------------------------------------------------
+// ModuleRIV Implementation
+//-----------------------------------------------------------------------------
+ModuleRIV::Result ModuleRIV::build(Module &M) {
+  Result Res;
+
+  // STEP 1: Collect the functions with a body
+  std::vector<Function *> Funcs;
+  for (Function &F : M) {
+    if (F.isDeclaration())
+      continue;
+    Res.Index[&F] = Funcs.size();
+    Res.Funcs.push_back(&F);
+    Funcs.push_back(&F);
+  }
+  // The slots are assigned (not inserted) by the workers, so Results never
+  // reallocates
+  Res.Results.resize(Funcs.size());
+
+  // STEP 2: Compute the results in parallel
+  std::atomic<size_t> NextFunc{0};
+  DefaultThreadPool Pool(hardware_concurrency(Threads));
+  for (unsigned I = 0, E = Pool.getMaxConcurrency(); I < E; ++I)
+    Pool.async([&] {
+      for (size_t Idx = NextFunc++; Idx < Funcs.size(); Idx = NextFunc++) {
+        DominatorTree DT(*Funcs[Idx]);
+        Res.Results[Idx] = RIV().buildRIV(*Funcs[Idx], DT.getRootNode());
+      }
+    });
+  Pool.wait();
+
+  return Res;
+}
+
+ModuleRIV::Result ModuleRIV::run(Module &M, ModuleAnalysisManager &) {
+  return build(M);
+}
+
+PreservedAnalyses ModuleRIVPrinter::run(Module &M,
+                                        ModuleAnalysisManager &MAM) {
+  auto &RIVs = MAM.getResult<ModuleRIV>(M);
+
+  // Same output as print<riv>
+  for (const Function *F : RIVs.functions())
+    printRIVResult(OS, *RIVs.lookup(F));
+
+  return PreservedAnalyses::all();
+}
+
+//-----------------------------------------------------------------------------
+// New PM Registration (see getRIVPluginInfo in RIV.cpp)
+//-----------------------------------------------------------------------------
+AnalysisKey ModuleRIV::Key;
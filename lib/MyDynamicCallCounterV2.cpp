@@ -1,4 +1,6 @@
 #include "MyDynamicCallCounterV2.h"
+#include "DynamicCCRuntime.h"
+#include "NameTable.h"
 
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/Passes/PassBuilder.h"
@@ -10,189 +12,64 @@ using namespace llvm;
 #define DEBUG_TYPE "my-dynamic-cc-v2"
 
 
-Constant *CreateGlobalCounter(Module &M, StringRef GlobalVarName) {
-  auto &CTX = M.getContext();
-
-  // This will insert a declaration into M
-  Constant *NewGlobalVar =
-      M.getOrInsertGlobal(GlobalVarName, IntegerType::getInt32Ty(CTX));
+bool MyDynamicCallCounterV2::runOnModule(Module &M) {
+  // Functions to instrument. The position in this vector is the function's ID,
+  // i.e. the index of its counter.
+  SmallVector<Function *, 16> Funcs;
+  for (auto &F : M)
+    if (!F.isDeclaration())
+      Funcs.push_back(&F);
 
-  // This will change the declaration into definition (and initialise to 0)
-  GlobalVariable *NewGV = M.getNamedGlobal(GlobalVarName);
-  NewGV->setLinkage(GlobalValue::CommonLinkage);
-  NewGV->setAlignment(MaybeAlign(4));
-  NewGV->setInitializer(llvm::ConstantInt::get(CTX, APInt(32, 0)));
-
-  return NewGlobalVar;
-}
+  // Stop here if there are no function definitions in this module
+  if (Funcs.empty())
+    return false;
 
-bool MyDynamicCallCounterV2::runOnModule(Module &M)
-{
-    bool Instrumented = false;
+  auto &CTX = M.getContext();
 
-  // Function name <--> IR variable that holds the call counter
-  llvm::StringMap<Constant *> CallCounterMap;
-  // Function name <--> IR variable that holds the function name
-  llvm::StringMap<Constant *> FuncNameMap;
+  // STEP 1: Create the call counters
+  // --------------------------------
+  CounterLayout Layout =
+      CreateCounterArray(M, Funcs.size(), /*CounterWidth=*/32);
 
-  auto &CTX = M.getContext();
+  // Function ID <--> offset of the function name in the name table
+  NameTable Names(M);
+  SmallVector<uint32_t, 16> NameOffsets;
+  // Function ID <--> number of arguments. Unlike in V1, this is known at
+  // compile-time, so no code is injected for it.
+  SmallVector<uint32_t, 16> ArgNums;
 
-  // STEP 1: For each function in the module, inject a call-counting code
+  // STEP 2: For each function in the module, inject a call-counting code
   // --------------------------------------------------------------------
-  for (auto &F : M) {
-    if (F.isDeclaration())
-      continue;
-
+  for (auto [ID, F] : enumerate(Funcs)) {
     // Get an IR builder. Sets the insertion point to the top of the function
-    IRBuilder<> Builder(&*F.getEntryBlock().getFirstInsertionPt());
-
-    // Create a global variable to count the calls to this function
-    std::string CounterName = "CounterFor_" + std::string(F.getName());
-    //debug:97 Constant *Var = CreateGlobalCounter(M, CounterName);
-    //(gdb) p CounterName
-    //$1 = "CounterFor_foo"
-
-    Constant *Var = CreateGlobalCounter(M, CounterName);
-    
-    CallCounterMap[F.getName()] = Var;
+    IRBuilder<> Builder(&*F->getEntryBlock().getFirstInsertionPt());
 
-    // Create a global variable to hold the name of this function
-    auto FuncName = Builder.CreateGlobalString(F.getName());
-    FuncNameMap[F.getName()] = FuncName;
-    //get func for print func cuz we need to print func name later
+    NameOffsets.push_back(Names.add(F->getName()));
+    ArgNums.push_back(F->arg_size());
 
     // Inject instruction to increment the call count each time this function
     // executes
-    LoadInst *Load2 = Builder.CreateLoad(IntegerType::getInt32Ty(CTX), Var);
-    //%1 = load i32, ptr @CounterFor_foo, align 4
-    Value *Inc2 = Builder.CreateAdd(Builder.getInt32(1), Load2);
-    //%2 = add i32 1, %1
-    Builder.CreateStore(Inc2, Var);
-    //store i32 %2, ptr @CounterFor_foo, align 4
-
-    // The following is visible only if you pass -debug on the command line
-    // *and* you have an assert build.
-    LLVM_DEBUG(dbgs() << " Instrumented: " << F.getName() << "\n");
-
-    Instrumented = true;
-  }
+    Value *Var = Builder.CreateConstInBoundsGEP1_64(Layout.CounterTy,
+                                                    Layout.Counters, ID);
+    CreateIncrement(Builder, Layout, Var, /*IsAtomic=*/false);
 
-  // Stop here if there are no function definitions in this module
-  if (false == Instrumented)
-    return Instrumented;
-
-  // STEP 2: Inject the declaration of printf
-  // ----------------------------------------
-  // Create (or _get_ in cases where it's already available) the following
-  // declaration in the IR module:
-  //    declare i32 @printf(i8*, ...)
-  // It corresponds to the following C declaration:
-  //    int printf(char *, ...)
-  PointerType *PrintfArgTy = PointerType::getUnqual(Type::getInt8Ty(CTX));
-  //char * 8bit ptr
-  FunctionType *PrintfTy =
-      FunctionType::get(IntegerType::getInt32Ty(CTX), PrintfArgTy,
-                        /*IsVarArgs=*/true);
-  //func signature  return int 32bit, first arg char* (8bit ptr), var args
-
-  FunctionCallee Printf = M.getOrInsertFunction("printf", PrintfTy);
-  //check if printf is already in the module, if not insert it with the above signature
-  //we got something like this now:
-  //int printf(const char *format, ...); c style
-  //llvm ir:declare i32 @printf(i8*, ...)
-
-  // Set attributes as per inferLibFuncAttributes in BuildLibCalls.cpp
-  Function *PrintfF = dyn_cast<Function>(Printf.getCallee());
-  PrintfF->setDoesNotThrow();
-  PrintfF->addParamAttr(0, llvm::Attribute::getWithCaptureInfo(
-                               M.getContext(), llvm::CaptureInfo::none()));
-  //don't caputure ptr
-  PrintfF->addParamAttr(0, Attribute::ReadOnly);
-  //first arg is read only
-
-  // STEP 3: Inject a global variable that will hold the printf format string
-  // ------------------------------------------------------------------------
-  llvm::Constant *ResultFormatStr =
-      llvm::ConstantDataArray::getString(CTX, "%-20s %-10lu %d\n");
-    //create a global string constant with the format we want to use to print results
-  Constant *ResultFormatStrVar =
-      M.getOrInsertGlobal("ResultFormatStrIR", ResultFormatStr->getType());
-    //insert a global variable into the module to hold the format string
-  dyn_cast<GlobalVariable>(ResultFormatStrVar)->setInitializer(ResultFormatStr);
-
-  std::string out = "";
-  out += "=================================================\n";
-  out += "LLVM-TUTOR: mydynamic analysis results\n";
-  out += "=================================================\n";
-  out += "NAME     #N DIRECT CALLS     #N FUNC ARGS \n";
-  out += "-------------------------------------------------\n";
-
-  llvm::Constant *ResultHeaderStr =
-      llvm::ConstantDataArray::getString(CTX, out.c_str());
-
-  Constant *ResultHeaderStrVar =
-      M.getOrInsertGlobal("ResultHeaderStrIR", ResultHeaderStr->getType());
-  dyn_cast<GlobalVariable>(ResultHeaderStrVar)->setInitializer(ResultHeaderStr);
-
-  // STEP 4: Define a printf wrapper that will print the results
-  // -----------------------------------------------------------
-  // Define `printf_wrapper` that will print the results stored in FuncNameMap
-  // and CallCounterMap.  It is equivalent to the following C++ function:
-  // ```
-  //    void printf_wrapper() {
-  //      for (auto &item : Functions)
-  //        printf("llvm-tutor): Function %s was called %d times. \n",
-  //        item.name, item.count);
-  //    }
-  // ```
-  // (item.name comes from FuncNameMap, item.count comes from
-  // CallCounterMap)
-  FunctionType *PrintfWrapperTy =
-      FunctionType::get(llvm::Type::getVoidTy(CTX), {},
-                        /*IsVarArgs=*/false);
-  //void printf_wrapper()
-  Function *PrintfWrapperF = dyn_cast<Function>(
-      M.getOrInsertFunction("printf_wrapper", PrintfWrapperTy).getCallee());
-  //get or insert function into module
-
-  // Create the entry basic block for printf_wrapper ...
-  llvm::BasicBlock *RetBlock =
-      llvm::BasicBlock::Create(CTX, "enter", PrintfWrapperF);
-  IRBuilder<> Builder(RetBlock);
-  //fill the basic block with instructions
-
-  // ... and start inserting calls to printf
-  // (printf requires i8*, so cast the input strings accordingly)
-  llvm::Value *ResultHeaderStrPtr =
-      Builder.CreatePointerCast(ResultHeaderStrVar, PrintfArgTy);
-  llvm::Value *ResultFormatStrPtr =
-      Builder.CreatePointerCast(ResultFormatStrVar, PrintfArgTy);
-  //cast global vars to i8* (char*)
-  //llvm::Constant *ResultFormatStr =
-  // llvm::ConstantDataArray::getString(CTX, "%-20s %-10lu\n");
-  // it is array not a pointer, so we need to cast it
-
-  Builder.CreateCall(Printf, {ResultHeaderStrPtr});
-
-  LoadInst *LoadCounter;
-  
-  for (auto &item : CallCounterMap) {
-    LoadCounter = Builder.CreateLoad(IntegerType::getInt32Ty(CTX), item.second);
-    // LoadCounter = Builder.CreateLoad(item.second);
-    // This is the real function call counter
-    Function* Func = M.getFunction(item.first());
-    uint32_t argNum = Func->arg_size();
-    Value* ArgNumValue = Builder.getInt32(argNum);
-    //we don't need load store for arg num since it's constant
-    Builder.CreateCall(
-        Printf, {ResultFormatStrPtr, FuncNameMap[item.first()], LoadCounter,ArgNumValue});
+    LLVM_DEBUG(dbgs() << " Instrumented: " << F->getName() << "\n");
   }
 
-  // Finally, insert return instruction
-  Builder.CreateRetVoid();
+  Names.finalize();
+
+  // STEP 3: Print the results at the very end of this module
+  // --------------------------------------------------------
+  // The argument counts are baked into a constant table that is read by
+  // `printf_wrapper` (see CreateTextReport in DynamicCCRuntime.h)
+  Constant *ArgNumsInit = ConstantDataArray::get(CTX, ArgNums);
+  auto *ArgNumsVar = new GlobalVariable(
+      M, ArgNumsInit->getType(), /*isConstant=*/true,
+      GlobalValue::PrivateLinkage, ArgNumsInit, "DynamicCCArgNums");
 
-  // STEP 5: Call `printf_wrapper` at the very end of this module
-  // ------------------------------------------------------------
+  Function *PrintfWrapperF =
+      CreateTextReport(M, "mydynamic analysis results", Layout, Names,
+                       NameOffsets, ArgNumsVar, "#N FUNC ARGS");
   appendToGlobalDtors(M, PrintfWrapperF, /*Priority=*/0);
 
   return true;
@@ -0,0 +1,196 @@
+//========================================================================
+// FILE:
+//    MyDynamicCallCounterV3.cpp
+//
+// DESCRIPTION:
+//    Counts dynamic function calls and (optionally) reports the number of
+//    arguments of every function. This is a single, configurable version of
+//    MyDynamicCallCounter (V1) and MyDynamicCallCounterV2 that builds on the
+//    same runtime as DynamicCallCounter (see DynamicCCRuntime.h):
+//      1. Every function F _defined_ in M is given a dense ID and a counter in
+//         `DynamicCCCounters`, incremented at the beginning of F.
+//      2. At the end of the module, the results are either printed with
+//         `printf_wrapper` or written as a binary record (`dynamic_cc_dump`).
+//
+//    As in V2, the number of arguments is a compile-time constant, so it is
+//    only emitted into a constant table read by `printf_wrapper` - no code is
+//    injected into F for it. The counters and both reports are generated by
+//    the same code as in DynamicCallCounter.
+//
+//    The variant is selected through the pass parameters (separated with `;`):
+//      * `width=32|64` - width of the counters (64 by default)
+//      * `atomic`      - update the counters with relaxed atomic adds
+//      * `args`        - report the number of arguments
+//      * `format=text|bin` - print a table or write a binary record (read it
+//        with `cc-dump`). `args` is only available with `format=text`.
+//
+// USAGE:
+//      $ opt -load-pass-plugin <BUILD_DIR>/lib/libMyDynamicCallCounterV3.so `\`
+//        -passes="my-dynamic-cc-v3<width=64;atomic;args>" <bitcode-file> `\`
+//        -o instrumented.bin
+//      $ lli instrumented.bin
+//
+// License: MIT
+//========================================================================
+#include "MyDynamicCallCounterV3.h"
+#include "DynamicCCRuntime.h"
+#include "NameTable.h"
+
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+
+using namespace llvm;
+
+#define DEBUG_TYPE "my-dynamic-cc-v3"
+
+//-----------------------------------------------------------------------------
+// MyDynamicCallCounterV3 implementation
+//-----------------------------------------------------------------------------
+bool MyDynamicCallCounterV3::runOnModule(Module &M) {
+  // Functions to instrument. The position in this vector is the function's ID,
+  // i.e. the index of its counter.
+  SmallVector<Function *, 16> Funcs;
+  for (auto &F : M)
+    if (!F.isDeclaration())
+      Funcs.push_back(&F);
+
+  // Stop here if there are no function definitions in this module
+  if (Funcs.empty())
+    return false;
+
+  auto &CTX = M.getContext();
+
+  // STEP 1: Create the counters and inject the call-counting code
+  // -------------------------------------------------------------
+  CounterLayout Layout =
+      CreateCounterArray(M, Funcs.size(), Opts.CounterWidth);
+
+  for (auto [ID, F] : enumerate(Funcs)) {
+    IRBuilder<> Builder(&*F->getEntryBlock().getFirstInsertionPt());
+    Value *Var = Builder.CreateConstInBoundsGEP1_64(Layout.CounterTy,
+                                                    Layout.Counters, ID);
+    CreateIncrement(Builder, Layout, Var, Opts.Atomic);
+
+    LLVM_DEBUG(dbgs() << " Instrumented: " << F->getName() << " (ID " << ID
+                      << ")\n");
+  }
+
+  // STEP 2: Report the results when the module exits
+  // ------------------------------------------------
+  if (Opts.Format == ReportFormat::Binary) {
+    GlobalVariable *Prefix = CreateRecordPrefix(M, Layout, Funcs);
+    appendToGlobalDtors(M, CreateBinaryDump(M, Layout, Prefix),
+                        /*Priority=*/0);
+    return true;
+  }
+
+  // The table is printed by `printf_wrapper` (see CreateTextReport in
+  // DynamicCCRuntime.h). The numbers of arguments are compile-time constants,
+  // so they live in a constant table.
+  NameTable Names(M);
+  SmallVector<uint32_t, 16> NameOffsets;
+  SmallVector<uint32_t, 16> ArgNums;
+  for (Function *F : Funcs) {
+    NameOffsets.push_back(Names.add(F->getName()));
+    ArgNums.push_back(F->arg_size());
+  }
+  Names.finalize();
+
+  GlobalVariable *ArgNumsVar = nullptr;
+  if (Opts.ReportArgs) {
+    Constant *ArgNumsInit = ConstantDataArray::get(CTX, ArgNums);
+    ArgNumsVar = new GlobalVariable(M, ArgNumsInit->getType(),
+                                    /*isConstant=*/true,
+                                    GlobalValue::PrivateLinkage, ArgNumsInit,
+                                    "DynamicCCArgNums");
+  }
+
+  Function *PrintfWrapperF =
+      CreateTextReport(M, "mydynamic analysis results", Layout, Names,
+                       NameOffsets, ArgNumsVar, "#N FUNC ARGS");
+  appendToGlobalDtors(M, PrintfWrapperF, /*Priority=*/0);
+
+  return true;
+}
+
+PreservedAnalyses MyDynamicCallCounterV3::run(llvm::Module &M,
+                                              llvm::ModuleAnalysisManager &) {
+  bool Changed = runOnModule(M);
+
+  return (Changed ? llvm::PreservedAnalyses::none()
+                  : llvm::PreservedAnalyses::all());
+}
+
+//-----------------------------------------------------------------------------
+// New PM Registration
+//-----------------------------------------------------------------------------
+// Parses the parameters of `my-dynamic-cc-v3<...>`, e.g.
+// `my-dynamic-cc-v3<width=32;atomic;args>`.
+static Expected<MyDynamicCallCounterV3Options>
+parseMyDynamicCallCounterV3Options(StringRef Params) {
+  MyDynamicCallCounterV3Options Opts;
+  while (!Params.empty()) {
+    StringRef ParamName;
+    std::tie(ParamName, Params) = Params.split(';');
+
+    if (ParamName == "atomic") {
+      Opts.Atomic = true;
+    } else if (ParamName == "args") {
+      Opts.ReportArgs = true;
+    } else if (ParamName.consume_front("width=")) {
+      if (ParamName.getAsInteger(0, Opts.CounterWidth) ||
+          (Opts.CounterWidth != 32 && Opts.CounterWidth != 64))
+        return make_error<StringError>(
+            "my-dynamic-cc-v3 counter width must be 32 or 64, got '" +
+                ParamName + "'",
+            inconvertibleErrorCode());
+    } else if (ParamName == "format=text") {
+      Opts.Format = ReportFormat::Text;
+    } else if (ParamName == "format=bin") {
+      Opts.Format = ReportFormat::Binary;
+    } else {
+      return make_error<StringError>(
+          "invalid my-dynamic-cc-v3 pass parameter '" + ParamName + "'",
+          inconvertibleErrorCode());
+    }
+  }
+
+  // The binary record (see DynamicCCRecord.h) has no room for argument counts
+  if (Opts.ReportArgs && Opts.Format == ReportFormat::Binary)
+    return make_error<StringError>(
+        "my-dynamic-cc-v3: 'args' requires 'format=text'",
+        inconvertibleErrorCode());
+
+  return Opts;
+}
+
+llvm::PassPluginLibraryInfo getMyDynamicCallCounterV3PluginInfo() {
+  return {LLVM_PLUGIN_API_VERSION, "my-dynamic-cc-v3", LLVM_VERSION_STRING,
+          [](PassBuilder &PB) {
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, ModulePassManager &MPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+                  if (!PassBuilder::checkParametrizedPassName(
+                          Name, "my-dynamic-cc-v3"))
+                    return false;
+
+                  auto Opts = PassBuilder::parsePassParameters(
+                      parseMyDynamicCallCounterV3Options, Name,
+                      "my-dynamic-cc-v3");
+                  if (!Opts) {
+                    errs() << toString(Opts.takeError()) << "\n";
+                    return false;
+                  }
+                  MPM.addPass(MyDynamicCallCounterV3(*Opts));
+                  return true;
+                });
+          }};
+}
+
+extern "C" LLVM_ATTRIBUTE_WEAK ::llvm::PassPluginLibraryInfo
+llvmGetPassPluginInfo() {
+  return getMyDynamicCallCounterV3PluginInfo();
+}
@@ -0,0 +1,84 @@
+//========================================================================
+// FILE:
+//    NameTable.cpp
+//
+// DESCRIPTION:
+//    Implements NameTable, see NameTable.h. This file is compiled into every
+//    plugin that uses it.
+//
+// License: MIT
+//========================================================================
+#include "NameTable.h"
+
+#include <cassert>
+
+using namespace llvm;
+
+// The name of the global variable that holds the table
+static constexpr const char *NameTableVarName = "LLVMTutorNames";
+
+NameTable::NameTable(Module &M) : M(M) {
+  GlobalVariable *Existing = M.getNamedGlobal(NameTableVarName);
+  if (!Existing || !Existing->hasInitializer())
+    return;
+  auto *Init = dyn_cast<ConstantDataSequential>(Existing->getInitializer());
+  if (!Init || !Init->isString())
+    return;
+
+  Table = Existing;
+  Data = Init->getAsString().str();
+  StringRef Names = Data;
+  uint32_t Offset = 0;
+  while (!Names.empty()) {
+    auto [Name, Rest] = Names.split('\0');
+    Offsets.try_emplace(Name, Offset);
+    Offset += Name.size() + 1;
+    Names = Rest;
+  }
+}
+
+uint32_t NameTable::add(StringRef Name) {
+  auto [It, Inserted] = Offsets.try_emplace(Name, Data.size());
+  if (Inserted) {
+    Data += Name;
+    Data.push_back('\0');
+  }
+  return It->second;
+}
+
+GlobalVariable *NameTable::finalize() {
+  Constant *Init = ConstantDataArray::getString(M.getContext(), Data,
+                                                /*AddNull=*/false);
+  if (Table && Table->getInitializer() == Init)
+    return Table;
+
+  auto *NewTable = new GlobalVariable(M, Init->getType(), /*isConstant=*/true,
+                                      GlobalValue::PrivateLinkage, Init);
+  NewTable->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+  NewTable->setAlignment(Align(1));
+  if (Table) {
+    // The old contents are a prefix of the new ones, so all the addresses
+    // computed from the old table remain valid
+    Table->replaceAllUsesWith(NewTable);
+    NewTable->takeName(Table);
+    Table->eraseFromParent();
+  } else {
+    NewTable->setName(NameTableVarName);
+  }
+  Table = NewTable;
+  return Table;
+}
+
+Constant *NameTable::getAddress(uint32_t Offset) const {
+  assert(Table && "The table has not been finalized");
+  return ConstantExpr::getInBoundsGetElementPtr(
+      Type::getInt8Ty(M.getContext()), Table,
+      ConstantInt::get(Type::getInt64Ty(M.getContext()), Offset));
+}
+
+Value *NameTable::CreateAddress(IRBuilder<> &Builder, Value *Offset) const {
+  assert(Table && "The table has not been finalized");
+  return Builder.CreateInBoundsGEP(
+      Builder.getInt8Ty(), Table,
+      Builder.CreateZExt(Offset, Builder.getInt64Ty()), "name");
+}
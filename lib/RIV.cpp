@@ -13,16 +13,21 @@
 //    RIV_N = set of reachable integer values for basic block N (BB_N)
 //    -------------------------------------------------------------------------
 //    STEP 1:
-//    For every BB_N in F:
-//      compute v_N and store it in DefinedValuesMap
+//    Create the root node:
+//      Root = {input args, global vars}
+//      RIV_0 = Root (BB_0 is the entry block)
 //    -------------------------------------------------------------------------
-//    STEP 2:
-//    Compute the RIVs for the entry block (BB_0):
-//      RIV_0 = {input args, global vars}
+//    STEP 2: Traverse the dominator tree and for every BB_N:
+//      * compute v_N, the set of integer values defined in BB_N,
+//      * if v_N is non-empty, create a node Node_N = {v_N} -> RIV_N, otherwise
+//        Node_N = RIV_N
+//      * for every BB_M that BB_N immediately dominates:
+//          RIV_M = Node_N
+//    i.e. RIV_M = {RIV_N, v_N} is represented by a pointer to the node of
+//    v_N, which points to RIV_N. Nothing is copied.
 //    -------------------------------------------------------------------------
-//    STEP 3: Traverse the CFG and for every BB_M that BB_N dominates,
-//    calculate RIV_M as follows:
-//      RIV_M = {RIV_N, v_N}
+//    STEP 3 (compact mode only):
+//    Flatten the chains that are longer than MaxChainLength
 //    -------------------------------------------------------------------------
 //
 // REFERENCES:
@@ -33,6 +38,9 @@
 // License: MIT
 //=============================================================================
 #include "RIV.h"
+#include "LazyRIV.h"
+#include "ModuleRIV.h"
+#include "RIVBitVector.h"
 
 #include "llvm/IR/Module.h"
 #include "llvm/Passes/PassBuilder.h"
@@ -49,14 +57,47 @@ using namespace llvm;
 using NodeTy = DomTreeNodeBase<llvm::BasicBlock> *;
 //NodeTy myNode; // example of how to declare a variable of type NodeTy
 //DomTreeNodeBase<llvm::BasicBlock>* myNode; // equivalent declaration
-// A map that a basic block BB holds a set of pointers to values defined in BB.
-using DefValMapTy = RIV::Result;
-// using Result = llvm::MapVector<llvm::BasicBlock const *,
-//                                llvm::SmallPtrSet<llvm::Value *, 8>>;
 
-// Pretty-prints the result of this analysis
-static void printRIVResult(llvm::raw_ostream &OutS, const RIV::Result &RIVMap);
-static void debugRIVMap(const llvm::MapVector<const llvm::BasicBlock *, llvm::SmallPtrSet<llvm::Value *, 8>> &Map);
+static void debugRIVMap(const RIV::Result &Map);
+
+//-----------------------------------------------------------------------------
+// RIVResult
+//-----------------------------------------------------------------------------
+bool RIVResult::ValueSet::contains(const Value *V) const {
+  for (const Node *N = Head; N; N = N->Up)
+    if (is_contained(N->Values, V))
+      return true;
+  return false;
+}
+
+RIVResult::Node &RIVResult::createNode(const Node *Up) {
+  Node &N = Nodes.emplace_back();
+  N.Up = Up;
+  if (Up) {
+    N.ChainSize = Up->ChainSize;
+    N.ChainLength = Up->ChainLength + 1;
+  }
+  return N;
+}
+
+void RIVResult::compact(unsigned MaxChainLength) {
+  if (!MaxChainLength)
+    return;
+
+  // Parents come before children, so every chain above N is already at most
+  // MaxChainLength long
+  for (Node &N : Nodes) {
+    N.ChainLength = N.Up ? N.Up->ChainLength + 1 : 1;
+    if (N.ChainLength <= MaxChainLength)
+      continue;
+
+    // The order of the values doesn't change
+    for (const Node *Up = N.Up; Up; Up = Up->Up)
+      N.Values.append(Up->Values.begin(), Up->Values.end());
+    N.Up = nullptr;
+    N.ChainLength = 1;
+  }
+}
 
 //-----------------------------------------------------------------------------
 // RIV Implementation
@@ -68,63 +109,56 @@ RIV::Result RIV::buildRIV(Function &F, NodeTy CFGRoot) {
   std::deque<NodeTy> BBsToProcess;
   BBsToProcess.push_back(CFGRoot);
 
-  // STEP 1: For every basic block BB compute the set of integer values defined
-  // in BB
-  DefValMapTy DefinedValuesMap;
-  for (BasicBlock &BB : F) {
-    auto &Values = DefinedValuesMap[&BB];
-    for (Instruction &Inst : BB)
-      if (Inst.getType()->isIntegerTy())
-        Values.insert(&Inst);
-  }
-
-  // STEP 2: Compute the RIVs for the entry BB. This will include global
+  // STEP 1: Compute the RIVs for the entry BB. This will include global
   // variables and input arguments.
-  auto &EntryBBValues = ResultMap[&F.getEntryBlock()];
+  Result::Node &EntryBBValues = ResultMap.createNode(nullptr);
 
   for (auto &Global : F.getParent()->globals())
     if (Global.getValueType()->isIntegerTy())
-      EntryBBValues.insert(&Global);
+      EntryBBValues.Values.push_back(&Global);
     //Global is empty in input_for_riv.c
 
   for (Argument &Arg : F.args())
     if (Arg.getType()->isIntegerTy())
-      EntryBBValues.insert(&Arg);
+      EntryBBValues.Values.push_back(&Arg);
+  EntryBBValues.ChainSize = EntryBBValues.Values.size();
+
+  ResultMap.Blocks.push_back(CFGRoot->getBlock());
+  ResultMap.Heads[CFGRoot->getBlock()] = &EntryBBValues;
 
-  // STEP 3: Traverse the CFG for every BB in F calculate its RIVs
+  // STEP 2: Traverse the CFG for every BB in F calculate its RIVs
   while (!BBsToProcess.empty()) {
     auto *Parent = BBsToProcess.back();
     BBsToProcess.pop_back();
 
-    // Get the values defined in Parent
-    auto &ParentDefs = DefinedValuesMap[Parent->getBlock()];
-    //[Debug]: call (Parent->getBlock()).dump()
-    // %4 = add nsw i32 %0, 123
-    // %5 = icmp sgt i32 %0, 0
-    // br i1 %5, label %6, label %17
-
-    // Get the RIV set of for Parent
-    // (Since RIVMap is updated on every iteration, its contents are likely to
-    // be moved around when resizing. This means that we need a copy of it
-    // (i.e. a reference is not sufficient).
-    llvm::SmallPtrSet<llvm::Value *, 8> ParentRIVs =
-        ResultMap[Parent->getBlock()];
-
-    // Loop over all BBs that Parent dominates and update their RIV sets
+    // The RIV set of Parent
+    const Result::Node *ParentRIVs = ResultMap.Heads.lookup(Parent->getBlock());
+
+    // The RIV set shared by all the children of Parent: the values defined in
+    // Parent on top of Parent's set (or just Parent's set if Parent defines
+    // no integer values)
+    Result::Node *ParentDefs = nullptr;
+    for (Instruction &Inst : *Parent->getBlock()) {
+      if (!Inst.getType()->isIntegerTy())
+        continue;
+      if (!ParentDefs)
+        ParentDefs = &ResultMap.createNode(ParentRIVs);
+      ParentDefs->Values.push_back(&Inst);
+      ParentDefs->ChainSize++;
+    }
+    const Result::Node *ChildRIVs = ParentDefs ? ParentDefs : ParentRIVs;
+
+    // Loop over all BBs that Parent dominates and set their RIV sets
     for (NodeTy Child : *Parent) {
-      //[debug]: p (*Child.TheBB).dump() 
       BBsToProcess.push_back(Child);
-      auto ChildBB = Child->getBlock();
-      //Child->getBlock is same with  p (*Child.TheBB).dump()
-
-      // Add values defined in Parent to the current child's set of RIV
-      ResultMap[ChildBB].insert(ParentDefs.begin(), ParentDefs.end());
-
-      // Add Parent's set of RIVs to the current child's RIV
-      ResultMap[ChildBB].insert(ParentRIVs.begin(), ParentRIVs.end());
+      ResultMap.Blocks.push_back(Child->getBlock());
+      ResultMap.Heads[Child->getBlock()] = ChildRIVs;
     }
   }
 
+  // STEP 3: Flatten long chains
+  ResultMap.compact(MaxChainLength);
+
   return ResultMap;
 }
 
@@ -138,7 +172,7 @@ RIV::Result RIV::run(llvm::Function &F, llvm::FunctionAnalysisManager &FAM) {
 PreservedAnalyses RIVPrinter::run(Function &Func,
                                   FunctionAnalysisManager &FAM) {
 
-  auto RIVMap = FAM.getResult<RIV>(Func);
+  auto &RIVMap = FAM.getResult<RIV>(Func);
 
   printRIVResult(OS, RIVMap);
   return PreservedAnalyses::all();
@@ -160,12 +194,35 @@ llvm::PassPluginLibraryInfo getRIVPluginInfo() {
                     FPM.addPass(RIVPrinter(llvm::errs()));
                     return true;
                   }
+                  if (Name == "print<riv-bitvector>") {
+                    FPM.addPass(RIVBitVectorPrinter(llvm::errs()));
+                    return true;
+                  }
+                  return false;
+                });
+            // #1 REGISTRATION FOR "opt -passes=print<riv-module>"
+            PB.registerPipelineParsingCallback(
+                [&](StringRef Name, ModulePassManager &MPM,
+                    ArrayRef<PassBuilder::PipelineElement>) {
+                  if (Name == "print<riv-module>") {
+                    MPM.addPass(ModuleRIVPrinter(llvm::errs()));
+                    return true;
+                  }
                   return false;
                 });
-            // #2 REGISTRATION FOR "FAM.getResult<RIV>(Function)"
+            // #2 REGISTRATION FOR "FAM.getResult<RIV>(Function)",
+            // "FAM.getResult<RIVBitVector>(Function)" and
+            // "FAM.getResult<LazyRIV>(Function)"
             PB.registerAnalysisRegistrationCallback(
                 [](FunctionAnalysisManager &FAM) {
                   FAM.registerPass([&] { return RIV(); });
+                  FAM.registerPass([&] { return RIVBitVector(); });
+                  FAM.registerPass([&] { return LazyRIV(); });
+                });
+            // #2 REGISTRATION FOR "MAM.getResult<ModuleRIV>(Module)"
+            PB.registerAnalysisRegistrationCallback(
+                [](ModuleAnalysisManager &MAM) {
+                  MAM.registerPass([&] { return ModuleRIV(); });
                 });
           }};
 };
@@ -178,7 +235,7 @@ llvmGetPassPluginInfo() {
 //------------------------------------------------------------------------------
 // Helper functions
 //------------------------------------------------------------------------------
-static void printRIVResult(raw_ostream &OutS, const RIV::Result &RIVMap) {
+void printRIVResult(raw_ostream &OutS, const RIV::Result &RIVMap) {
   OutS << "=================================================\n";
   OutS << "LLVM-TUTOR: RIV analysis results\n";
   OutS << "=================================================\n";
@@ -190,12 +247,12 @@ static void printRIVResult(raw_ostream &OutS, const RIV::Result &RIVMap) {
 
   const char *EmptyStr = "";
 
-  for (auto const &KV : RIVMap) {
+  for (const BasicBlock *BB : RIVMap.blocks()) {
     std::string DummyStr;
     raw_string_ostream BBIdStream(DummyStr);
-    KV.first->printAsOperand(BBIdStream, false);
+    BB->printAsOperand(BBIdStream, false);
     OutS << format("BB %-12s %-30s\n", BBIdStream.str().c_str(), EmptyStr);
-    for (auto const *IntegerValue : KV.second) {
+    for (auto const *IntegerValue : RIVMap.lookup(BB)) {
       std::string DummyStr;
       raw_string_ostream InstrStr(DummyStr);
       IntegerValue->print(InstrStr);
@@ -210,15 +267,14 @@ static void printRIVResult(raw_ostream &OutS, const RIV::Result &RIVMap) {
 // Debug functions
 //------------------------------------------------------------------------------
 __attribute__((used))
-static void debugRIVMap(const llvm::MapVector<const llvm::BasicBlock *, 
-                                              llvm::SmallPtrSet<llvm::Value *, 8>> &Map)
+static void debugRIVMap(const RIV::Result &Map)
 {
-  for(const auto &Pair : Map) 
+  for(const llvm::BasicBlock *BB : Map.blocks()) 
   {
     llvm::errs() << "BasicBlock: ";
-    Pair.first->printAsOperand(llvm::errs(), false);
+    BB->printAsOperand(llvm::errs(), false);
     llvm::errs() << "\n Values:";
-    for (const auto *V : Pair.second) {
+    for (const auto *V : Map.lookup(BB)) {
       V->printAsOperand(llvm::errs(), false);
       llvm::errs() << ", ";
     }
@@ -227,7 +283,7 @@ static void debugRIVMap(const llvm::MapVector<const llvm::BasicBlock *,
 
 }
 __attribute__((used))
-static void debugSet(const llvm::SmallPtrSet<llvm::Value *, 8> &Set) {
+static void debugSet(const RIV::Result::ValueSet &Set) {
     llvm::errs() << "\n=== Debugging RIV Set (Size: " << Set.size() << ") ===\n";
     
     if (Set.empty()) {
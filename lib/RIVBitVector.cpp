@@ -0,0 +1,158 @@
+//=============================================================================
+// FILE:
+//    RIVBitVector.cpp
+//
+// DESCRIPTION:
+//    Computes the same reachable integer values as RIV (see RIV.cpp), but
+//    stores them as bit vectors over a dense numbering of the values. See
+//    RIVBitVector.h. This file is compiled into the RIV plugin.
+//
+// ALGORITHM:
+//    -------------------------------------------------------------------------
+//    STEP 1:
+//    Number the integer globals and arguments (0 .. E - 1) and set them in
+//    RIV_0 (the set of the entry block)
+//    -------------------------------------------------------------------------
+//    STEP 2:
+//    Traverse the dominator tree in preorder. For every BB_N that is not a
+//    leaf (the values defined in a leaf are not reachable in any block):
+//      * number the integer values defined in BB_N, v_N (this makes v_N a
+//        contiguous range of bits)
+//      * for every BB_M that BB_N immediately dominates:
+//          RIV_M = RIV_N | v_N
+//    -------------------------------------------------------------------------
+//
+// USAGE:
+//      $ opt -load-pass-plugin <BUILD_DIR>/lib/libRIV.so `\`
+//        -passes="print<riv-bitvector>" -disable-output <bitcode-file>
+//
+// License: MIT
+//=============================================================================
+#include "RIVBitVector.h"
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+//-----------------------------------------------------------------------------
+// RIVBitVectorResult
+//-----------------------------------------------------------------------------
+const RIVBitVectorResult::ValueSet &
+RIVBitVectorResult::getReachable(const BasicBlock *BB) const {
+  auto It = Reachable.find(BB);
+  return It == Reachable.end() ? Empty : It->second;
+}
+
+bool RIVBitVectorResult::isReachable(const BasicBlock *BB,
+                                     const Value *V) const {
+  auto It = Numbers.find(V);
+  return It != Numbers.end() && getReachable(BB).test(It->second);
+}
+
+//-----------------------------------------------------------------------------
+// RIVBitVector Implementation
+//-----------------------------------------------------------------------------
+RIVBitVector::Result RIVBitVector::build(Function &F,
+                                         const DominatorTree &DT) {
+  Result Res;
+  auto Number = [&Res](Value *V) {
+    Res.Numbers[V] = Res.Values.size();
+    Res.Values.push_back(V);
+  };
+
+  // Every block gets exactly one set, so the sets never move once created
+  Res.Reachable.reserve(F.size());
+
+  // STEP 1: Number the values reachable in the entry block: global variables
+  // and input arguments
+  for (GlobalVariable &Global : F.getParent()->globals())
+    if (Global.getValueType()->isIntegerTy())
+      Number(&Global);
+
+  for (Argument &Arg : F.args())
+    if (Arg.getType()->isIntegerTy())
+      Number(&Arg);
+
+  Result::ValueSet &EntryBBValues = Res.Reachable[&F.getEntryBlock()];
+  for (unsigned I = 0, E = Res.Values.size(); I < E; ++I)
+    EntryBBValues.set(I);
+
+  // STEP 2: Traverse the dominator tree in preorder
+  SmallVector<const DomTreeNode *, 32> BBsToProcess;
+  BBsToProcess.push_back(DT.getRootNode());
+  while (!BBsToProcess.empty()) {
+    const DomTreeNode *Parent = BBsToProcess.pop_back_val();
+    if (Parent->isLeaf())
+      continue;
+
+    // Number the values defined in Parent
+    BasicBlock *ParentBB = Parent->getBlock();
+    unsigned DefsBegin = Res.Values.size();
+    for (Instruction &Inst : *ParentBB)
+      if (Inst.getType()->isIntegerTy())
+        Number(&Inst);
+
+    // The RIV set shared by all the children of Parent
+    Result::ValueSet ChildRIVs = Res.Reachable[ParentBB];
+    for (unsigned I = DefsBegin, E = Res.Values.size(); I < E; ++I)
+      ChildRIVs.set(I);
+
+    for (const DomTreeNode *Child : *Parent) {
+      Res.Reachable[Child->getBlock()] = ChildRIVs;
+      BBsToProcess.push_back(Child);
+    }
+  }
+
+  return Res;
+}
+
+RIVBitVector::Result RIVBitVector::run(Function &F,
+                                       FunctionAnalysisManager &FAM) {
+  return build(F, FAM.getResult<DominatorTreeAnalysis>(F));
+}
+
+PreservedAnalyses RIVBitVectorPrinter::run(Function &Func,
+                                           FunctionAnalysisManager &FAM) {
+  auto &RIVs = FAM.getResult<RIVBitVector>(Func);
+  auto &DT = FAM.getResult<DominatorTreeAnalysis>(Func);
+
+  OS << "=================================================\n";
+  OS << "LLVM-TUTOR: RIV analysis results (bit vectors)\n";
+  OS << "=================================================\n";
+
+  const char *Str1 = "BB id";
+  const char *Str2 = "Reachable Integer Values";
+  OS << format("%-10s %-30s\n", Str1, Str2);
+  OS << "-------------------------------------------------\n";
+
+  const char *EmptyStr = "";
+
+  // Unlike print<riv>, blocks are printed in function order and values in
+  // the order of their numbers
+  for (BasicBlock &BB : Func) {
+    if (!DT.isReachableFromEntry(&BB))
+      continue;
+
+    std::string DummyStr;
+    raw_string_ostream BBIdStream(DummyStr);
+    BB.printAsOperand(BBIdStream, false);
+    OS << format("BB %-12s %-30s\n", BBIdStream.str().c_str(), EmptyStr);
+    for (unsigned Number : RIVs.getReachable(&BB)) {
+      std::string DummyStr;
+      raw_string_ostream InstrStr(DummyStr);
+      RIVs.getValue(Number)->print(InstrStr);
+      OS << format("%-12s %-30s\n", EmptyStr, InstrStr.str().c_str());
+    }
+  }
+
+  OS << "\n\n";
+  return PreservedAnalyses::all();
+}
+
+//-----------------------------------------------------------------------------
+// New PM Registration (see getRIVPluginInfo in RIV.cpp)
+//-----------------------------------------------------------------------------
+AnalysisKey RIVBitVector::Key;
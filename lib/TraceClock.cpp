@@ -0,0 +1,75 @@
+//========================================================================
+// FILE:
+//    TraceClock.cpp
+//
+// DESCRIPTION:
+//    Implements the clock helpers declared in TraceClock.h. This file is
+//    compiled into every plugin that uses them.
+//
+// License: MIT
+//========================================================================
+#include "TraceClock.h"
+
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/TargetParser/Triple.h"
+
+using namespace llvm;
+
+bool traceClockCountsCycles(const Module &M) {
+  return M.getTargetTriple().isX86();
+}
+
+// Creates `llvm_tutor_clock_ns`, which is equivalent to the following C code:
+// ```
+//    static uint64_t llvm_tutor_clock_ns() {
+//      struct timespec TS;
+//      clock_gettime(CLOCK_MONOTONIC, &TS);
+//      return TS.tv_sec * 1000000000 + TS.tv_nsec;
+//    }
+// ```
+// It's a separate function (rather than inline code) so that the `alloca`
+// for TS stays in an entry block, no matter where the clock is read.
+static Function *getOrCreateClockNs(Module &M) {
+  static constexpr const char *ClockFnName = "llvm_tutor_clock_ns";
+  if (Function *ClockF = M.getFunction(ClockFnName))
+    return ClockF;
+
+  auto &CTX = M.getContext();
+  PointerType *PtrTy = PointerType::getUnqual(CTX);
+  IntegerType *Int32Ty = Type::getInt32Ty(CTX);
+  IntegerType *Int64Ty = Type::getInt64Ty(CTX);
+  // Both fields of struct timespec (time_t and long) are as wide as a pointer
+  // on the (non-LFS) ABIs supported here
+  IntegerType *LongTy = M.getDataLayout().getIntPtrType(CTX);
+  auto *TimespecTy = StructType::get(CTX, {LongTy, LongTy});
+  const uint32_t CLOCK_MONOTONIC_ =
+      M.getTargetTriple().isOSDarwin() ? 6 : 1;
+
+  FunctionCallee ClockGettime = M.getOrInsertFunction(
+      "clock_gettime", FunctionType::get(Int32Ty, {Int32Ty, PtrTy}, false));
+  Function *ClockF = Function::Create(FunctionType::get(Int64Ty, false),
+                                      GlobalValue::InternalLinkage,
+                                      ClockFnName, M);
+  ClockF->addFnAttr(Attribute::NoUnwind);
+
+  IRBuilder<> Builder(BasicBlock::Create(CTX, "enter", ClockF));
+  Value *TS = Builder.CreateAlloca(TimespecTy, nullptr, "ts");
+  Builder.CreateCall(ClockGettime, {Builder.getInt32(CLOCK_MONOTONIC_), TS});
+  Value *Sec = Builder.CreateSExt(
+      Builder.CreateLoad(LongTy, Builder.CreateStructGEP(TimespecTy, TS, 0)),
+      Int64Ty);
+  Value *NSec = Builder.CreateSExt(
+      Builder.CreateLoad(LongTy, Builder.CreateStructGEP(TimespecTy, TS, 1)),
+      Int64Ty);
+  Builder.CreateRet(Builder.CreateAdd(
+      Builder.CreateMul(Sec, Builder.getInt64(1000000000)), NSec));
+
+  return ClockF;
+}
+
+Value *CreateReadTraceClock(IRBuilder<> &Builder, Module &M) {
+  if (traceClockCountsCycles(M))
+    return Builder.CreateIntrinsic(Intrinsic::readcyclecounter, {}, {},
+                                   /*FMFSource=*/nullptr, "timestamp");
+  return Builder.CreateCall(getOrCreateClockNs(M), {}, "timestamp");
+}
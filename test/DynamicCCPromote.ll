@@ -0,0 +1,111 @@
+; Checks that DynamicCCPromote keeps the counter updates in loops in
+; registers and flushes the delta on every exit: plain and atomic updates,
+; loops with several exits and loop nests (only the outermost loop flushes).
+
+; RUN: opt -load-pass-plugin %shlibdir/libDynamicCallCounter%shlibext -passes="dynamic-cc-promote" -S %s | FileCheck %s
+
+; The documented pipeline has to parse, i.e. the pass is available at the
+; module level too
+; RUN: opt -load-pass-plugin %shlibdir/libDynamicCallCounter%shlibext -passes="dynamic-cc,default<O2>,dynamic-cc-promote" -disable-output %s
+
+@DynamicCCCounters = internal global [4 x i64] zeroinitializer
+
+; CHECK-LABEL: define void @plain(
+; CHECK: loop:
+; CHECK-NEXT: %delta = phi i64
+; CHECK-NOT: @DynamicCCCounters
+; CHECK: %delta.next = add i64 %delta, 1
+; CHECK-NOT: @DynamicCCCounters
+; CHECK: exit:
+; CHECK-NEXT: [[COUNT:%.+]] = load i64, ptr @DynamicCCCounters
+; CHECK-NEXT: [[SUM:%.+]] = add i64 [[COUNT]], %delta.next
+; CHECK-NEXT: store i64 [[SUM]], ptr @DynamicCCCounters
+; CHECK-NEXT: ret void
+define void @plain(i32 %n) {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  %count = load i64, ptr @DynamicCCCounters
+  %count.next = add i64 %count, 1
+  store i64 %count.next, ptr @DynamicCCCounters
+  %i.next = add i32 %i, 1
+  %done = icmp eq i32 %i.next, %n
+  br i1 %done, label %exit, label %loop
+
+exit:
+  ret void
+}
+
+; CHECK-LABEL: define void @atomic_exits(
+; CHECK: loop:
+; CHECK-NEXT: %delta = phi i64
+; CHECK-NOT: atomicrmw
+; CHECK: %delta.next = add i64 %delta, 1
+; CHECK-NOT: atomicrmw
+; CHECK: early:
+; CHECK-NEXT: atomicrmw add ptr {{.*}}@DynamicCCCounters, i64 8), i64 %delta.next monotonic, align 8
+; CHECK-NEXT: ret void
+; CHECK: exit:
+; CHECK-NEXT: atomicrmw add ptr {{.*}}@DynamicCCCounters, i64 8), i64 %delta.next monotonic, align 8
+; CHECK-NEXT: ret void
+define void @atomic_exits(i32 %n, i1 %stop) {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %latch ]
+  %old = atomicrmw add ptr getelementptr inbounds (i8, ptr @DynamicCCCounters, i64 8), i64 1 monotonic, align 8
+  br i1 %stop, label %early, label %latch
+
+latch:
+  %i.next = add i32 %i, 1
+  %done = icmp eq i32 %i.next, %n
+  br i1 %done, label %exit, label %loop
+
+early:
+  ret void
+
+exit:
+  ret void
+}
+
+; CHECK-LABEL: define void @nested(
+; CHECK: outer:
+; CHECK-NEXT: [[OUTER:%delta[0-9]*]] = phi i64
+; CHECK: inner:
+; CHECK-NEXT: [[INNER:%delta[0-9]*]] = phi i64 {{.*}}[ [[OUTER]], %outer ]
+; CHECK-NOT: @DynamicCCCounters
+; CHECK: %delta.next = add i64 [[INNER]], 1
+; CHECK-NOT: @DynamicCCCounters
+; CHECK: exit:
+; CHECK-NEXT: [[COUNT:%.+]] = load i64, ptr {{.*}}@DynamicCCCounters, i64 16)
+; CHECK-NEXT: [[SUM:%.+]] = add i64 [[COUNT]], %delta.next
+; CHECK-NEXT: store i64 [[SUM]], ptr {{.*}}@DynamicCCCounters, i64 16)
+; CHECK-NEXT: ret void
+define void @nested(i32 %n) {
+entry:
+  br label %outer
+
+outer:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %outer.latch ]
+  br label %inner
+
+inner:
+  %j = phi i32 [ 0, %outer ], [ %j.next, %inner ]
+  %count = load i64, ptr getelementptr inbounds (i8, ptr @DynamicCCCounters, i64 16)
+  %count.next = add i64 %count, 1
+  store i64 %count.next, ptr getelementptr inbounds (i8, ptr @DynamicCCCounters, i64 16)
+  %j.next = add i32 %j, 1
+  %inner.done = icmp eq i32 %j.next, %n
+  br i1 %inner.done, label %outer.latch, label %inner
+
+outer.latch:
+  %i.next = add i32 %i, 1
+  %done = icmp eq i32 %i.next, %n
+  br i1 %done, label %exit, label %outer
+
+exit:
+  ret void
+}
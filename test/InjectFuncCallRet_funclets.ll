@@ -0,0 +1,69 @@
+; Checks the exits through exceptions of functions with funclet-based EH
+; (MSVC C++). Every unwind edge to the caller (`cleanupret`, `catchswitch` and
+; calls that may throw) is redirected to a single instrumented cleanup, which
+; then unwinds to the caller. The calls injected into funclets get the
+; `funclet` bundle.
+
+; RUN: opt -load-pass-plugin %shlibdir/libInjectFuncCallRet%shlibext -passes="inject-func-call-ret" -S %s | FileCheck %s
+
+target triple = "x86_64-pc-windows-msvc"
+
+declare void @may_throw()
+declare void @dtor()
+declare i32 @__CxxFrameHandler3(...)
+
+; CHECK-LABEL: define void @cleanup()
+; CHECK: call i32 (ptr, ...) @printf(
+; CHECK-NEXT: ret void
+; CHECK: [[PAD:%.+]] = cleanuppad within none []
+; CHECK-NEXT: invoke void @dtor() [ "funclet"(token [[PAD]]) ]
+; CHECK-NEXT: to label %{{.+}} unwind label %func_exit_cleanup
+; CHECK: cleanupret from [[PAD]] unwind label %func_exit_cleanup
+; CHECK: func_exit_cleanup:
+; CHECK-NEXT: [[EXIT_PAD:%.+]] = cleanuppad within none []
+; CHECK-NEXT: call i32 (ptr, ...) @printf({{.*}}) [ "funclet"(token [[EXIT_PAD]]) ]
+; CHECK-NEXT: cleanupret from [[EXIT_PAD]] unwind to caller
+define void @cleanup() personality ptr @__CxxFrameHandler3 {
+entry:
+  invoke void @may_throw()
+          to label %done unwind label %ehcleanup
+
+done:
+  ret void
+
+ehcleanup:
+  %pad = cleanuppad within none []
+  call void @dtor() [ "funclet"(token %pad) ]
+  cleanupret from %pad unwind to caller
+}
+
+; CHECK-LABEL: define void @catch()
+; CHECK: %cs = catchswitch within none [label %handler] unwind label %func_exit_cleanup
+; CHECK: %cp = catchpad within %cs
+; CHECK-NEXT: invoke void @may_throw() [ "funclet"(token %cp) ]
+; CHECK-NEXT: to label %{{.+}} unwind label %func_exit_cleanup
+; CHECK: invoke void @may_throw()
+; CHECK-NEXT: to label %{{.+}} unwind label %func_exit_cleanup
+; CHECK: call i32 (ptr, ...) @printf(
+; CHECK-NEXT: ret void
+; CHECK: func_exit_cleanup:
+; CHECK-NEXT: [[EXIT_PAD:%.+]] = cleanuppad within none []
+; CHECK-NEXT: call i32 (ptr, ...) @printf({{.*}}) [ "funclet"(token [[EXIT_PAD]]) ]
+; CHECK-NEXT: cleanupret from [[EXIT_PAD]] unwind to caller
+define void @catch() personality ptr @__CxxFrameHandler3 {
+entry:
+  invoke void @may_throw()
+          to label %done unwind label %dispatch
+
+dispatch:
+  %cs = catchswitch within none [label %handler] unwind to caller
+
+handler:
+  %cp = catchpad within %cs [ptr null, i32 64, ptr null]
+  call void @may_throw() [ "funclet"(token %cp) ]
+  catchret from %cp to label %done
+
+done:
+  call void @may_throw()
+  ret void
+}
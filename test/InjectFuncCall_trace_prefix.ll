@@ -0,0 +1,25 @@
+; Checks that the trace prefix (header, function-name table and argument-kind
+; table) is written without padding. Here, the name table is "main\0" (5
+; bytes), so the chunks start at an offset that's not a multiple of 4.
+
+; RUN: opt -load-pass-plugin %shlibdir/libInjectFuncCall%shlibext -passes="inject-func-call<trace>" %s -o %t.bin
+; RUN: env LLVM_TUTOR_TRACE_OUTPUT=%t.trace lli %t.bin
+; RUN: trace-dump %t.trace | FileCheck %s
+
+; RUN: opt -load-pass-plugin %shlibdir/libInjectFuncCall%shlibext -passes="inject-func-call<trace;args=1>" %s -o %t.args.bin
+; RUN: env LLVM_TUTOR_TRACE_OUTPUT=%t.args.trace lli %t.args.bin
+; RUN: trace-dump %t.args.trace | FileCheck %s --check-prefix=ARGS
+
+; CHECK: Thread 0 (1 events)
+; CHECK-NEXT: TIMESTAMP
+; CHECK-NEXT: ---
+; CHECK-NEXT: {{^[0-9]+ +main +2$}}
+
+; ARGS: Thread 0 (1 events)
+; ARGS-NEXT: TIMESTAMP
+; ARGS-NEXT: ---
+; ARGS-NEXT: {{^[0-9]+ +main +2 +1$}}
+
+define i32 @main(i32 %argc, ptr %argv) {
+  ret i32 0
+}
@@ -56,6 +56,10 @@ llvm_config.add_tool_substitutions(tool_substitutions)
 tools = ["opt", "lli", "not", "FileCheck", "clang"]
 llvm_config.add_tool_substitutions(tools, config.llvm_tools_dir)
 
+# The tools built by this project (i.e. <build_dir>/bin)
+lt_tools = ["trace-dump"]
+llvm_config.add_tool_substitutions(lt_tools, config.lt_tools_dir)
+
 # The LIT variable to hold the file extension for shared libraries (this is
 # platform dependent)
 config.substitutions.append(('%shlibext', config.llvm_shlib_ext))
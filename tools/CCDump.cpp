@@ -0,0 +1,193 @@
+//========================================================================
+// FILE:
+//    CCDump.cpp
+//
+// DESCRIPTION:
+//    A command-line tool that prints the binary record written by modules
+//    instrumented with `dynamic-cc<format=bin>` (see DynamicCCRecord.h). The
+//    record is printed either as the table that DynamicCallCounter prints in
+//    the text mode or as JSON.
+//
+//    It also reads the live record of a process instrumented with
+//    `dynamic-cc<shm>`. Every invocation takes a snapshot of the counters
+//    without stopping (or otherwise interacting with) that process.
+//
+// USAGE:
+//    # First, instrument and run the input module:
+//      opt -load-pass-plugin <BUILD_DIR>/lib/libDynamicCallCounter.so `\`
+//        -passes="dynamic-cc<format=bin>" <input-llvm-file> -o instrumented.bin
+//      LLVM_TUTOR_CC_OUTPUT=counts.bin lli instrumented.bin
+//    # Now you can run this tool as follows:
+//      <BUILD/DIR>/bin/cc-dump counts.bin
+//      <BUILD/DIR>/bin/cc-dump --json counts.bin
+//    # or, for a running process:
+//      opt -load-pass-plugin <BUILD_DIR>/lib/libDynamicCallCounter.so `\`
+//        -passes="dynamic-cc<shm>" <input-llvm-file> -o instrumented.bin
+//      LLVM_TUTOR_CC_SHM=/dev/shm/counts lli instrumented.bin &
+//      <BUILD/DIR>/bin/cc-dump /dev/shm/counts
+//
+// License: MIT
+//========================================================================
+#include "DynamicCCRecord.h"
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <cstring>
+#include <vector>
+
+using namespace llvm;
+
+//===----------------------------------------------------------------------===//
+// Command line options
+//===----------------------------------------------------------------------===//
+static cl::OptionCategory CCDumpCategory{"cc-dump options"};
+
+static cl::opt<std::string> InputRecord{cl::Positional,
+                                        cl::desc{"<Record to print>"},
+                                        cl::value_desc{"filename"},
+                                        cl::init(""),
+                                        cl::Required,
+                                        cl::cat{CCDumpCategory}};
+
+static cl::opt<bool> PrintJSON{"json", cl::desc{"Print the record as JSON"},
+                               cl::init(false), cl::cat{CCDumpCategory}};
+
+//===----------------------------------------------------------------------===//
+// cc-dump - implementation
+//===----------------------------------------------------------------------===//
+struct FunctionCount {
+  StringRef Name;
+  uint64_t Count;
+};
+
+// Parses the record in Buffer and sums up the shards of every counter.
+static Expected<std::vector<FunctionCount>> readRecord(StringRef Buffer) {
+  auto Malformed = [](const Twine &Msg) {
+    return make_error<StringError>("malformed record: " + Msg,
+                                   inconvertibleErrorCode());
+  };
+
+  DynamicCCRecordHeader Header;
+  if (Buffer.size() < sizeof(Header))
+    return Malformed("truncated header");
+  std::memcpy(&Header, Buffer.data(), sizeof(Header));
+
+  if (Header.Magic != DynamicCCRecordHeader::MagicValue) {
+    if (Header.Magic == sys::getSwappedBytes(DynamicCCRecordHeader::MagicValue))
+      return Malformed("the record was written on a machine with different "
+                       "endianness");
+    return Malformed("bad magic");
+  }
+  if (Header.Version != DynamicCCRecordHeader::CurrentVersion)
+    return Malformed("unsupported version " + Twine(Header.Version));
+  if (Header.CounterBytes != 4 && Header.CounterBytes != 8)
+    return Malformed("unsupported counter size " + Twine(Header.CounterBytes));
+  if (Header.StrideBytes < Header.CounterBytes)
+    return Malformed("stride smaller than a counter");
+
+  uint64_t NamesEnd = sizeof(Header) + uint64_t(Header.NamesSize);
+  uint64_t CountersEnd = uint64_t(Header.CountersOffset) +
+                         uint64_t(Header.NumShards) * Header.NumFuncs *
+                             Header.StrideBytes;
+  if (NamesEnd > Header.CountersOffset || CountersEnd > Buffer.size())
+    return Malformed("truncated record");
+
+  std::vector<FunctionCount> Counts;
+  Counts.reserve(Header.NumFuncs);
+
+  StringRef Names = Buffer.slice(sizeof(Header), NamesEnd);
+  for (uint32_t ID = 0; ID < Header.NumFuncs; ID++) {
+    size_t Len = Names.find('\0');
+    if (Len == StringRef::npos)
+      return Malformed("truncated function-name table");
+    Counts.push_back({Names.take_front(Len), 0});
+    Names = Names.drop_front(Len + 1);
+  }
+
+  const char *Counters = Buffer.data() + Header.CountersOffset;
+  uint64_t ShardBytes = uint64_t(Header.NumFuncs) * Header.StrideBytes;
+  for (uint32_t Shard = 0; Shard < Header.NumShards; Shard++) {
+    for (uint32_t ID = 0; ID < Header.NumFuncs; ID++) {
+      const char *Counter =
+          Counters + Shard * ShardBytes + uint64_t(ID) * Header.StrideBytes;
+      Counts[ID].Count +=
+          (Header.CounterBytes == 8)
+              ? support::endian::read64(Counter, endianness::native)
+              : support::endian::read32(Counter, endianness::native);
+    }
+  }
+
+  return Counts;
+}
+
+static void printTable(raw_ostream &OutS, ArrayRef<FunctionCount> Counts) {
+  OutS << "=================================================\n";
+  OutS << "LLVM-TUTOR: dynamic analysis results\n";
+  OutS << "=================================================\n";
+  OutS << "NAME                 #N DIRECT CALLS\n";
+  OutS << "-------------------------------------------------\n";
+  for (const FunctionCount &FC : Counts)
+    OutS << format("%-20s %-10llu\n", FC.Name.str().c_str(),
+                   static_cast<unsigned long long>(FC.Count));
+}
+
+static void printJSON(raw_ostream &OutS, ArrayRef<FunctionCount> Counts) {
+  json::OStream JOS(OutS, /*IndentSize=*/2);
+  JOS.array([&] {
+    for (const FunctionCount &FC : Counts)
+      JOS.object([&] {
+        JOS.attribute("name", FC.Name);
+        JOS.attribute("calls", json::Value(FC.Count));
+      });
+  });
+  OutS << "\n";
+}
+
+//===----------------------------------------------------------------------===//
+// Main driver code.
+//===----------------------------------------------------------------------===//
+int main(int Argc, char **Argv) {
+  // Hide all options apart from the ones specific to this tool
+  cl::HideUnrelatedOptions(CCDumpCategory);
+
+  cl::ParseCommandLineOptions(Argc, Argv,
+                              "Prints the binary record written by modules "
+                              "instrumented with dynamic-cc<format=bin>\n");
+
+  // Makes sure llvm_shutdown() is called (which cleans up LLVM objects)
+  //  http://llvm.org/docs/ProgrammersManual.html#ending-execution-with-llvm-shutdown
+  llvm_shutdown_obj SDO;
+
+  // The record may be updated by a running process while it's being read, so
+  // copy it (IsVolatile) rather than map it. Counters are naturally aligned,
+  // so every individual counter is read consistently.
+  auto BufferOrErr = MemoryBuffer::getFile(InputRecord, /*IsText=*/false,
+                                           /*RequiresNullTerminator=*/false,
+                                           /*IsVolatile=*/true);
+  if (!BufferOrErr) {
+    errs() << "Error reading record: " << InputRecord << ": "
+           << BufferOrErr.getError().message() << "\n";
+    return -1;
+  }
+
+  auto CountsOrErr = readRecord((*BufferOrErr)->getBuffer());
+  if (!CountsOrErr) {
+    errs() << InputRecord << ": " << toString(CountsOrErr.takeError()) << "\n";
+    return -1;
+  }
+
+  if (PrintJSON)
+    printJSON(outs(), *CountsOrErr);
+  else
+    printTable(outs(), *CountsOrErr);
+
+  return 0;
+}
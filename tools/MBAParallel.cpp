@@ -0,0 +1,317 @@
+//========================================================================
+// FILE:
+//    MBAParallel.cpp
+//
+// DESCRIPTION:
+//    A command-line tool that runs a pipeline of the MBA passes (mba,
+//    mba-sub, mba-add and mba-add-16) on the input LLVM file, processing
+//    functions in parallel. The output is identical for any number of threads.
+//
+//    All functions of a module share one LLVMContext, which is not thread
+//    safe. This tool relies on the following to rewrite functions
+//    concurrently anyway:
+//      * Workers only emit the MBA expressions (emitReplacement, see
+//        MBARewrite.h), they don't replace or erase anything. The new
+//        instructions are unnamed and use IRBuilder<NoFolder>, so no
+//        constant expressions are created.
+//      * Constants are obtained through a per-worker cache backed by a
+//        mutex-protected ConstantInt::get. ConstantData (integers, undef,
+//        poison) has no use lists, so using it from several threads is
+//        fine.
+//      * Functions in which an add/sub takes any other constant (e.g. a
+//        global variable or a constant expression) as an operand, or
+//        operates on vectors whose splats are not ConstantData, would add
+//        uses to a shared use list. The latter are scalable vectors (splats
+//        are constant expressions) and fixed-width vectors of integers that
+//        are not 8, 16, 32 or 64 bits wide, e.g. <4 x i1> or <2 x i128>
+//        (splats are ConstantVectors). These functions are rewritten on the
+//        main thread, after the workers are done.
+//      * Replacing the original instructions (RAUW, taking over the name,
+//        erasing) is done serially, in a fixed order.
+//
+// USAGE:
+//    # First, generate an LLVM file:
+//      clang -emit-llvm <input-file> -c -o <input-llvm-file>
+//    # Now you can run this tool as follows:
+//      <BUILD/DIR>/bin/mba-parallel --passes=mba-sub,mba-add -j 8 \
+//        <input-llvm-file> -o <output-llvm-file>
+//
+// License: MIT
+//========================================================================
+#include "MBA.h"
+#include "MBAAdd.h"
+#include "MBAAddInt16.h"
+#include "MBASub.h"
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/StringSwitch.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/NoFolder.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <atomic>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+using namespace llvm;
+
+//===----------------------------------------------------------------------===//
+// Command line options
+//===----------------------------------------------------------------------===//
+static cl::OptionCategory MBAParallelCategory{"mba-parallel options"};
+
+static cl::opt<std::string> InputModule{cl::Positional,
+                                        cl::desc{"<Module to obfuscate>"},
+                                        cl::value_desc{"bitcode filename"},
+                                        cl::init(""),
+                                        cl::Required,
+                                        cl::cat{MBAParallelCategory}};
+
+static cl::list<std::string>
+    Passes{"passes",
+           cl::desc{"The MBA passes to run, in order (mba, mba-sub, "
+                    "mba-add, mba-add-16)"},
+           cl::CommaSeparated, cl::OneOrMore, cl::cat{MBAParallelCategory}};
+
+static cl::opt<unsigned> Jobs{
+    "j", cl::desc{"The number of worker threads (0 means all cores)"},
+    cl::init(0), cl::cat{MBAParallelCategory}};
+
+static cl::opt<std::string> OutputFilename{"o", cl::desc{"Output filename"},
+                                           cl::value_desc{"filename"},
+                                           cl::init("-"),
+                                           cl::cat{MBAParallelCategory}};
+
+static cl::opt<bool> OutputAssembly{
+    "S", cl::desc{"Write the output as LLVM assembly"}, cl::init(false),
+    cl::cat{MBAParallelCategory}};
+
+//===----------------------------------------------------------------------===//
+// mba-parallel - implementation
+//===----------------------------------------------------------------------===//
+namespace {
+// One MBA pass, see MBARewrite.h
+struct MBARewriter {
+  bool (*IsCandidate)(const Instruction &);
+  Value *(*EmitReplacement)(IRBuilderBase &, BinaryOperator &,
+                            MBAConstantFn);
+};
+
+// The original instruction and the expression that replaces it
+using MBAReplacement = std::pair<BinaryOperator *, Value *>;
+
+// Hands out integer constants to the workers. ConstantInt::get modifies the
+// LLVMContext, hence the lock. The cache (one per worker) makes sure that
+// the lock is taken once per distinct constant.
+class MBAConstantPool {
+public:
+  explicit MBAConstantPool(std::mutex &ContextMutex)
+      : ContextMutex(&ContextMutex) {}
+
+  Constant *get(Type *Ty, uint64_t V) {
+    Constant *&C = Cache[{Ty, V}];
+    if (!C) {
+      std::lock_guard<std::mutex> Lock(*ContextMutex);
+      C = ConstantInt::get(Ty, getMBAConstantValue(Ty, V));
+    }
+    return C;
+  }
+
+private:
+  std::mutex *ContextMutex;
+  DenseMap<std::pair<Type *, uint64_t>, Constant *> Cache;
+};
+} // namespace
+
+// Returns true if F can be rewritten on a worker thread, i.e. if the MBA
+// expressions emitted for F only use constants without use lists.
+static bool isSafeToRewriteInParallel(const Function &F) {
+  for (const BasicBlock &BB : F)
+    for (const Instruction &Inst : BB) {
+      if (Inst.getOpcode() != Instruction::Add &&
+          Inst.getOpcode() != Instruction::Sub)
+        continue;
+      // Splats of scalable vectors are constant expressions. Splats of other
+      // vectors are ConstantDataVectors only if the element type fits
+      // ConstantDataSequential, otherwise they are ConstantVectors.
+      if (isa<ScalableVectorType>(Inst.getType()))
+        return false;
+      if (auto *VecTy = dyn_cast<FixedVectorType>(Inst.getType()))
+        if (!ConstantDataSequential::isElementTypeCompatible(
+                VecTy->getElementType()))
+          return false;
+      for (const Value *Op : Inst.operands())
+        if (isa<Constant>(Op) && !isa<ConstantData>(Op))
+          return false;
+    }
+  return true;
+}
+
+// Emits the MBA expressions for all candidates in F, one pass after the
+// other, and returns the replacements in the order in which they have to be
+// applied. F itself is not modified, apart from the new instructions.
+static std::vector<MBAReplacement>
+emitReplacements(Function &F, ArrayRef<MBARewriter> Pipeline,
+                 MBAConstantFn GetConstant) {
+  std::vector<MBAReplacement> Replacements;
+  // The original instructions are only erased in applyReplacements, skip
+  // the ones that have already been replaced
+  SmallPtrSet<Instruction *, 32> Replaced;
+
+  for (const MBARewriter &Pass : Pipeline) {
+    // STEP 1: Collect the candidates (before emitting anything, as emitted
+    // instructions are only visible to the next pass)
+    std::vector<BinaryOperator *> Candidates;
+    for (BasicBlock &BB : F)
+      for (Instruction &Inst : BB)
+        if (!Replaced.count(&Inst) && Pass.IsCandidate(Inst))
+          Candidates.push_back(cast<BinaryOperator>(&Inst));
+
+    // STEP 2: Emit the replacements right before the original instructions
+    for (BinaryOperator *BinOp : Candidates) {
+      IRBuilder<NoFolder> Builder(BinOp);
+      Replacements.emplace_back(
+          BinOp, Pass.EmitReplacement(Builder, *BinOp, GetConstant));
+      Replaced.insert(BinOp);
+    }
+  }
+
+  return Replacements;
+}
+
+// Replaces the original instructions. A value replaced by a later pass is
+// itself replaced after it has taken over the uses of the original
+// instruction, so chains are resolved correctly.
+static unsigned applyReplacements(ArrayRef<MBAReplacement> Replacements) {
+  for (const MBAReplacement &R : Replacements)
+    replaceWithMBA(*R.first, R.second);
+  return Replacements.size();
+}
+
+static unsigned runMBAPipeline(Module &M, ArrayRef<MBARewriter> Pipeline) {
+  // STEP 1: Split the functions into the ones rewritten by the workers and
+  // the ones rewritten on the main thread
+  std::vector<Function *> Funcs;
+  std::vector<Function *> SerialFuncs;
+  for (Function &F : M) {
+    if (F.isDeclaration())
+      continue;
+    (isSafeToRewriteInParallel(F) ? Funcs : SerialFuncs).push_back(&F);
+  }
+
+  // STEP 2: Emit the replacements. Every worker pulls the next function from
+  // a shared index and stores the result in that function's slot, so that
+  // the results don't depend on the scheduling.
+  std::mutex ContextMutex;
+  std::vector<std::vector<MBAReplacement>> Replacements(Funcs.size());
+  std::atomic<size_t> NextFunc{0};
+
+  DefaultThreadPool Pool(hardware_concurrency(Jobs));
+  for (unsigned I = 0, E = Pool.getMaxConcurrency(); I < E; ++I)
+    Pool.async([&] {
+      MBAConstantPool Constants(ContextMutex);
+      auto GetConstant = [&Constants](Type *Ty, uint64_t V) {
+        return Constants.get(Ty, V);
+      };
+      for (size_t Idx = NextFunc++; Idx < Funcs.size(); Idx = NextFunc++)
+        Replacements[Idx] = emitReplacements(*Funcs[Idx], Pipeline,
+                                             GetConstant);
+    });
+  Pool.wait();
+
+  // STEP 3: Apply the replacements, in the order of the functions in M
+  unsigned NumReplaced = 0;
+  for (const std::vector<MBAReplacement> &FuncReplacements : Replacements)
+    NumReplaced += applyReplacements(FuncReplacements);
+
+  // STEP 4: Rewrite the remaining functions
+  for (Function *F : SerialFuncs)
+    NumReplaced +=
+        applyReplacements(emitReplacements(*F, Pipeline, getMBAConstant));
+
+  return NumReplaced;
+}
+
+//===----------------------------------------------------------------------===//
+// Main driver code.
+//===----------------------------------------------------------------------===//
+int main(int Argc, char **Argv) {
+  // Hide all options apart from the ones specific to this tool
+  cl::HideUnrelatedOptions(MBAParallelCategory);
+
+  cl::ParseCommandLineOptions(Argc, Argv,
+                              "Obfuscates integer add and sub instructions "
+                              "in the input IR file, one function per "
+                              "thread\n");
+
+  // Makes sure llvm_shutdown() is called (which cleans up LLVM objects)
+  //  http://llvm.org/docs/ProgrammersManual.html#ending-execution-with-llvm-shutdown
+  llvm_shutdown_obj SDO;
+
+  // Translate the pass names
+  std::vector<MBARewriter> Pipeline;
+  for (const std::string &Name : Passes) {
+    auto Pass = StringSwitch<MBARewriter>(Name)
+                    .Case("mba", {&MBA::isCandidate, &MBA::emitReplacement})
+                    .Case("mba-sub", {&MBASub::isCandidate,
+                                      &MBASub::emitReplacement})
+                    .Case("mba-add", {&MBAAdd::isCandidate,
+                                      &MBAAdd::emitReplacement})
+                    .Case("mba-add-16", {&MBAAddInt16::isCandidate,
+                                         &MBAAddInt16::emitReplacement})
+                    .Default({nullptr, nullptr});
+    if (!Pass.IsCandidate) {
+      errs() << "Unknown MBA pass: " << Name
+             << " (expected mba, mba-sub, mba-add or mba-add-16)\n";
+      return -1;
+    }
+    Pipeline.push_back(Pass);
+  }
+
+  // Parse the IR file passed on the command line.
+  SMDiagnostic Err;
+  LLVMContext Ctx;
+  std::unique_ptr<Module> M = parseIRFile(InputModule.getValue(), Err, Ctx);
+
+  if (!M) {
+    errs() << "Error reading bitcode file: " << InputModule << "\n";
+    Err.print(Argv[0], errs());
+    return -1;
+  }
+
+  unsigned NumReplaced = runMBAPipeline(*M, Pipeline);
+
+  if (verifyModule(*M, &errs())) {
+    errs() << "Error: the obfuscated module is broken\n";
+    return -1;
+  }
+
+  std::error_code EC;
+  ToolOutputFile Out(OutputFilename, EC,
+                     OutputAssembly ? sys::fs::OF_Text : sys::fs::OF_None);
+  if (EC) {
+    errs() << "Error opening " << OutputFilename << ": " << EC.message()
+           << "\n";
+    return -1;
+  }
+
+  if (OutputAssembly)
+    M->print(Out.os(), nullptr);
+  else
+    WriteBitcodeToFile(*M, Out.os());
+  Out.keep();
+
+  errs() << "mba-parallel: replaced " << NumReplaced << " instructions\n";
+  return 0;
+}
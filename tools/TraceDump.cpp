@@ -0,0 +1,323 @@
+//========================================================================
+// FILE:
+//    TraceDump.cpp
+//
+// DESCRIPTION:
+//    A command-line tool that prints the binary trace written by modules
+//    instrumented with `inject-func-call<trace>` (see FuncTraceRecord.h).
+//    The events of every thread are printed oldest first, either as a table
+//    or as JSON. Captured argument values (`inject-func-call<trace;args=K>`)
+//    are printed according to their types.
+//
+// USAGE:
+//    # First, instrument and run the input module:
+//      opt -load-pass-plugin <BUILD_DIR>/lib/libInjectFuncCall.so `\`
+//        -passes="inject-func-call<trace>" <input-llvm-file> -o instrumented.bin
+//      LLVM_TUTOR_TRACE_OUTPUT=trace.bin lli instrumented.bin
+//    # Now you can run this tool as follows:
+//      <BUILD/DIR>/bin/trace-dump trace.bin
+//      <BUILD/DIR>/bin/trace-dump --json trace.bin
+//
+// License: MIT
+//========================================================================
+#include "FuncTraceRecord.h"
+
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/bit.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/SwapByteOrder.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <cstring>
+#include <utility>
+#include <vector>
+
+using namespace llvm;
+
+//===----------------------------------------------------------------------===//
+// Command line options
+//===----------------------------------------------------------------------===//
+static cl::OptionCategory TraceDumpCategory{"trace-dump options"};
+
+static cl::opt<std::string> InputTrace{cl::Positional,
+                                       cl::desc{"<Trace to print>"},
+                                       cl::value_desc{"filename"},
+                                       cl::init(""),
+                                       cl::Required,
+                                       cl::cat{TraceDumpCategory}};
+
+static cl::opt<bool> PrintJSON{"json", cl::desc{"Print the trace as JSON"},
+                               cl::init(false), cl::cat{TraceDumpCategory}};
+
+//===----------------------------------------------------------------------===//
+// trace-dump - implementation
+//===----------------------------------------------------------------------===//
+struct ThreadTrace {
+  uint32_t ThreadIndex;
+  // The number of events that were overwritten before the trace was written
+  uint64_t Dropped;
+  // Oldest first
+  std::vector<FuncTraceEvent> Events;
+  // The argument values of Events[I] are Args[I * ArgsPerEvent] onwards
+  std::vector<uint64_t> Args;
+};
+
+struct Trace {
+  bool TimestampsAreCycles;
+  uint32_t ArgsPerEvent;
+  std::vector<StringRef> FuncNames;
+  // The kinds of the arguments of function ID are ArgKinds[ID * ArgsPerEvent]
+  // onwards
+  std::vector<FuncTraceArgKind> ArgKinds;
+  std::vector<ThreadTrace> Threads;
+};
+
+// Parses the trace in Buffer and puts the events of every thread in order.
+static Expected<Trace> readTrace(StringRef Buffer) {
+  auto Malformed = [](const Twine &Msg) {
+    return make_error<StringError>("malformed trace: " + Msg,
+                                   inconvertibleErrorCode());
+  };
+
+  FuncTraceHeader Header;
+  if (Buffer.size() < sizeof(Header))
+    return Malformed("truncated header");
+  std::memcpy(&Header, Buffer.data(), sizeof(Header));
+
+  if (Header.Magic != FuncTraceHeader::MagicValue) {
+    if (Header.Magic == sys::getSwappedBytes(FuncTraceHeader::MagicValue))
+      return Malformed("the trace was written on a machine with different "
+                       "endianness");
+    return Malformed("bad magic");
+  }
+  if (Header.Version != FuncTraceHeader::CurrentVersion)
+    return Malformed("unsupported version " + Twine(Header.Version));
+
+  if (Header.ArgsPerEvent > FuncTraceMaxArgsPerEvent)
+    return Malformed("too many arguments per event");
+
+  uint64_t NamesEnd = sizeof(Header) + uint64_t(Header.NamesSize);
+  if (NamesEnd > Buffer.size())
+    return Malformed("truncated function-name table");
+  uint64_t ArgKindsEnd =
+      NamesEnd + uint64_t(Header.NumFuncs) * Header.ArgsPerEvent;
+  if (ArgKindsEnd > Buffer.size())
+    return Malformed("truncated argument-kind table");
+
+  Trace Result;
+  Result.TimestampsAreCycles =
+      Header.ClockKind == FuncTraceHeader::ClockCycles;
+  Result.ArgsPerEvent = Header.ArgsPerEvent;
+
+  StringRef Names = Buffer.slice(sizeof(Header), NamesEnd);
+  for (uint32_t ID = 0; ID < Header.NumFuncs; ID++) {
+    size_t Len = Names.find('\0');
+    if (Len == StringRef::npos)
+      return Malformed("truncated function-name table");
+    Result.FuncNames.push_back(Names.take_front(Len));
+    Names = Names.drop_front(Len + 1);
+  }
+
+  for (char Kind : Buffer.slice(NamesEnd, ArgKindsEnd)) {
+    if (static_cast<uint8_t>(Kind) >
+        static_cast<uint8_t>(FuncTraceArgKind::Float))
+      return Malformed("unknown argument kind");
+    Result.ArgKinds.push_back(static_cast<FuncTraceArgKind>(Kind));
+  }
+
+  const uint64_t EventSize =
+      sizeof(FuncTraceEvent) + Header.ArgsPerEvent * sizeof(uint64_t);
+  StringRef Chunks = Buffer.drop_front(ArgKindsEnd);
+  while (!Chunks.empty()) {
+    FuncTraceChunkHeader Chunk;
+    if (Chunks.size() < sizeof(Chunk))
+      return Malformed("truncated chunk header");
+    std::memcpy(&Chunk, Chunks.data(), sizeof(Chunk));
+    Chunks = Chunks.drop_front(sizeof(Chunk));
+
+    uint64_t EventsSize = uint64_t(Chunk.NumEvents) * EventSize;
+    if (Chunk.NumEvents > Header.EventsPerThread ||
+        Chunk.NumEvents > Chunk.Head)
+      return Malformed("inconsistent chunk header");
+    if (Chunks.size() < EventsSize)
+      return Malformed("truncated chunk");
+
+    ThreadTrace Thread;
+    Thread.ThreadIndex = Chunk.ThreadIndex;
+    Thread.Dropped = Chunk.Head - Chunk.NumEvents;
+    Thread.Events.resize(Chunk.NumEvents);
+    Thread.Args.resize(uint64_t(Chunk.NumEvents) * Header.ArgsPerEvent);
+    if (Chunk.NumEvents) {
+      // Rotate the ring buffer so that the oldest event comes first
+      uint64_t Oldest =
+          (Chunk.Head > Chunk.NumEvents) ? Chunk.Head % Chunk.NumEvents : 0;
+      for (uint32_t I = 0; I < Chunk.NumEvents; I++) {
+        const char *Event =
+            Chunks.data() + ((Oldest + I) % Chunk.NumEvents) * EventSize;
+        std::memcpy(&Thread.Events[I], Event, sizeof(FuncTraceEvent));
+        if (Header.ArgsPerEvent)
+          std::memcpy(&Thread.Args[uint64_t(I) * Header.ArgsPerEvent],
+                      Event + sizeof(FuncTraceEvent),
+                      Header.ArgsPerEvent * sizeof(uint64_t));
+      }
+    }
+    for (const FuncTraceEvent &Event : Thread.Events)
+      if (Event.FuncID >= Header.NumFuncs)
+        return Malformed("function ID out of range");
+
+    Result.Threads.push_back(std::move(Thread));
+    Chunks = Chunks.drop_front(EventsSize);
+  }
+
+  // Threads are listed in reverse order of creation in the file
+  llvm::sort(Result.Threads, [](const ThreadTrace &A, const ThreadTrace &B) {
+    return A.ThreadIndex < B.ThreadIndex;
+  });
+
+  return Result;
+}
+
+// Returns the captured arguments of Thread.Events[EventIdx] (of kinds other
+// than FuncTraceArgKind::None) as (kind, value) pairs
+static std::vector<std::pair<FuncTraceArgKind, uint64_t>>
+getEventArgs(const Trace &T, const ThreadTrace &Thread, size_t EventIdx) {
+  std::vector<std::pair<FuncTraceArgKind, uint64_t>> Args;
+  const FuncTraceEvent &Event = Thread.Events[EventIdx];
+  for (uint32_t I = 0; I < T.ArgsPerEvent; I++) {
+    FuncTraceArgKind Kind = T.ArgKinds[Event.FuncID * T.ArgsPerEvent + I];
+    if (Kind != FuncTraceArgKind::None)
+      Args.emplace_back(Kind, Thread.Args[EventIdx * T.ArgsPerEvent + I]);
+  }
+  return Args;
+}
+
+static void printArg(raw_ostream &OutS, FuncTraceArgKind Kind,
+                     uint64_t Value) {
+  switch (Kind) {
+  case FuncTraceArgKind::Int:
+    OutS << static_cast<int64_t>(Value);
+    break;
+  case FuncTraceArgKind::Pointer:
+    OutS << format_hex(Value, 2);
+    break;
+  case FuncTraceArgKind::Float:
+    OutS << format("%g", bit_cast<double>(Value));
+    break;
+  case FuncTraceArgKind::None:
+    OutS << "?";
+    break;
+  }
+}
+
+static void printTable(raw_ostream &OutS, const Trace &T) {
+  OutS << "=================================================\n";
+  OutS << "LLVM-TUTOR: function trace\n";
+  OutS << "=================================================\n";
+  for (const ThreadTrace &Thread : T.Threads) {
+    OutS << "Thread " << Thread.ThreadIndex << " (" << Thread.Events.size()
+         << " events";
+    if (Thread.Dropped)
+      OutS << ", " << Thread.Dropped << " older events overwritten";
+    OutS << ")\n";
+    OutS << (T.TimestampsAreCycles ? "TIMESTAMP (CYCLES)   "
+                                   : "TIMESTAMP (NS)       ")
+         << "NAME                 #N ARGS"
+         << (T.ArgsPerEvent ? "  ARGS\n" : "\n");
+    OutS << "-------------------------------------------------\n";
+    for (auto [Idx, Event] : enumerate(Thread.Events)) {
+      // The argument values (if any) go into an extra column
+      OutS << format(T.ArgsPerEvent ? "%-20llu %-20s %-9u" : "%-20llu %-20s %u",
+                     static_cast<unsigned long long>(Event.Timestamp),
+                     T.FuncNames[Event.FuncID].str().c_str(), Event.NumArgs);
+      ListSeparator LS(", ");
+      for (auto [Kind, Value] : getEventArgs(T, Thread, Idx)) {
+        OutS << LS;
+        printArg(OutS, Kind, Value);
+      }
+      OutS << "\n";
+    }
+    OutS << "\n";
+  }
+}
+
+static void printJSON(raw_ostream &OutS, const Trace &T) {
+  json::OStream JOS(OutS, /*IndentSize=*/2);
+  JOS.object([&] {
+    JOS.attribute("clock", T.TimestampsAreCycles ? "cycles" : "ns");
+    JOS.attributeArray("threads", [&] {
+      for (const ThreadTrace &Thread : T.Threads)
+        JOS.object([&] {
+          JOS.attribute("thread", static_cast<int64_t>(Thread.ThreadIndex));
+          JOS.attribute("dropped", static_cast<int64_t>(Thread.Dropped));
+          JOS.attributeArray("events", [&] {
+            for (auto [Idx, Event] : enumerate(Thread.Events))
+              JOS.object([&] {
+                JOS.attribute("timestamp",
+                              static_cast<int64_t>(Event.Timestamp));
+                JOS.attribute("name", T.FuncNames[Event.FuncID]);
+                JOS.attribute("args", static_cast<int64_t>(Event.NumArgs));
+                if (!T.ArgsPerEvent)
+                  return;
+                // Pointers are printed as hex strings, the other values as
+                // numbers
+                JOS.attributeArray("values", [&] {
+                  for (auto [Kind, Value] : getEventArgs(T, Thread, Idx)) {
+                    if (Kind == FuncTraceArgKind::Int)
+                      JOS.value(static_cast<int64_t>(Value));
+                    else if (Kind == FuncTraceArgKind::Float)
+                      JOS.value(bit_cast<double>(Value));
+                    else
+                      JOS.value("0x" + utohexstr(Value, /*LowerCase=*/true));
+                  }
+                });
+              });
+          });
+        });
+    });
+  });
+  OutS << "\n";
+}
+
+//===----------------------------------------------------------------------===//
+// Main driver code.
+//===----------------------------------------------------------------------===//
+int main(int Argc, char **Argv) {
+  // Hide all options apart from the ones specific to this tool
+  cl::HideUnrelatedOptions(TraceDumpCategory);
+
+  cl::ParseCommandLineOptions(Argc, Argv,
+                              "Prints the binary trace written by modules "
+                              "instrumented with inject-func-call<trace>\n");
+
+  // Makes sure llvm_shutdown() is called (which cleans up LLVM objects)
+  //  http://llvm.org/docs/ProgrammersManual.html#ending-execution-with-llvm-shutdown
+  llvm_shutdown_obj SDO;
+
+  auto BufferOrErr = MemoryBuffer::getFile(InputTrace, /*IsText=*/false,
+                                           /*RequiresNullTerminator=*/false);
+  if (!BufferOrErr) {
+    errs() << "Error reading trace: " << InputTrace << ": "
+           << BufferOrErr.getError().message() << "\n";
+    return -1;
+  }
+
+  auto TraceOrErr = readTrace((*BufferOrErr)->getBuffer());
+  if (!TraceOrErr) {
+    errs() << InputTrace << ": " << toString(TraceOrErr.takeError()) << "\n";
+    return -1;
+  }
+
+  if (PrintJSON)
+    printJSON(outs(), *TraceOrErr);
+  else
+    printTable(outs(), *TraceOrErr);
+
+  return 0;
+}